@@ -2,103 +2,262 @@
 #include "string.h"
 #include <stdio.h>
 #include <stdlib.h>
-#include <ctype.h>
 
-// Hash function based on key initial.
-// @param key Lowercase alphabetical string.
-// @return hash.
-// NOTE: This is not an ideal hash function, but is useful for test purposes of the project
-int hash(const char *key) {
-    int firstLetter = tolower(key[0]);
-    if (firstLetter >= 'a' && firstLetter <= 'z') {
-        return firstLetter - 'a';
-    } else if (firstLetter >= '0' && firstLetter <= '9') {
-        return firstLetter - '0';
+// Multiply-and-fold constants, as used by wyhash.
+#define HASH_P0 0xa0761d6478bd642fULL
+#define HASH_P1 0xe7037ed1a0b428dbULL
+#define HASH_P2 0x8ebc6af09c88c6e3ULL
+
+static uint64_t hash_mix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// wyhash-style hash over every byte of the key.
+uint64_t hash(const char *key) {
+    const unsigned char *p = (const unsigned char *)key;
+    size_t len = strlen(key);
+    uint64_t seed = HASH_P0 ^ hash_mix(len ^ HASH_P0, HASH_P1);
+    uint64_t a, b;
+
+    if (len <= 16) {
+        if (len >= 8) {
+            a = read64(p);
+            b = read64(p + len - 8);
+        } else if (len >= 4) {
+            a = read32(p);
+            b = read32(p + len - 4);
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        while (i > 16) {
+            seed = hash_mix(read64(p) ^ HASH_P1, read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
     }
-    return -1; // Invalid index for non-alphabetic or number strings
+    return hash_mix(HASH_P1 ^ len, hash_mix(a ^ HASH_P1, b ^ seed ^ HASH_P2));
+}
+
+size_t key_stripe(const char *key) {
+    return (size_t)(hash(key) & (TABLE_STRIPES - 1));
 }
 
+// Bucket of a hash inside a bucket array, using the bits above the stripe.
+static size_t bucket_index(uint64_t h, size_t size) {
+    return (size_t)(h >> STRIPE_BITS) & (size - 1);
+}
+
+// Moves up to REHASH_STEP buckets of a growing segment to its new array, and
+// installs the new array once every bucket was moved.
+static void rehash_step(Segment *segment) {
+    for (int step = 0; step < REHASH_STEP && segment->rehash_index < segment->size; step++) {
+        KeyNode *keyNode = segment->buckets[segment->rehash_index];
+        while (keyNode != NULL) {
+            KeyNode *next = keyNode->next;
+            size_t index = bucket_index(keyNode->hash, segment->rehash_size);
+            keyNode->next = segment->rehash_buckets[index];
+            segment->rehash_buckets[index] = keyNode;
+            keyNode = next;
+        }
+        segment->buckets[segment->rehash_index++] = NULL;
+    }
+
+    if (segment->rehash_index == segment->size) {
+        free(segment->buckets);
+        segment->buckets = segment->rehash_buckets;
+        segment->size = segment->rehash_size;
+        segment->rehash_buckets = NULL;
+        segment->rehash_size = 0;
+        segment->rehash_index = 0;
+    }
+}
+
+// Starts growing a segment once its load factor is exceeded. If the new array
+// cannot be allocated the segment simply keeps its current size.
+static void maybe_grow(Segment *segment) {
+    if (segment->rehash_buckets != NULL || segment->count <= segment->size * MAX_LOAD_FACTOR) {
+        return;
+    }
+    KeyNode **buckets = calloc(segment->size * 2, sizeof(KeyNode*));
+    if (buckets == NULL) {
+        return;
+    }
+    segment->rehash_buckets = buckets;
+    segment->rehash_size = segment->size * 2;
+    segment->rehash_index = 0;
+}
+
+// Gets the link that points to the node of a key, or NULL if it is not stored.
+static KeyNode **find_slot(Segment *segment, uint64_t h, const char *key) {
+    KeyNode **slot = &segment->buckets[bucket_index(h, segment->size)];
+    for (KeyNode **it = slot; *it != NULL; it = &(*it)->next) {
+        if ((*it)->hash == h && strcmp((*it)->key, key) == 0) {
+            return it;
+        }
+    }
+    if (segment->rehash_buckets != NULL) {
+        slot = &segment->rehash_buckets[bucket_index(h, segment->rehash_size)];
+        for (KeyNode **it = slot; *it != NULL; it = &(*it)->next) {
+            if ((*it)->hash == h && strcmp((*it)->key, key) == 0) {
+                return it;
+            }
+        }
+    }
+    return NULL;
+}
+
+static Segment *key_segment(HashTable *ht, uint64_t h) {
+    return &ht->segments[h & (TABLE_STRIPES - 1)];
+}
 
 struct HashTable* create_hash_table() {
   HashTable *ht = malloc(sizeof(HashTable));
   if (!ht) return NULL;
-  for (int i = 0; i < TABLE_SIZE; i++) {
-      ht->table[i] = NULL;
+  for (int i = 0; i < TABLE_STRIPES; i++) {
+      Segment *segment = &ht->segments[i];
+      segment->buckets = calloc(INITIAL_SEGMENT_SIZE, sizeof(KeyNode*));
+      if (segment->buckets == NULL) {
+          for (int j = 0; j < i; j++) {
+              free(ht->segments[j].buckets);
+          }
+          free(ht);
+          return NULL;
+      }
+      segment->size = INITIAL_SEGMENT_SIZE;
+      segment->rehash_buckets = NULL;
+      segment->rehash_size = 0;
+      segment->rehash_index = 0;
+      segment->count = 0;
   }
   return ht;
 }
 
 int write_pair(HashTable *ht, const char *key, const char *value) {
-    int index = hash(key);
+    uint64_t h = hash(key);
+    Segment *segment = key_segment(ht, h);
 
-    KeyNode *keyNode = ht->table[index];
+    if (segment->rehash_buckets != NULL) {
+        rehash_step(segment);
+    }
 
     // Search for the key node
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            free(keyNode->value);
-            keyNode->value = strdup(value);
-            return 0;
-        }
-        keyNode = keyNode->next; // Move to the next node
+    KeyNode **slot = find_slot(segment, h, key);
+    if (slot != NULL) {
+        KeyNode *keyNode = *slot;
+        free(keyNode->value);
+        keyNode->value = strdup(value);
+        return 0;
     }
 
     // Key not found, create a new key node
-    keyNode = malloc(sizeof(KeyNode));
+    KeyNode *keyNode = malloc(sizeof(KeyNode));
+    if (keyNode == NULL) {
+        return 1;
+    }
     keyNode->key = strdup(key); // Allocate memory for the key
     keyNode->value = strdup(value); // Allocate memory for the value
-    keyNode->next = ht->table[index]; // Link to existing nodes
-    ht->table[index] = keyNode; // Place new key node at the start of the list
+    keyNode->hash = h;
+
+    // New nodes go to the grown array while a segment is being rehashed
+    KeyNode **head;
+    if (segment->rehash_buckets != NULL) {
+        head = &segment->rehash_buckets[bucket_index(h, segment->rehash_size)];
+    } else {
+        head = &segment->buckets[bucket_index(h, segment->size)];
+    }
+    keyNode->next = *head; // Link to existing nodes
+    *head = keyNode; // Place new key node at the start of the list
+    segment->count++;
+
+    maybe_grow(segment);
     return 0;
 }
 
+static KeyNode *get_key_node(HashTable *ht, const char *key) {
+    uint64_t h = hash(key);
+    KeyNode **slot = find_slot(key_segment(ht, h), h, key);
+    return slot != NULL ? *slot : NULL;
+}
+
 char* read_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-    char* value;
-
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            value = strdup(keyNode->value);
-            return value; // Return copy of the value if found
-        }
-        keyNode = keyNode->next; // Move to the next node
+    KeyNode *keyNode = get_key_node(ht, key);
+    if (keyNode == NULL) {
+        return NULL; // Key not found
     }
-    return NULL; // Key not found
+    return strdup(keyNode->value); // Return copy of the value if found
 }
 
 int delete_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-    KeyNode *prevNode = NULL;
+    uint64_t h = hash(key);
+    Segment *segment = key_segment(ht, h);
+
+    if (segment->rehash_buckets != NULL) {
+        rehash_step(segment);
+    }
 
     // Search for the key node
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            // Key found; delete this node
-            if (prevNode == NULL) {
-                // Node to delete is the first node in the list
-                ht->table[index] = keyNode->next; // Update the table to point to the next node
-            } else {
-                // Node to delete is not the first; bypass it
-                prevNode->next = keyNode->next; // Link the previous node to the next node
-            }
-            // Free the memory allocated for the key and value
-            free(keyNode->key);
-            free(keyNode->value);
-            free(keyNode); // Free the key node itself
-            return 0; // Exit the function
+    KeyNode **slot = find_slot(segment, h, key);
+    if (slot == NULL) {
+        return 1;
+    }
+
+    // Key found; bypass it in its list
+    KeyNode *keyNode = *slot;
+    *slot = keyNode->next;
+    segment->count--;
+
+    // Free the memory allocated for the key and value
+    free(keyNode->key);
+    free(keyNode->value);
+    free(keyNode); // Free the key node itself
+    return 0;
+}
+
+void visit_nodes(HashTable *ht, size_t stripe, void (*visit)(KeyNode*, void*), void *arg) {
+    Segment *segment = &ht->segments[stripe];
+    for (size_t i = 0; i < segment->size; i++) {
+        for (KeyNode *keyNode = segment->buckets[i]; keyNode != NULL; keyNode = keyNode->next) {
+            visit(keyNode, arg);
+        }
+    }
+    for (size_t i = 0; i < segment->rehash_size; i++) {
+        for (KeyNode *keyNode = segment->rehash_buckets[i]; keyNode != NULL; keyNode = keyNode->next) {
+            visit(keyNode, arg);
         }
-        prevNode = keyNode; // Move prevNode to current node
-        keyNode = keyNode->next; // Move to the next node
     }
-    
-    return 1;
 }
 
-void free_table(HashTable *ht) {
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        KeyNode *keyNode = ht->table[i];
+size_t table_count(HashTable *ht) {
+    size_t count = 0;
+    for (int i = 0; i < TABLE_STRIPES; i++) {
+        count += ht->segments[i].count;
+    }
+    return count;
+}
+
+static void free_bucket_array(KeyNode **buckets, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        KeyNode *keyNode = buckets[i];
         while (keyNode != NULL) {
             KeyNode *temp = keyNode;
             keyNode = keyNode->next;
@@ -107,5 +266,14 @@ void free_table(HashTable *ht) {
             free(temp);
         }
     }
+    free(buckets);
+}
+
+void free_table(HashTable *ht) {
+    for (int i = 0; i < TABLE_STRIPES; i++) {
+        Segment *segment = &ht->segments[i];
+        free_bucket_array(segment->buckets, segment->size);
+        free_bucket_array(segment->rehash_buckets, segment->rehash_size);
+    }
     free(ht);
 }
\ No newline at end of file
@@ -1,24 +1,52 @@
 #ifndef KEY_VALUE_STORE_H
 #define KEY_VALUE_STORE_H
 
-#define TABLE_SIZE 26
+// number of table segments; each segment is guarded by its own lock stripe
+#define TABLE_STRIPES 64
+#define STRIPE_BITS 6
+// buckets of a segment when the table is created (power of two)
+#define INITIAL_SEGMENT_SIZE 8
+// average chain length that makes a segment start growing
+#define MAX_LOAD_FACTOR 2
+// buckets moved to the grown array by each write while a segment is growing
+#define REHASH_STEP 4
 
 #include <stddef.h>
+#include <stdint.h>
 
 typedef struct KeyNode {
     char *key;
     char *value;
+    // full hash of the key, kept to skip most string comparisons and rehashing
+    uint64_t hash;
     struct KeyNode *next;
 } KeyNode;
 
+/// Part of the table owned by a single lock stripe. A segment grows
+/// incrementally: while rehash_buckets is set, every write moves a few buckets
+/// from buckets into rehash_buckets, and lookups search both arrays.
+typedef struct Segment {
+    KeyNode **buckets;
+    size_t size;
+    KeyNode **rehash_buckets;
+    size_t rehash_size;
+    size_t rehash_index; // next bucket of buckets to be moved
+    size_t count;
+} Segment;
+
 typedef struct HashTable {
-    KeyNode *table[TABLE_SIZE];
+    Segment segments[TABLE_STRIPES];
 } HashTable;
 
-/// @brief Hashing function to transform the key of the pair into an index
+/// @brief Hashing function over the whole key
+/// @param key Key of the pair
+/// @return 64-bit hash of the key
+uint64_t hash(const char *key);
+
+/// @brief Gets the lock stripe (and table segment) that holds a key
 /// @param key Key of the pair
-/// @return Index of key to hash_table
-int hash(const char *key);
+/// @return Stripe index, lower than TABLE_STRIPES
+size_t key_stripe(const char *key);
 
 /// Creates a new event hash table.
 /// @return Newly created hash table, NULL on failure
@@ -47,5 +75,16 @@ int delete_pair(HashTable *ht, const char *key);
 /// @param ht Hash table to be deleted.
 void free_table(HashTable *ht);
 
+/// @brief Calls visit for every node stored in a stripe
+/// @param ht hashtable
+/// @param stripe stripe to walk, the caller must hold its lock
+/// @param visit function called with each node and arg
+/// @param arg argument passed to visit
+void visit_nodes(HashTable *ht, size_t stripe, void (*visit)(KeyNode*, void*), void *arg);
+
+/// @brief Counts the pairs stored in the table
+/// @param ht hashtable, the caller must hold every stripe lock
+/// @return number of pairs
+size_t table_count(HashTable *ht);
 
 #endif  // KVS_H
@@ -12,8 +12,8 @@
 
 static struct HashTable* kvs_table = NULL;
 
-// lock for each table entry
-pthread_rwlock_t table_locks[TABLE_SIZE] = {PTHREAD_RWLOCK_INITIALIZER};
+// lock for each table stripe
+pthread_rwlock_t table_locks[TABLE_STRIPES] = {PTHREAD_RWLOCK_INITIALIZER};
 
 // lock for accessing current simultaneous backups
 pthread_mutex_t backups_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -25,6 +25,81 @@ static struct timespec delay_to_timespec(unsigned int delay_ms) {
   return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
 }
 
+/// Marks the stripes that hold a set of keys.
+/// @param num_pairs Number of keys.
+/// @param keys Array of keys' strings.
+/// @param stripes Array of TABLE_STRIPES flags to fill.
+static void mark_stripes(size_t num_pairs, char keys[][MAX_STRING_SIZE], int stripes[]) {
+  for (size_t i = 0; i < num_pairs; i++) {
+    stripes[key_stripe(keys[i])] = 1;
+  }
+}
+
+/// Groups keys by stripe with a counting sort over their stripe indexes.
+/// Keys of the same stripe keep their relative order.
+/// @param num_pairs Number of keys.
+/// @param keys Array of keys' strings.
+/// @param order Array of num_pairs key indexes to fill, by increasing stripe.
+/// @param stripes Array of TABLE_STRIPES flags to fill.
+static void order_by_stripe(size_t num_pairs, char keys[][MAX_STRING_SIZE], size_t order[], int stripes[]) {
+  size_t key_stripes[num_pairs];
+  size_t starts[TABLE_STRIPES + 1] = {0};
+  for (size_t i = 0; i < num_pairs; i++) {
+    key_stripes[i] = key_stripe(keys[i]);
+    stripes[key_stripes[i]] = 1;
+    starts[key_stripes[i] + 1]++;
+  }
+  for (size_t i = 0; i < TABLE_STRIPES; i++) {
+    starts[i + 1] += starts[i];
+  }
+  for (size_t i = 0; i < num_pairs; i++) {
+    order[starts[key_stripes[i]]++] = i;
+  }
+}
+
+/// Compares two keys' strings, for qsort.
+static int compare_keys(const void *a, const void *b) {
+  return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/// Acquires the marked stripe locks. Locks are always taken by increasing
+/// stripe index, which stops dead-locks between threads.
+/// @param stripes Array of TABLE_STRIPES flags.
+/// @param write 1 to lock for writing, 0 for reading.
+static void lock_stripes(const int stripes[], int write) {
+  for (int i = 0; i < TABLE_STRIPES; i++) {
+    if (stripes[i]) {
+      if (write) {
+        pthread_rwlock_wrlock(&table_locks[i]);
+      } else {
+        pthread_rwlock_rdlock(&table_locks[i]);
+      }
+    }
+  }
+}
+
+/// Releases the marked stripe locks.
+/// @param stripes Array of TABLE_STRIPES flags.
+static void unlock_stripes(const int stripes[]) {
+  for (int i = 0; i < TABLE_STRIPES; i++) {
+    if (stripes[i]) {
+      pthread_rwlock_unlock(&table_locks[i]);
+    }
+  }
+}
+
+static void lock_all_stripes() {
+  for (int i = 0; i < TABLE_STRIPES; i++) {
+    pthread_rwlock_rdlock(&table_locks[i]);
+  }
+}
+
+static void unlock_all_stripes() {
+  for (int i = 0; i < TABLE_STRIPES; i++) {
+    pthread_rwlock_unlock(&table_locks[i]);
+  }
+}
+
 int kvs_init() {
   if (kvs_table != NULL) {
     fprintf(stderr, "KVS state has already been initialized\n");
@@ -45,79 +120,41 @@ int kvs_terminate() {
   return 0;
 }
 
-void sort_keys_values(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]) {
-  for (size_t i = 0; i < num_pairs; i++) {
-    size_t min = i;
-    for (size_t j = i+1; j < num_pairs; j++) {
-      if(strcmp(keys[min], keys[j]) > 0) {
-          min = j;   
-      }
-    }
-    if (min != i) {
-      char temp[MAX_STRING_SIZE];
-      strcpy(temp, keys[i]);
-      strcpy(keys[i], keys[min]);
-      strcpy(keys[min], temp);
-      char temp2[MAX_STRING_SIZE];
-      strcpy(temp2, values[i]);
-      strcpy(values[i], values[min]);
-      strcpy(values[min], temp2);
-    }
-  }
-}
-
 int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  // stops dead-locks between threads
-  sort_keys_values(num_pairs, keys, values);
-
-  // acquire locks correspondent to each table entry
-  int locked_indices[TABLE_SIZE] = {0};
-  for (size_t i = 0; i < num_pairs; i++) {
-    int index = hash(keys[i]);
-    if (!locked_indices[index]) {
-      locked_indices[index] = 1;
-      pthread_rwlock_wrlock(&table_locks[index]);
-    }
+  if (num_pairs == 0) {
+    return 0;
   }
+
+  // group the pairs by stripe and acquire the locks of those stripes; pairs
+  // of a stripe keep their order, so the last value given for a key is stored
+  size_t order[num_pairs];
+  int locked_stripes[TABLE_STRIPES] = {0};
+  order_by_stripe(num_pairs, keys, order, locked_stripes);
+  lock_stripes(locked_stripes, 1);
   
   for (size_t i = 0; i < num_pairs; i++) {
-    if (write_pair(kvs_table, keys[i], values[i]) != 0) {
-      fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[i], values[i]);
+    size_t pair = order[i];
+    if (write_pair(kvs_table, keys[pair], values[pair]) != 0) {
+      fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[pair], values[pair]);
     }
   }
 
   // free locks
-  for (size_t i = 0; i < num_pairs; i++) {
-    int index = hash(keys[i]);
-    if (locked_indices[index]) {
-      locked_indices[index] = 0;
-      pthread_rwlock_unlock(&table_locks[index]);
-    }
-  }
+  unlock_stripes(locked_stripes);
 
   return 0;
 }
 
-void sort_keys(size_t num_pairs, char keys[][MAX_STRING_SIZE]) {
+void sort_keys(size_t num_pairs, char keys[][MAX_STRING_SIZE], char *sorted[]) {
   for (size_t i = 0; i < num_pairs; i++) {
-    size_t min = i;
-    for (size_t j = i+1; j < num_pairs; j++) {
-      if(strcmp(keys[min], keys[j]) > 0) {
-          min = j;   
-      }
-    }
-    if (min != i) {
-      char temp[MAX_STRING_SIZE];
-      strcpy(temp, keys[i]);
-      strcpy(keys[i], keys[min]);
-      strcpy(keys[min], temp);
-    }
+    sorted[i] = keys[i];
   }
+  qsort(sorted, num_pairs, sizeof(char*), compare_keys);
 }
 
 int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int file_out) {
@@ -126,30 +163,26 @@ int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int file_out) {
     return 1;
   }
 
-  // prevents dead-locks between threads
-  sort_keys(num_pairs, keys);
+  // output is listed by key order
+  char *sorted[num_pairs + 1];
+  sort_keys(num_pairs, keys, sorted);
 
-  // acquire locks correspondent to each table entry
-  int locked_indices[TABLE_SIZE] = {0};
-  for (size_t i = 0; i < num_pairs; i++) {
-    int index = hash(keys[i]);
-    if (!locked_indices[index]) {
-      locked_indices[index] = 1;
-      pthread_rwlock_rdlock(&table_locks[index]);
-    }
-  }
+  // acquire locks of the stripes holding the keys
+  int locked_stripes[TABLE_STRIPES] = {0};
+  mark_stripes(num_pairs, keys, locked_stripes);
+  lock_stripes(locked_stripes, 0);
 
   // write to output file
   write(file_out, "[", 1);
   for (size_t i = 0; i < num_pairs; i++) {
-    char* result = read_pair(kvs_table, keys[i]);
+    char* result = read_pair(kvs_table, sorted[i]);
     if (result == NULL) {
       char content[MAX_WRITE_SIZE];
-      sprintf(content, "(%s,KVSERROR)", keys[i]);
+      sprintf(content, "(%s,KVSERROR)", sorted[i]);
       write(file_out, content, strlen(content));
     } else {
       char content[MAX_WRITE_SIZE];
-      sprintf(content, "(%s,%s)", keys[i], result);
+      sprintf(content, "(%s,%s)", sorted[i], result);
       write(file_out, content, strlen(content));
     }
     free(result);
@@ -157,13 +190,7 @@ int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int file_out) {
   write(file_out, "]\n", 2);
 
   // free locks
-  for (size_t i = 0; i < num_pairs; i++) {
-    int index = hash(keys[i]);
-    if (locked_indices[index]) {
-      locked_indices[index] = 0;
-      pthread_rwlock_unlock(&table_locks[index]);
-    }
-  }
+  unlock_stripes(locked_stripes);
   return 0;
 }
 
@@ -173,29 +200,25 @@ int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int file_out) {
     return 1;
   }
 
-  // prevents dead-locks between threads
-  sort_keys(num_pairs, keys);
+  // output is listed by key order
+  char *sorted[num_pairs + 1];
+  sort_keys(num_pairs, keys, sorted);
 
-  // acquire locks correspondent to each table entry
-  int locked_indices[TABLE_SIZE] = {0};
-  for (size_t i = 0; i < num_pairs; i++) {
-    int index = hash(keys[i]);
-    if (!locked_indices[index]) {
-      locked_indices[index] = 1;
-      pthread_rwlock_wrlock(&table_locks[index]);
-    }
-  }
+  // acquire locks of the stripes holding the keys
+  int locked_stripes[TABLE_STRIPES] = {0};
+  mark_stripes(num_pairs, keys, locked_stripes);
+  lock_stripes(locked_stripes, 1);
 
   // delete pairs
   int aux = 0;
   for (size_t i = 0; i < num_pairs; i++) {
-    if (delete_pair(kvs_table, keys[i]) != 0) {
+    if (delete_pair(kvs_table, sorted[i]) != 0) {
       if (!aux) {
         write(file_out, "[", 1);
         aux = 1;
       }
       char content[MAX_WRITE_SIZE];
-      sprintf(content, "(%s,KVSMISSING)", keys[i]);
+      sprintf(content, "(%s,KVSMISSING)", sorted[i]);
       write(file_out, content, strlen(content));
     }
   }
@@ -204,38 +227,50 @@ int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int file_out) {
   }
 
   // free locks
-  for (size_t i = 0; i < num_pairs; i++) {
-    int index = hash(keys[i]);
-    if (locked_indices[index]) {
-      locked_indices[index] = 0;
-      pthread_rwlock_unlock(&table_locks[index]);
-    }
-  }
+  unlock_stripes(locked_stripes);
 
   return 0;
 }
 
+static void collect_node(KeyNode *keyNode, void *arg) {
+  KeyNode ***next = (KeyNode***) arg;
+  *(*next)++ = keyNode;
+}
+
+static int compare_nodes(const void *a, const void *b) {
+  return strcmp((*(KeyNode* const*) a)->key, (*(KeyNode* const*) b)->key);
+}
+
 void kvs_show(int file_out) {
-  // acquire locks for all table entries
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    pthread_rwlock_rdlock(&table_locks[i]);
+  // acquire locks for all table stripes
+  lock_all_stripes();
+
+  // pairs are listed by key order, independently of where they are stored
+  size_t count = table_count(kvs_table);
+  KeyNode **nodes = malloc(count * sizeof(KeyNode*));
+  if (nodes == NULL && count > 0) {
+    fprintf(stderr, "Failed to allocate memory for SHOW\n");
+    unlock_all_stripes();
+    return;
+  }
+  KeyNode **next = nodes;
+  for (size_t i = 0; i < TABLE_STRIPES; i++) {
+    visit_nodes(kvs_table, i, collect_node, &next);
+  }
+  if (count > 0) {
+    qsort(nodes, count, sizeof(KeyNode*), compare_nodes);
   }
 
   // show table contents
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = kvs_table->table[i];
-    while (keyNode != NULL) {
-      char content[MAX_WRITE_SIZE];
-      sprintf(content, "(%s, %s)\n", keyNode->key, keyNode->value);
-      write(file_out, content, strlen(content));
-      keyNode = keyNode->next; // Move to the next node
-    }
+  for (size_t i = 0; i < count; i++) {
+    char content[MAX_WRITE_SIZE];
+    sprintf(content, "(%s, %s)\n", nodes[i]->key, nodes[i]->value);
+    write(file_out, content, strlen(content));
   }
+  free(nodes);
 
   // free locks
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    pthread_rwlock_unlock(&table_locks[i]);
-  }
+  unlock_all_stripes();
 }
 
 int kvs_backup(char pathname[], int max_backups, int *simultaneous_backups, int backup_num) { 
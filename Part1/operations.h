@@ -11,12 +11,6 @@ int kvs_init();
 /// @return 0 if the KVS state was terminated successfully, 1 otherwise.
 int kvs_terminate();
 
-/// @brief Sorts (key, value) pairs by key alphabetical order
-/// @param num_pairs Number of pairs to sort
-/// @param keys Array of keys' strings
-/// @param values Array of values' strings
-void sort_keys_values(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]);
-
 /// Writes a key value pair to the KVS. If key already exists it is updated.
 /// @param num_pairs Number of pairs being written.
 /// @param keys Array of keys' strings.
@@ -24,10 +18,11 @@ void sort_keys_values(size_t num_pairs, char keys[][MAX_STRING_SIZE], char value
 /// @return 0 if the pairs were written successfully, 1 otherwise.
 int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]);
 
-/// @brief Sorts keys by alphabetical order
+/// @brief Sorts keys by alphabetical order, without moving them
 /// @param num_pairs Number of keys
 /// @param keys Array of keys' strings
-void sort_keys(size_t num_pairs, char keys[][MAX_STRING_SIZE]);
+/// @param sorted Array of num_pairs pointers to fill with the sorted keys
+void sort_keys(size_t num_pairs, char keys[][MAX_STRING_SIZE], char *sorted[]);
 
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
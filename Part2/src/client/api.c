@@ -11,6 +11,7 @@
 #include <sys/stat.h>
 #include <src/server/io.h>
 #include <errno.h>
+#include <stdint.h>
 
 #define SUCCESS 0
 #define FAILURE 1
@@ -47,6 +48,12 @@ void print_response(int opcode, int response_code) {
         case OP_CODE_UNSUBSCRIBE:
             printf("Server returned %d for operation: unsubscribe\n", response_code);
             break;
+        case OP_CODE_STATS:
+            printf("Server returned %d for operation: stats\n", response_code);
+            break;
+        case OP_CODE_COALESCE:
+            printf("Server returned %d for operation: coalesce\n", response_code);
+            break;
     }
 }
 
@@ -236,4 +243,67 @@ int kvs_unsubscribe(const char *key) {
     client_state.subscriptions -= 1;
 
     return SUCCESS;
-}
\ No newline at end of file
+}
+
+int kvs_stats(void) {
+    char message[1] = {(char) OP_CODE_STATS};
+    if (write_all(client_state.req_fd, message, sizeof(message)) == -1) {
+        perror("Erro ao escrever para o pipe de pedidos");
+        return FAILURE;
+    }
+
+    // Ler resposta do servidor e o tamanho do relatório
+    char response[2];
+    uint32_t len;
+    if (read_all(client_state.resp_fd, response, sizeof(response), NULL) <= 0 ||
+        read_all(client_state.resp_fd, &len, sizeof(len), NULL) <= 0) {
+        perror("Erro ao ler resposta do servidor");
+        return FAILURE;
+    }
+
+    // Validar resposta
+    if (response[0] != OP_CODE_STATS) {
+        fprintf(stderr, "Resposta inválida: Código de resposta %d\n", response[1]);
+        return FAILURE;
+    }
+
+    char *report = malloc(len + 1);
+    if (report == NULL) {
+        return FAILURE;
+    }
+    if (len > 0 && read_all(client_state.resp_fd, report, len, NULL) <= 0) {
+        perror("Erro ao ler resposta do servidor");
+        free(report);
+        return FAILURE;
+    }
+    report[len] = '\0';
+    print_response(OP_CODE_STATS, response[1]);
+    fputs(report, stdout);
+    free(report);
+
+    return SUCCESS;
+}
+
+int kvs_coalesce(void) {
+    char message[1] = {(char) OP_CODE_COALESCE};
+    if (write_all(client_state.req_fd, message, sizeof(message)) == -1) {
+        perror("Erro ao escrever para o pipe de pedidos");
+        return FAILURE;
+    }
+
+    // Ler resposta do servidor
+    char response[2];
+    if (read_all(client_state.resp_fd, response, sizeof(response), NULL) <= 0) {
+        perror("Erro ao ler resposta do servidor");
+        return FAILURE;
+    }
+
+    // Validar resposta
+    if (response[0] != OP_CODE_COALESCE) {
+        fprintf(stderr, "Resposta inválida: Código de resposta %d\n", response[1]);
+        return FAILURE;
+    }
+    print_response(OP_CODE_COALESCE, response[1]);
+
+    return response[1] == SUCCESS ? SUCCESS : FAILURE;
+}
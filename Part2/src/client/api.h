@@ -36,6 +36,15 @@ int kvs_subscribe(const char *key);
 /// and was removed), 1 otherwise.
 int kvs_unsubscribe(const char *key);
 
+/// Requests the server's operation counts and latencies, and prints them.
+/// @return 0 if the statistics were received, 1 otherwise.
+int kvs_stats(void);
+
+/// Asks the server to coalesce this client's notifications: while one for a
+/// key is undelivered, later ones replace its value instead of queueing.
+/// @return 0 if the server coalesces them, 1 otherwise.
+int kvs_coalesce(void);
+
 /// @brief imprime a resposta do servidor a uma certa operação
 /// @param opcode opcode da operação
 /// @param response_code código de resposta da operação
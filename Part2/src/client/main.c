@@ -1,5 +1,7 @@
+#include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,8 +11,39 @@
 #include "src/client/api.h"
 #include "src/common/io.h"
 
+// tamanho de uma notificação: chave e valor
+#define NOTIF_SIZE (2*(MAX_STRING_SIZE+1))
+// notificações lidas de uma vez do pipe
+#define NOTIF_BATCH 64
+
 pthread_t notif_thread;
 
+// o servidor junta as notificações por chave, e a thread de notificações
+// também junta as que lê de uma vez
+static atomic_int coalescing = 0;
+
+/// @brief Junta as notificações da mesma chave, ficando cada chave com o
+/// último valor, na posição da sua primeira notificação
+/// @param messages notificações lidas
+/// @param count número de notificações
+/// @return número de notificações que ficam
+static size_t coalesce(char messages[][NOTIF_SIZE], size_t count) {
+  size_t kept = 0;
+  for (size_t i = 0; i < count; i++) {
+    size_t j = 0;
+    while (j < kept && strncmp(messages[j], messages[i], MAX_STRING_SIZE + 1) != 0) {
+      j++;
+    }
+    if (j == kept) {
+      kept++;
+    }
+    if (j != i) {
+      memcpy(messages[j], messages[i], NOTIF_SIZE);
+    }
+  }
+  return kept;
+}
+
 void *notif_task(void* arg) {
   char *notif_pipe_path = (char*) arg;
   int notif_fd = open(notif_pipe_path, O_RDONLY);
@@ -18,24 +51,35 @@ void *notif_task(void* arg) {
     perror("Erro ao abrir pipe de notificações do cliente\n");
     pthread_exit(NULL);
   }
+  // lê as notificações que houver, até NOTIF_BATCH; os bytes de uma
+  // notificação incompleta ficam à espera dos restantes
+  char messages[NOTIF_BATCH][NOTIF_SIZE];
+  size_t len = 0;
   while (1) {
-    char key[MAX_STRING_SIZE + 1];
-    char value[MAX_STRING_SIZE + 1];
-    char message[2*(MAX_STRING_SIZE+1)];
-    int result = read_all(notif_fd, message, sizeof(message), NULL);
+    ssize_t result = read(notif_fd, (char*) messages + len, sizeof(messages) - len);
     if (result == -1) {
-      perror("Erro ao ler notificação do servidor\n");
+      if (errno != EINTR) {
+        perror("Erro ao ler notificação do servidor\n");
+      }
       continue;
     }
     else if (result == 0) {
       return NULL;
     }
-    else {
-      strncpy(key, message, MAX_STRING_SIZE+1);
-      strncpy(value, message+MAX_STRING_SIZE+1, MAX_STRING_SIZE+1);
+    len += (size_t) result;
+    size_t count = len / NOTIF_SIZE;
+    size_t shown = atomic_load(&coalescing) ? coalesce(messages, count) : count;
+    for (size_t i = 0; i < shown; i++) {
+      char key[MAX_STRING_SIZE + 1];
+      char value[MAX_STRING_SIZE + 1];
+      strncpy(key, messages[i], MAX_STRING_SIZE+1);
+      strncpy(value, messages[i]+MAX_STRING_SIZE+1, MAX_STRING_SIZE+1);
+      key[MAX_STRING_SIZE] = value[MAX_STRING_SIZE] = '\0';
 
       printf("(<%s>,<%s>)\n", key, value);
     }
+    len -= count * NOTIF_SIZE;
+    memmove(messages, messages[count], len);
   }
   return NULL;
 }
@@ -109,6 +153,22 @@ int main(int argc, char *argv[]) {
 
       break;
 
+    case CMD_COALESCE:
+      if (kvs_coalesce()) {
+        fprintf(stderr, "Command coalesce failed\n");
+      } else {
+        atomic_store(&coalescing, 1);
+      }
+
+      break;
+
+    case CMD_STATS:
+      if (kvs_stats()) {
+        fprintf(stderr, "Command stats failed\n");
+      }
+
+      break;
+
     case CMD_DELAY:
       if (parse_delay(STDIN_FILENO, &delay_ms) == -1) {
         fprintf(stderr, "Invalid command. See HELP for usage\n");
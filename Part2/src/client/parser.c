@@ -100,13 +100,37 @@ enum Command get_next(int fd) {
 
   switch (buf[0]) {
   case 'S':
-    if (read(fd, buf + 1, 9) != 9 || strncmp(buf, "SUBSCRIBE ", 10) != 0) {
+    if (read(fd, buf + 1, 4) != 4) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    if (strncmp(buf, "STATS", 5) == 0) {
+      if (read(fd, buf + 5, 1) != 0 && buf[5] != '\n') {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+      return CMD_STATS;
+    }
+
+    if (read(fd, buf + 5, 5) != 5 || strncmp(buf, "SUBSCRIBE ", 10) != 0) {
       cleanup(fd);
       return CMD_INVALID;
     }
 
     return CMD_SUBSCRIBE;
 
+  case 'C':
+    if (read(fd, buf + 1, 7) != 7 || strncmp(buf, "COALESCE", 8) != 0) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+    if (read(fd, buf + 8, 1) != 0 && buf[8] != '\n') {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+    return CMD_COALESCE;
+
   case 'U':
     if (read(fd, buf + 1, 11) != 11 || strncmp(buf, "UNSUBSCRIBE ", 12) != 0) {
       cleanup(fd);
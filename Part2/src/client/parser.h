@@ -10,6 +10,8 @@ enum Command {
   CMD_SUBSCRIBE,
   CMD_UNSUBSCRIBE,
   CMD_DELAY,
+  CMD_STATS,
+  CMD_COALESCE,
   CMD_EMPTY,
   CMD_INVALID,
   EOC // End of commands
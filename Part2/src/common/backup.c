@@ -0,0 +1,157 @@
+#include "backup.h"
+
+#include <pthread.h>
+#include <string.h>
+
+// CRC-32 tables for the reflected polynomial 0xEDB88320, to process 8 bytes
+// per step: crc_table[k][b] is the CRC of byte b followed by k zero bytes.
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void build_crc_table(void) {
+  for (uint32_t b = 0; b < 256; b++) {
+    uint32_t crc = b;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+    crc_table[0][b] = crc;
+  }
+  for (uint32_t b = 0; b < 256; b++) {
+    for (int k = 1; k < 8; k++) {
+      uint32_t prev = crc_table[k - 1][b];
+      crc_table[k][b] = (prev >> 8) ^ crc_table[0][prev & 0xFF];
+    }
+  }
+}
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len) {
+  pthread_once(&crc_table_once, build_crc_table);
+  const unsigned char *bytes = data;
+  crc = ~crc;
+  for (; len >= 8; len -= 8, bytes += 8) {
+    uint32_t low = crc ^ (uint32_t) decode_le(bytes, 4);
+    uint32_t high = (uint32_t) decode_le(bytes + 4, 4);
+    crc = crc_table[7][low & 0xFF] ^ crc_table[6][(low >> 8) & 0xFF] ^
+          crc_table[5][(low >> 16) & 0xFF] ^ crc_table[4][low >> 24] ^
+          crc_table[3][high & 0xFF] ^ crc_table[2][(high >> 8) & 0xFF] ^
+          crc_table[1][(high >> 16) & 0xFF] ^ crc_table[0][high >> 24];
+  }
+  for (; len > 0; len--, bytes++) {
+    crc = (crc >> 8) ^ crc_table[0][(crc ^ *bytes) & 0xFF];
+  }
+  return ~crc;
+}
+
+void encode_le(unsigned char *dest, uint64_t value, size_t bytes) {
+  for (size_t i = 0; i < bytes; i++) {
+    dest[i] = (unsigned char) (value >> (8 * i));
+  }
+}
+
+uint64_t decode_le(const unsigned char *src, size_t bytes) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < bytes; i++) {
+    value |= (uint64_t) src[i] << (8 * i);
+  }
+  return value;
+}
+
+void backup_encode_header(const BackupHeader *header, unsigned char *dest) {
+  memset(dest, 0, BACKUP_HEADER_SIZE);
+  memcpy(dest, BACKUP_MAGIC, 4);
+  dest[4] = header->format;
+  dest[5] = header->kind;
+  encode_le(dest + 8, header->base_version, 8);
+  encode_le(dest + 16, header->version, 8);
+  encode_le(dest + 24, header->count, 4);
+}
+
+int backup_decode_header(const unsigned char *src, BackupHeader *header) {
+  if (memcmp(src, BACKUP_MAGIC, 4) != 0 || src[4] < BACKUP_FORMAT_V1 || src[4] > BACKUP_FORMAT ||
+      (src[5] != BACKUP_FULL && src[5] != BACKUP_DELTA)) {
+    return -1;
+  }
+  header->format = src[4];
+  header->kind = src[5];
+  header->base_version = decode_le(src + 8, 8);
+  header->version = decode_le(src + 16, 8);
+  header->count = (uint32_t) decode_le(src + 24, 4);
+  return 0;
+}
+
+// bytes added after the key and after the value of a record
+static size_t terminator_size(uint8_t format) {
+  return format >= 2 ? 1 : 0;
+}
+
+size_t backup_encode_record(uint8_t format, uint8_t op, const char *key, const char *value, unsigned char *dest) {
+  size_t key_len = strlen(key);
+  size_t value_len = op == BACKUP_PUT ? strlen(value) : 0;
+  size_t end = terminator_size(format);
+  dest[0] = op;
+  dest[1] = (unsigned char) key_len;
+  dest[2] = (unsigned char) value_len;
+  unsigned char *ptr = dest + 3;
+  memcpy(ptr, key, key_len);
+  ptr += key_len;
+  memset(ptr, 0, end);
+  ptr += end;
+  memcpy(ptr, value, value_len);
+  ptr += value_len;
+  memset(ptr, 0, end);
+  return (size_t) (ptr + end - dest);
+}
+
+// Checks the lengths of a record and gets its size, or 0 if it is invalid.
+static size_t record_size(uint8_t format, const unsigned char *src, size_t len, size_t max_string_size) {
+  if (len < 3) {
+    return 0;
+  }
+  size_t key_len = src[1], value_len = src[2];
+  size_t end = terminator_size(format);
+  size_t size = 3 + key_len + value_len + 2 * end;
+  if ((src[0] != BACKUP_PUT && src[0] != BACKUP_DELETE) ||
+      (src[0] == BACKUP_DELETE && value_len != 0) ||
+      key_len == 0 || key_len >= max_string_size || value_len >= max_string_size || len < size) {
+    return 0;
+  }
+  if (end > 0 && (src[3 + key_len] != '\0' || src[size - 1] != '\0')) {
+    return 0;
+  }
+  return size;
+}
+
+size_t backup_decode_record(uint8_t format, const unsigned char *src, size_t len, uint8_t *op, char *key, char *value, size_t max_string_size) {
+  size_t size = record_size(format, src, len, max_string_size);
+  if (size == 0) {
+    return 0;
+  }
+  size_t key_len = src[1], value_len = src[2];
+  *op = src[0];
+  memcpy(key, src + 3, key_len);
+  key[key_len] = '\0';
+  memcpy(value, src + 3 + key_len + terminator_size(format), value_len);
+  value[value_len] = '\0';
+  return size;
+}
+
+size_t backup_view_record(const unsigned char *src, size_t len, uint8_t *op, const char **key, const char **value, size_t max_string_size) {
+  size_t size = record_size(BACKUP_FORMAT, src, len, max_string_size);
+  if (size == 0) {
+    return 0;
+  }
+  *op = src[0];
+  *key = (const char*) src + 3;
+  *value = (const char*) src + 3 + src[1] + 1;
+  return size;
+}
+
+void backup_encode_trailer(uint32_t crc, unsigned char *dest) {
+  encode_le(dest, crc, BACKUP_TRAILER_SIZE);
+}
+
+int backup_check_trailer(const unsigned char *data, size_t len) {
+  size_t body = len - BACKUP_TRAILER_SIZE;
+  uint32_t crc = (uint32_t) decode_le(data + body, BACKUP_TRAILER_SIZE);
+  return crc32_update(0, data, body) == crc ? 0 : -1;
+}
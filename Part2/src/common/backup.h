@@ -0,0 +1,116 @@
+#ifndef COMMON_BACKUP_H
+#define COMMON_BACKUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Binary backup files, written by the server when it runs with incremental
+// backups. A file is a header, its records and the CRC-32 of both. Integers
+// are stored little-endian.
+//
+// header: "KVSB", format, kind, 2 reserved bytes, base version (8 bytes),
+//         version (8 bytes), record count (4 bytes), 4 reserved bytes
+// record: operation, key length, value length, key, '\0', value, '\0'
+//
+// Format 1 records have no '\0' after the key and value. Format 2 ones can
+// be used in place, from a mapped file.
+
+#define BACKUP_MAGIC "KVSB"
+#define BACKUP_FORMAT 2
+#define BACKUP_FORMAT_V1 1
+#define BACKUP_HEADER_SIZE 32
+#define BACKUP_TRAILER_SIZE 4
+
+// most bytes of a record holding a key and value of the given lengths
+#define BACKUP_RECORD_SIZE(key_len, value_len) (5 + (key_len) + (value_len))
+
+enum BackupKind {
+  BACKUP_FULL = 0, // every pair of the table
+  BACKUP_DELTA = 1 // pairs changed since the backup of the base version
+};
+
+enum BackupOp {
+  BACKUP_PUT = 0,
+  BACKUP_DELETE = 1
+};
+
+typedef struct {
+  uint8_t format;
+  uint8_t kind;
+  uint64_t base_version; // version of the previous backup, for deltas
+  uint64_t version; // table version the backup shows
+  uint32_t count; // number of records
+} BackupHeader;
+
+/// @brief Continues a CRC-32 (IEEE) over more bytes
+/// @param crc checksum of the bytes before, 0 to start
+/// @param data bytes to add
+/// @param len number of bytes
+/// @return checksum of every byte so far
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len);
+
+/// @brief Stores an integer little-endian
+/// @param dest bytes to write it to
+/// @param value integer to store
+/// @param bytes number of bytes to store, at most 8
+void encode_le(unsigned char *dest, uint64_t value, size_t bytes);
+
+/// @brief Loads a little-endian integer
+/// @param src bytes to read it from
+/// @param bytes number of bytes to load, at most 8
+/// @return the integer
+uint64_t decode_le(const unsigned char *src, size_t bytes);
+
+/// @brief Encodes a header, in the format it names
+/// @param header header to encode
+/// @param dest BACKUP_HEADER_SIZE bytes to write it to
+void backup_encode_header(const BackupHeader *header, unsigned char *dest);
+
+/// @brief Decodes a header
+/// @param src BACKUP_HEADER_SIZE bytes to read
+/// @param header header to fill
+/// @return 0 if the header is valid, -1 otherwise
+int backup_decode_header(const unsigned char *src, BackupHeader *header);
+
+/// @brief Encodes a record. Keys and values must be shorter than 256 bytes
+/// @param format format of the record
+/// @param op operation of the record
+/// @param key key of the record
+/// @param value value put, ignored for deletes
+/// @param dest BACKUP_RECORD_SIZE bytes to write it to
+/// @return number of bytes written
+size_t backup_encode_record(uint8_t format, uint8_t op, const char *key, const char *value, unsigned char *dest);
+
+/// @brief Decodes a record, copying its key and value
+/// @param format format of the record
+/// @param src bytes to read
+/// @param len number of bytes that can be read
+/// @param op operation of the record
+/// @param key buffer of max_string_size bytes for the key
+/// @param value buffer of max_string_size bytes for the value, empty for deletes
+/// @param max_string_size maximum size for keys and values, with the '\0'
+/// @return number of bytes read, 0 if the record is invalid
+size_t backup_decode_record(uint8_t format, const unsigned char *src, size_t len, uint8_t *op, char *key, char *value, size_t max_string_size);
+
+/// @brief Decodes a format 2 record without copying its key and value
+/// @param src bytes to read
+/// @param len number of bytes that can be read
+/// @param op operation of the record
+/// @param key set to the key, inside src
+/// @param value set to the value, inside src, empty for deletes
+/// @param max_string_size maximum size for keys and values, with the '\0'
+/// @return number of bytes read, 0 if the record is invalid
+size_t backup_view_record(const unsigned char *src, size_t len, uint8_t *op, const char **key, const char **value, size_t max_string_size);
+
+/// @brief Encodes the trailer that ends a file
+/// @param crc checksum of the header and every record
+/// @param dest BACKUP_TRAILER_SIZE bytes to write it to
+void backup_encode_trailer(uint32_t crc, unsigned char *dest);
+
+/// @brief Checks the trailer of a whole file
+/// @param data bytes of the file
+/// @param len number of bytes, at least BACKUP_TRAILER_SIZE
+/// @return 0 if the checksum matches, -1 otherwise
+int backup_check_trailer(const unsigned char *data, size_t len);
+
+#endif // COMMON_BACKUP_H
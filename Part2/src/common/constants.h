@@ -1,5 +1,5 @@
 // constantes partilhadas entre cliente e servidor
-#define MAX_SESSION_COUNT 3 // num max de sessoes no server, 1 default, necessario alterar mais tarde
+#define MAX_SESSION_COUNT 3 // num max de sessoes no server por omissão, mudado com -c
 #define STATE_ACCESS_DELAY_US   // delay a aplicar no server
 #define MAX_PIPE_PATH_LENGTH 40 // tamanho max do caminho do pipe
 #define MAX_STRING_SIZE 40
@@ -9,7 +9,12 @@ enum {
   OP_CODE_CONNECT = 1,
   OP_CODE_DISCONNECT = 2,
   OP_CODE_SUBSCRIBE = 3,
-  OP_CODE_UNSUBSCRIBE = 4
+  OP_CODE_UNSUBSCRIBE = 4,
+  // resposta: opcode, resultado, tamanho do relatório (uint32_t) e o relatório
+  OP_CODE_STATS = 5,
+  // a partir daqui, uma notificação de uma chave que ainda tem outra por
+  // entregar ao cliente substitui o valor dessa
+  OP_CODE_COALESCE = 6
 };
 
 #endif // COMMON_PROTOCOL_H
@@ -0,0 +1,236 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "src/common/backup.h"
+#include "src/common/constants.h"
+#include "src/common/io.h"
+
+// Merges a full backup written by a server running with incremental backups
+// with the deltas written after it, giving the state of the KVS at the last
+// delta: as SHOW lists it, or as a new full backup with -b.
+
+typedef struct {
+  uint8_t op;
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+} Record;
+
+typedef struct {
+  const char *path;
+  BackupHeader header;
+  Record *records; // sorted by key
+} BackupFile;
+
+static int compare_records(const void *a, const void *b) {
+  return strcmp(((const Record*) a)->key, ((const Record*) b)->key);
+}
+
+static int compare_versions(const void *a, const void *b) {
+  uint64_t va = ((const BackupFile*) a)->header.version;
+  uint64_t vb = ((const BackupFile*) b)->header.version;
+  return (va > vb) - (va < vb);
+}
+
+/// Reads and checks a backup file.
+/// @param path Path of the file.
+/// @param backup Backup to fill.
+/// @return 0 if the file is a valid backup, 1 otherwise.
+static int load_backup(const char *path, BackupFile *backup) {
+  backup->path = path;
+  backup->records = NULL;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to open backup %s\n", path);
+    return 1;
+  }
+  struct stat st;
+  unsigned char *data = NULL;
+  size_t len = 0;
+  if (fstat(fd, &st) == 0 && st.st_size >= BACKUP_HEADER_SIZE + BACKUP_TRAILER_SIZE) {
+    len = (size_t) st.st_size;
+    data = malloc(len);
+  }
+  if (data == NULL || read_all(fd, data, len, NULL) != 1) {
+    fprintf(stderr, "Failed to read backup %s\n", path);
+    free(data);
+    close(fd);
+    return 1;
+  }
+  close(fd);
+
+  if (backup_check_trailer(data, len) != 0 || backup_decode_header(data, &backup->header) != 0) {
+    fprintf(stderr, "Backup %s is corrupted\n", path);
+    free(data);
+    return 1;
+  }
+
+  size_t count = backup->header.count;
+  size_t pos = BACKUP_HEADER_SIZE, end = len - BACKUP_TRAILER_SIZE;
+  backup->records = malloc((count > 0 ? count : 1) * sizeof(Record));
+  if (backup->records == NULL) {
+    fprintf(stderr, "Failed to allocate memory for backup %s\n", path);
+    free(data);
+    return 1;
+  }
+  size_t decoded = 0;
+  while (decoded < count) {
+    Record *record = &backup->records[decoded];
+    size_t used = backup_decode_record(backup->header.format, data + pos, end - pos, &record->op, record->key, record->value, MAX_STRING_SIZE);
+    if (used == 0) {
+      break;
+    }
+    pos += used;
+    decoded++;
+  }
+  free(data);
+  if (decoded != count || pos != end) {
+    fprintf(stderr, "Backup %s is corrupted\n", path);
+    free(backup->records);
+    backup->records = NULL;
+    return 1;
+  }
+  qsort(backup->records, backup->header.count, sizeof(Record), compare_records);
+  return 0;
+}
+
+/// Applies the records of a delta to a sorted state.
+/// @param state Records of the state, sorted by key, all puts.
+/// @param count Number of records in the state, updated.
+/// @param delta Delta to apply.
+/// @return The new state, NULL on failure.
+static Record *apply_delta(Record *state, size_t *count, const BackupFile *delta) {
+  Record *merged = malloc((*count + delta->header.count + 1) * sizeof(Record));
+  if (merged == NULL) {
+    return NULL;
+  }
+  size_t i = 0, j = 0, len = 0;
+  while (i < *count || j < delta->header.count) {
+    int cmp = i == *count ? 1 : j == delta->header.count ? -1 :
+              strcmp(state[i].key, delta->records[j].key);
+    if (cmp < 0) {
+      merged[len++] = state[i++];
+      continue;
+    }
+    if (cmp == 0) {
+      i++; // replaced or deleted
+    }
+    if (delta->records[j].op == BACKUP_PUT) {
+      merged[len++] = delta->records[j];
+    }
+    j++;
+  }
+  free(state);
+  *count = len;
+  return merged;
+}
+
+static int write_show(int fd, const Record *state, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    char line[2 * MAX_STRING_SIZE + 5];
+    int len = snprintf(line, sizeof(line), "(%s, %s)\n", state[i].key, state[i].value);
+    if (write_all(fd, line, (size_t) len) == -1) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int write_full(int fd, const Record *state, size_t count, uint64_t version) {
+  BackupHeader header = {BACKUP_FORMAT, BACKUP_FULL, 0, version, (uint32_t) count};
+  unsigned char bytes[BACKUP_RECORD_SIZE(MAX_STRING_SIZE, MAX_STRING_SIZE)];
+  backup_encode_header(&header, bytes);
+  uint32_t crc = crc32_update(0, bytes, BACKUP_HEADER_SIZE);
+  if (write_all(fd, bytes, BACKUP_HEADER_SIZE) == -1) {
+    return 1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    size_t len = backup_encode_record(BACKUP_FORMAT, BACKUP_PUT, state[i].key, state[i].value, bytes);
+    crc = crc32_update(crc, bytes, len);
+    if (write_all(fd, bytes, len) == -1) {
+      return 1;
+    }
+  }
+  backup_encode_trailer(crc, bytes);
+  return write_all(fd, bytes, BACKUP_TRAILER_SIZE) == -1;
+}
+
+int main(int argc, char *argv[]) {
+  int binary = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "b")) != -1) {
+    switch (opt) {
+      case 'b':
+        binary = 1;
+        break;
+      default:
+        argc = 0;
+        break;
+    }
+  }
+  if (argc - optind < 2) {
+    fprintf(stderr, "Usage: %s [-b] <output> <full_backup> [<delta_backup> ...]\n", argv[0]);
+    return 1;
+  }
+  const char *output = argv[optind];
+  size_t num_backups = (size_t) (argc - optind - 1);
+
+  BackupFile *backups = calloc(num_backups, sizeof(BackupFile));
+  if (backups == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    return 1;
+  }
+  int result = 1;
+  for (size_t i = 0; i < num_backups; i++) {
+    if (load_backup(argv[optind + 1 + (int) i], &backups[i]) != 0) {
+      goto cleanup;
+    }
+  }
+  if (backups[0].header.kind != BACKUP_FULL) {
+    fprintf(stderr, "Backup %s is not a full backup\n", backups[0].path);
+    goto cleanup;
+  }
+  // deltas may be given in any order, but must follow each other
+  qsort(backups + 1, num_backups - 1, sizeof(BackupFile), compare_versions);
+  for (size_t i = 1; i < num_backups; i++) {
+    if (backups[i].header.kind != BACKUP_DELTA ||
+        backups[i].header.base_version != backups[i - 1].header.version) {
+      fprintf(stderr, "Backup %s is not a delta of %s\n", backups[i].path, backups[i - 1].path);
+      goto cleanup;
+    }
+  }
+
+  Record *state = backups[0].records;
+  size_t count = backups[0].header.count;
+  backups[0].records = NULL;
+  for (size_t i = 1; i < num_backups && state != NULL; i++) {
+    state = apply_delta(state, &count, &backups[i]);
+  }
+  if (state == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    goto cleanup;
+  }
+
+  int fd = open(output, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to open output file %s\n", output);
+  } else {
+    uint64_t version = backups[num_backups - 1].header.version;
+    result = binary ? write_full(fd, state, count, version) : write_show(fd, state, count);
+    if (result != 0) {
+      fprintf(stderr, "Failed to write output file %s\n", output);
+    }
+    close(fd);
+  }
+  free(state);
+
+cleanup:
+  for (size_t i = 0; i < num_backups; i++) {
+    free(backups[i].records);
+  }
+  free(backups);
+  return result;
+}
@@ -2,14 +2,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <dirent.h>
 #include <fcntl.h>
-#include <unistd.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
 #include <sys/stat.h>
-#include <semaphore.h>
 #include <errno.h>
+#include <semaphore.h>
 #include <signal.h>
 
 #include "constants.h"
@@ -20,232 +20,454 @@
 #include "src/common/protocol.h"
 #include "src/common/io.h"
 #include "src/server/operations.h"
+#include "src/server/notifier.h"
+#include "src/server/stats.h"
+
+// eventos tratados por cada chamada a epoll_wait
+#define MAX_EVENTS 64
+
+// Ciclo de eventos: só a sua thread mexe nos seus clientes
+typedef struct {
+    int epoll_fd;
+    // acorda o ciclo para registar clientes novos ou desconectar todos
+    int wake_pipe[2];
+    // clientes entregues pela tarefa anfitriã, ainda por registar
+    pthread_mutex_t pending_lock;
+    Client *pending;
+    // clientes registados no epoll
+    Client *clients;
+    // clientes apagados durante o lote de eventos atual, libertados no fim
+    // dele, porque ainda podem ter eventos no lote
+    Client *deleted;
+    atomic_size_t num_clients;
+    // pedidos de desconexão de todos os clientes já tratados
+    unsigned disconnects_seen;
+    pthread_t thread;
+} EventLoop;
+
+// Ciclos de eventos
+static EventLoop loops[MAX_EVENT_LOOPS];
+static int num_loops = 0;
 
-// Semáforos e Mutex
-sem_t space_in_buffer; // Espaço disponível no buffer
-sem_t info_to_read; // Informação disponível para ler
-
-pthread_mutex_t buffer_mutex; // Proteção ao buffer partilhado
-pthread_mutex_t buffer_index_mutex; // Proteção ao índice partilhado
-
-// Buffer partilhado
-char buffer[MAX_PIPE_PATH_LENGTH * 3 * MAX_SESSION_COUNT];
-int buffer_index = 0;
-
-// Array de threads para gerenciar clientes
-pthread_t manager_threads[MAX_SESSION_COUNT];
 pthread_t host_thread;
 
-// Lista de clientes com os fd
-Client *clients[MAX_SESSION_COUNT] = {NULL};
+// sessões livres, até ao máximo configurado
+static sem_t session_slots;
 
-// sinal
-volatile sig_atomic_t sigusr1_received = 0;
+// sinal: cada SIGUSR1 conta um pedido de desconexão de todos os clientes
+static atomic_uint disconnect_requests = 0;
 
 void sigusr1_handler(int sig) {
     if (sig == SIGUSR1) {
-        // Apagar todos os clientes
-        for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-            if (clients[i] != NULL) {
-                delete_client(&clients[i]);
+        // Só funções seguras em sinais: os ciclos desconectam os clientes
+        atomic_fetch_add(&disconnect_requests, 1);
+        for (int i = 0; i < num_loops; i++) {
+            char byte = 0;
+            if (write(loops[i].wake_pipe[1], &byte, 1) == -1) {
+                // pipe cheio: o ciclo já vai acordar
             }
         }
-        printf("Todos os clientes desconectados.\n");
+        const char message[] = "Todos os clientes desconectados.\n";
+        if (write(STDOUT_FILENO, message, sizeof(message) - 1) == -1) {
+            // nada a fazer dentro do handler
+        }
     }
 }
 
-Client* add_client(int req_fd, int resp_fd, int notif_fd) {
-    // Criar novo cliente
-    Client *client = (Client*) malloc(sizeof(Client));
-    client->req_fd = req_fd;
-    client->resp_fd = resp_fd;
-    client->notif_fd = notif_fd;
+void close_pipes(int req_fd, int resp_fd, int notif_fd) {
+    close(req_fd);
+    close(resp_fd);
+    close(notif_fd);
+}
 
-    // Adicionar cliente
-    for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-        if (clients[i] == NULL) {
-            clients[i] = client;
-            break;
+/// @brief Regista um cliente no epoll e na lista do ciclo
+static void add_client(EventLoop *loop, Client *client) {
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = client};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client->req_fd, &event) == -1) {
+        perror("Erro ao registar cliente no epoll");
+        close_pipes(client->req_fd, client->resp_fd, client->notif_fd);
+        free(client);
+        atomic_fetch_sub(&loop->num_clients, 1);
+        sem_post(&session_slots);
+        return;
+    }
+    client->prev = NULL;
+    client->next = loop->clients;
+    if (loop->clients != NULL) {
+        loop->clients->prev = client;
+    }
+    loop->clients = client;
+}
+
+/// @brief Apaga todas as subscrições de um cliente, fecha os seus pipes e
+/// remove-o do ciclo
+static void delete_client(EventLoop *loop, Client *client) {
+    // Depois disto nenhum notify põe notificações para o cliente na fila;
+    // o dispatcher fecha o pipe de notificações depois das que já lá estão
+    delete_all_subs(client->notif_fd, &client->subs);
+    // só um dos pipes está no epoll: o de respostas se há respostas pendentes
+    int registered_fd = client->output_len > 0 ? client->resp_fd : client->req_fd;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, registered_fd, NULL);
+    close(client->req_fd);
+    close(client->resp_fd);
+    notifier_close(client->notif_fd);
+
+    if (client->prev != NULL) {
+        client->prev->next = client->next;
+    } else {
+        loop->clients = client->next;
+    }
+    if (client->next != NULL) {
+        client->next->prev = client->prev;
+    }
+    client->deleted = 1;
+    client->next = loop->deleted;
+    loop->deleted = client;
+    atomic_fetch_sub(&loop->num_clients, 1);
+    sem_post(&session_slots);
+}
+
+/// @brief Liberta os clientes apagados no lote de eventos que acabou
+static void free_deleted(EventLoop *loop) {
+    while (loop->deleted != NULL) {
+        Client *next = loop->deleted->next;
+        free(loop->deleted);
+        loop->deleted = next;
+    }
+}
+
+/// @brief Tamanho de um pedido, a partir do seu opcode
+static size_t request_size(char opcode) {
+    switch ((int) opcode) {
+        case OP_CODE_SUBSCRIBE:
+        case OP_CODE_UNSUBSCRIBE:
+            return MAX_REQUEST_SIZE;
+        default:
+            return 1;
+    }
+}
+
+/// @brief Junta uma resposta às que falta enviar ao cliente; cabe sempre,
+/// porque os pedidos seguintes só são tratados depois de enviadas
+static void queue_reply(Client *client, const void *reply, size_t len) {
+    memcpy(client->output + client->output_len, reply, len);
+    client->output_len += len;
+}
+
+/// @brief Trata um pedido completo de um cliente, pondo a resposta no
+/// buffer de saída
+/// @param client cliente que fez o pedido
+/// @param request pedido, com request_size bytes
+/// @return 0 se o cliente continua conectado, 1 se deve ser apagado
+static int handle_request(Client *client, const char *request) {
+    char message[2];
+    switch ((int) request[0]) {
+        case OP_CODE_DISCONNECT: {
+            // Enviar resposta
+            message[0] = (char) OP_CODE_DISCONNECT;
+            message[1] = (char) SUCCESS;
+            queue_reply(client, message, sizeof(message));
+            return 1;
+        }
+
+        case OP_CODE_SUBSCRIBE:
+        case OP_CODE_UNSUBSCRIBE: {
+            // Chave a (des)subscrever
+            char key[MAX_STRING_SIZE + 1];
+            memcpy(key, request + 1, MAX_STRING_SIZE);
+            key[MAX_STRING_SIZE] = '\0';
+            int result = request[0] == OP_CODE_SUBSCRIBE ? subscribe_key(key, client->notif_fd, &client->subs) :
+                                                           unsubscribe_key(key, client->notif_fd, &client->subs);
+
+            // Mensagem de resposta
+            message[0] = request[0];
+            message[1] = (char) result;
+            queue_reply(client, message, sizeof(message));
+            return 0;
+        }
+
+        case OP_CODE_COALESCE: {
+            // O dispatcher passa a juntar as notificações do cliente por chave
+            notifier_coalesce(client->notif_fd);
+            message[0] = (char) OP_CODE_COALESCE;
+            message[1] = (char) SUCCESS;
+            queue_reply(client, message, sizeof(message));
+            return 0;
+        }
+
+        case OP_CODE_STATS: {
+            // Relatório das estatísticas, precedido do seu tamanho, escrito
+            // diretamente no buffer de saída
+            char *reply = client->output + client->output_len;
+            uint32_t len = (uint32_t) stats_format(reply + 2 + sizeof(uint32_t));
+            reply[0] = (char) OP_CODE_STATS;
+            reply[1] = (char) SUCCESS;
+            memcpy(reply + 2, &len, sizeof(len));
+            client->output_len += 2 + sizeof(len) + len;
+            return 0;
         }
+
+        default:
+            return 0;
     }
-    return client;
 }
 
-void delete_client(Client **client) {
-    // Apagar todas as subscrições do cliente
-    delete_all_subs((*client)->notif_fd);
-    // Apagar o cliente da lista e libertar memória a ele associada
-    for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-        if (clients[i] != NULL) {
-            int req_fd = clients[i]->req_fd;
-            int resp_fd = clients[i]->resp_fd;
-            int notif_fd = clients[i]->notif_fd;
-            if (req_fd == (*client)->req_fd && resp_fd == (*client)->resp_fd && notif_fd == (*client)->notif_fd) {
-                close_pipes((*client)->req_fd, (*client)->resp_fd, (*client)->notif_fd);
-                free(*client);
-                clients[i] = NULL;
-                break;
+/// @brief Escreve o que o pipe de respostas aceitar sem bloquear
+/// @return 0 se o pipe ainda está aberto, 1 se o cliente deve ser apagado
+static int flush_replies(Client *client) {
+    while (client->output_sent < client->output_len) {
+        ssize_t written = write(client->resp_fd, client->output + client->output_sent,
+                                client->output_len - client->output_sent);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
             }
+            if (errno == EAGAIN) {
+                return 0;
+            }
+            perror("Erro ao enviar mensagem para o cliente");
+            return 1;
         }
+        client->output_sent += (size_t) written;
     }
-    // Post de espaço no buffer, ganhamos uma sessão livre para preencher com
-    // um novo cliente
-    sem_post(&space_in_buffer);
+    client->output_len = client->output_sent = 0;
+    return 0;
 }
 
-void close_pipes(int req_fd, int resp_fd, int notif_fd) {
-    close(req_fd);
-    close(resp_fd);
-    close(notif_fd);
+/// @brief Trata os pedidos completos já recebidos de um cliente. Um cliente
+/// que não lê as respostas deixa de ser lido até as ler: o pipe de pedidos
+/// sai do epoll e entra o de respostas, à espera de espaço, e o ciclo nunca
+/// bloqueia à espera de um cliente. Cada cliente tem só um pipe no epoll,
+/// para nunca receber dois eventos no mesmo lote.
+/// @return 0 se o cliente continua conectado, 1 se deve ser apagado
+static int process_input(EventLoop *loop, Client *client) {
+    size_t used = 0;
+    int result = 0;
+    while (used < client->input_len && client->output_len == 0) {
+        size_t size = request_size(client->input[used]);
+        if (client->input_len - used < size) {
+            break;
+        }
+        int disconnect = handle_request(client, client->input + used);
+        used += size;
+        if (flush_replies(client) != 0 || disconnect) {
+            // a resposta ao DISCONNECT é enviada se o pipe a aceitar
+            result = 1;
+            break;
+        }
+    }
+    memmove(client->input, client->input + used, client->input_len - used);
+    client->input_len -= used;
+
+    if (result == 0 && client->output_len > 0) {
+        struct epoll_event writable = {.events = EPOLLOUT, .data.ptr = client};
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, client->req_fd, NULL) == -1) {
+            perror("Erro ao esperar pelo pipe de respostas");
+            result = 1;
+        } else if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client->resp_fd, &writable) == -1) {
+            perror("Erro ao esperar pelo pipe de respostas");
+            // nenhum pipe do cliente fica no epoll
+            client->output_len = 0;
+            result = 1;
+        }
+    }
+    return result;
+}
+
+/// @brief Envia as respostas pendentes de um cliente quando o seu pipe de
+/// respostas tem espaço e, enviadas todas, volta a ler os seus pedidos
+/// @return 0 se o cliente continua conectado, 1 se deve ser apagado
+static int resume_client(EventLoop *loop, Client *client) {
+    if (flush_replies(client) != 0) {
+        return 1;
+    }
+    if (client->output_len > 0) {
+        return 0;
+    }
+    struct epoll_event readable = {.events = EPOLLIN, .data.ptr = client};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, client->resp_fd, NULL) == -1 ||
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client->req_fd, &readable) == -1) {
+        perror("Erro ao voltar a ler os pedidos do cliente");
+        return 1;
+    }
+    return process_input(loop, client);
+}
+
+/// @brief Lê o que chegou ao pipe de pedidos de um cliente e trata os pedidos
+/// completos; os bytes de um pedido incompleto ficam à espera dos restantes.
+static void serve_client(EventLoop *loop, Client *client, uint32_t events) {
+    if (client->deleted) {
+        return;
+    }
+    if (client->output_len > 0) {
+        // só o pipe de respostas está no epoll; sem EPOLLOUT, o cliente
+        // fechou-o
+        if (!(events & EPOLLOUT) || resume_client(loop, client) != 0) {
+            delete_client(loop, client);
+        }
+        return;
+    }
+    if (!(events & EPOLLIN)) {
+        // EPOLLHUP ou EPOLLERR sem nada para ler: o cliente fechou o pipe
+        delete_client(loop, client);
+        return;
+    }
+
+    ssize_t bytes_read = read(client->req_fd, client->input + client->input_len,
+                              CLIENT_INPUT_SIZE - client->input_len);
+    if (bytes_read == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (bytes_read <= 0) {
+        delete_client(loop, client);
+        return;
+    }
+    client->input_len += (size_t) bytes_read;
+    if (process_input(loop, client) != 0) {
+        delete_client(loop, client);
+    }
+}
+
+/// @brief Regista os clientes entregues ao ciclo e, se foi pedido com
+/// SIGUSR1, desconecta todos
+static void wake_up(EventLoop *loop) {
+    char bytes[64];
+    while (read(loop->wake_pipe[0], bytes, sizeof(bytes)) > 0)
+        ;
+
+    pthread_mutex_lock(&loop->pending_lock);
+    Client *pending = loop->pending;
+    loop->pending = NULL;
+    pthread_mutex_unlock(&loop->pending_lock);
+    while (pending != NULL) {
+        Client *next = pending->next;
+        add_client(loop, pending);
+        pending = next;
+    }
+
+    unsigned requests = atomic_load(&disconnect_requests);
+    if (requests != loop->disconnects_seen) {
+        loop->disconnects_seen = requests;
+        while (loop->clients != NULL) {
+            delete_client(loop, loop->clients);
+        }
+    }
 }
 
-// Função das threads gestoras
-void* manager_thread() {
+// Função dos ciclos de eventos
+void *event_loop(void *arg) {
+    EventLoop *loop = (EventLoop*) arg;
     sigset_t set;
-    // Block SIGUSR1 in this thread
+    // Block SIGUSR1 in this thread; writing to a client that closed its
+    // response pipe fails with EPIPE instead of raising SIGPIPE
     sigemptyset(&set);
     sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGPIPE);
     if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
         perror("Erro ao ignorar o sinal\n");
         pthread_exit(NULL);
     }
 
+    struct epoll_event events[MAX_EVENTS];
     while (1) {
-        char req_pipe[MAX_PIPE_PATH_LENGTH];
-        char resp_pipe[MAX_PIPE_PATH_LENGTH];
-        char notif_pipe[MAX_PIPE_PATH_LENGTH];
-
-        // Esperar por informação para ler
-        sem_wait(&info_to_read);
-        
-        // secção crítica: mudar índice de leitura do buffer
-        pthread_mutex_lock(&buffer_index_mutex);
-        buffer_index -= 3 * MAX_PIPE_PATH_LENGTH;
-        pthread_mutex_unlock(&buffer_index_mutex);
-
-        // Secção crítica: ler do buffer
-        pthread_mutex_lock(&buffer_mutex);
-        strncpy(req_pipe, buffer + buffer_index, MAX_PIPE_PATH_LENGTH);
-        strncpy(resp_pipe, buffer + buffer_index + MAX_PIPE_PATH_LENGTH, MAX_PIPE_PATH_LENGTH);
-        strncpy(notif_pipe, buffer + buffer_index + 2 * MAX_PIPE_PATH_LENGTH, MAX_PIPE_PATH_LENGTH);
-        pthread_mutex_unlock(&buffer_mutex); 
-
-        // Post de espaço no buffer
-        sem_post(&space_in_buffer);
-
-        // Abrir o pipe de respostas do cliente
-        int resp_fd = open(resp_pipe, O_WRONLY);
-        if (resp_fd == -1) {
-            perror("Erro a abrir response pipe\n");
-            continue;
-        }
-        // mandar mensagem de sucesso do connect ao cliente
-        char success_message[2] = {(char) OP_CODE_CONNECT, (char) SUCCESS};
-        if (write_all(resp_fd, success_message, sizeof(success_message)) == -1){
-            perror("Erro ao enviar mensagem de resposta da conexão\n");
+        int count = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+        if (count == -1) {
+            if (errno != EINTR) {
+                perror("Erro no epoll_wait");
+            }
             continue;
         }
-
-        // Abrir os restantes pipes do cliente
-        int req_fd = open(req_pipe, O_RDONLY);
-        if (req_fd == -1) {
-            perror("Erro a abrir requests pipe\n");
-            continue;
+        // o pipe de despertar é tratado no fim, porque pode apagar clientes
+        // com eventos ainda por tratar
+        int woken = 0;
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == NULL) {
+                woken = 1;
+            } else {
+                serve_client(loop, (Client*) events[i].data.ptr, events[i].events);
+            }
         }
-        int notif_fd = open(notif_pipe, O_WRONLY);
-        if (notif_fd == -1) {
-            perror("Erro a abrir notifications pipe\n");
-            continue;
+        if (woken) {
+            wake_up(loop);
         }
+        free_deleted(loop);
+    }
 
-        Client *current_client = add_client(req_fd, resp_fd, notif_fd);
-        int is_connected = 1;
-        // Ler request pipe e processar os pedidos
-        while (is_connected) {
-            char opcode[1];
-            int read_result = read_all(req_fd, opcode, sizeof(opcode), NULL);
-            if (read_result == -1 || read_result == 0) {
-                delete_client(&current_client);
-                is_connected = 0;
-                break;
-            }
-            
-            char message[2];
-            int result;
-            switch ((int) opcode[0]) {
-                case OP_CODE_DISCONNECT: {
-                    // Enviar resposta
-                    message[0] = (char) OP_CODE_DISCONNECT;
-                    message[1] = (char) SUCCESS;
-                    if (write_all(resp_fd, message, sizeof(message)) == -1) {
-                        perror("Erro ao enviar mensagem para o cliente\n");
-                    }
-                    // Apagar o cliente
-                    delete_client(&current_client);
-                    is_connected = 0;
-                    break;
-                }
-                
-                case OP_CODE_SUBSCRIBE: {
-                    // Ler a chave a subscrever
-                    char key[MAX_STRING_SIZE+1];
-                    if (read_all(req_fd, key, sizeof(key), NULL) == -1) {
-                        perror("Erro ao ler request do cliente\n");
-                        delete_client(&current_client);
-                        is_connected = 0;
-                        break;
-                    }
-                    result = subscribe_key(key, notif_fd);
-
-                    // Mensagem de resposta
-                    message[0] = (char) OP_CODE_SUBSCRIBE;
-                    message[1] = (char) result;
-                    if (write_all(resp_fd, message, sizeof(message)) == -1) {
-                        perror("Erro ao enviar mensagem para o cliente\n");
-                        delete_client(&current_client);
-                        is_connected = 0;
-                        break;
-                    }
-                    break;
-                }
-
-                case OP_CODE_UNSUBSCRIBE: {
-                    // Ler a chave 
-                    char key_to_unsub[MAX_STRING_SIZE+1];
-                    if (read_all(req_fd, key_to_unsub, sizeof(key_to_unsub), NULL) == -1) {
-                        perror("Erro ao enviar mensagem para o cliente\n");
-                        delete_client(&current_client);
-                        is_connected = 0;
-                        break;
-                    }
-                    result = unsubscribe_key(key_to_unsub, notif_fd);
-
-                    // Mensagem de resposta
-                    message[0] = (char) OP_CODE_UNSUBSCRIBE;
-                    message[1] = (char) result;
-                    if (write_all(resp_fd, message, sizeof(message)) == -1) {
-                        perror("Erro ao enviar mensagem para o cliente");
-                        delete_client(&current_client);
-                        is_connected = 0;
-                        break;
-                    }
-                    break;
-                }
-            }  
+    return NULL;
+}
+
+/// @brief Abre os pipes de um cliente que pediu para se conectar e entrega-o
+/// ao ciclo de eventos com menos clientes
+/// @return 0 se o cliente foi entregue, 1 caso contrário
+static int connect_client(const char *req_pipe, const char *resp_pipe, const char *notif_pipe) {
+    // Abrir o pipe de respostas do cliente
+    int resp_fd = open(resp_pipe, O_WRONLY);
+    if (resp_fd == -1) {
+        perror("Erro a abrir response pipe\n");
+        return 1;
+    }
+    // mandar mensagem de sucesso do connect ao cliente
+    char success_message[2] = {(char) OP_CODE_CONNECT, (char) SUCCESS};
+    if (write_all(resp_fd, success_message, sizeof(success_message)) == -1){
+        perror("Erro ao enviar mensagem de resposta da conexão\n");
+        close(resp_fd);
+        return 1;
+    }
+
+    // Abrir os restantes pipes do cliente
+    int req_fd = open(req_pipe, O_RDONLY);
+    if (req_fd == -1) {
+        perror("Erro a abrir requests pipe\n");
+        close(resp_fd);
+        return 1;
+    }
+    int notif_fd = open(notif_pipe, O_WRONLY);
+    if (notif_fd == -1) {
+        perror("Erro a abrir notifications pipe\n");
+        close(req_fd);
+        close(resp_fd);
+        return 1;
+    }
+
+    // os pedidos são lidos e as respostas escritas pelo ciclo de eventos
+    // sem bloquear
+    Client *client = (Client*) malloc(sizeof(Client));
+    if (client == NULL || fcntl(req_fd, F_SETFL, O_NONBLOCK) == -1 ||
+        fcntl(resp_fd, F_SETFL, O_NONBLOCK) == -1) {
+        perror("Erro ao preparar o cliente\n");
+        free(client);
+        close_pipes(req_fd, resp_fd, notif_fd);
+        return 1;
+    }
+    client->req_fd = req_fd;
+    client->resp_fd = resp_fd;
+    client->notif_fd = notif_fd;
+    memset(&client->subs, 0, sizeof(client->subs));
+    client->input_len = 0;
+    client->output_len = client->output_sent = 0;
+    client->deleted = 0;
+
+    EventLoop *loop = &loops[0];
+    for (int i = 1; i < num_loops; i++) {
+        if (atomic_load(&loops[i].num_clients) < atomic_load(&loop->num_clients)) {
+            loop = &loops[i];
         }
     }
-    
-    return NULL;
+    atomic_fetch_add(&loop->num_clients, 1);
+    pthread_mutex_lock(&loop->pending_lock);
+    client->next = loop->pending;
+    loop->pending = client;
+    pthread_mutex_unlock(&loop->pending_lock);
+    char byte = 0;
+    if (write(loop->wake_pipe[1], &byte, 1) == -1 && errno != EAGAIN) {
+        perror("Erro ao acordar o ciclo de eventos");
+    }
+    return 0;
 }
 
 // Função da tarefa anfitriã
 void* host_task(void* arg) {
-    // associar handler ao sinal
-    if (signal(SIGUSR1, sigusr1_handler) == SIG_ERR) {
-        exit(EXIT_FAILURE);
-    }
-
-    char* server_path = (char*) arg;
+    const char *server_path = ((ClientManagerConfig*) arg)->server_path;
 
     // create server pipe
     if (unlink(server_path) != 0 && errno != ENOENT) {
@@ -255,14 +477,6 @@ void* host_task(void* arg) {
     if (mkfifo(server_path, 0666) == -1) {
         perror("Erro ao criar o pipe do server\n");
     }
-    
-    // Criar threads gestoras
-    for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-        if (pthread_create(&manager_threads[i], NULL, manager_thread, NULL) != 0) {
-            perror("Erro ao criar thread gestora\n");
-            exit(EXIT_FAILURE);
-        }
-    }
 
     // Abrir pipe do servidor
     int server_fd = open(server_path, O_RDWR);
@@ -272,38 +486,23 @@ void* host_task(void* arg) {
         if (read_all(server_fd, request, sizeof(request), NULL) == -1) {
             perror("Erro ao ler pedido de conexão com o servidor\n");
             continue;
-        } 
+        }
 
-        // le os pipes do cliente enviados na resposta 
-        char req_pipe[MAX_PIPE_PATH_LENGTH];
-        char resp_pipe[MAX_PIPE_PATH_LENGTH];
-        char notif_pipe[MAX_PIPE_PATH_LENGTH];
+        // le os pipes do cliente enviados na resposta
+        char req_pipe[MAX_PIPE_PATH_LENGTH + 1] = {0};
+        char resp_pipe[MAX_PIPE_PATH_LENGTH + 1] = {0};
+        char notif_pipe[MAX_PIPE_PATH_LENGTH + 1] = {0};
         strncpy(req_pipe, request + 1, MAX_PIPE_PATH_LENGTH);
         strncpy(resp_pipe, request + 1 + MAX_PIPE_PATH_LENGTH, MAX_PIPE_PATH_LENGTH);
         strncpy(notif_pipe, request + 1 + 2*MAX_PIPE_PATH_LENGTH, MAX_PIPE_PATH_LENGTH);
 
-        // Esperar por espaço no buffer
-        sem_wait(&space_in_buffer);
-
-        // Quando tem espaço, escrever no buffer
-        pthread_mutex_lock(&buffer_mutex);
-        strncpy(buffer + buffer_index, req_pipe, MAX_PIPE_PATH_LENGTH);
-        strncpy(buffer + buffer_index + MAX_PIPE_PATH_LENGTH, resp_pipe, MAX_PIPE_PATH_LENGTH);
-        strncpy(buffer + buffer_index + 2 * MAX_PIPE_PATH_LENGTH, notif_pipe, MAX_PIPE_PATH_LENGTH);
-        pthread_mutex_unlock(&buffer_mutex);
-
-        // Mudar o índice de acesso ao buffer
-        pthread_mutex_lock(&buffer_index_mutex);
-        buffer_index += 3 * MAX_PIPE_PATH_LENGTH;
-        pthread_mutex_unlock(&buffer_index_mutex);
-
-        // Post de informação para ler
-        sem_post(&info_to_read);
-    }
-
-    // esperar pelas threads gestoras
-    for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-        pthread_join(manager_threads[i], NULL);
+        // esperar por uma sessão livre; o ciclo que desconectar um cliente
+        // devolve a sua
+        while (sem_wait(&session_slots) == -1 && errno == EINTR)
+            ;
+        if (connect_client(req_pipe, resp_pipe, notif_pipe) != 0) {
+            sem_post(&session_slots);
+        }
     }
 
     // Fechar e apagar o pipe do server
@@ -315,18 +514,68 @@ void* host_task(void* arg) {
     return NULL;
 }
 
+/// @brief Cria o epoll e o pipe de despertar de um ciclo e a sua thread
+/// @return 0 se o ciclo foi criado, 1 caso contrário
+static int start_loop(EventLoop *loop) {
+    loop->epoll_fd = epoll_create1(0);
+    if (loop->epoll_fd == -1) {
+        return 1;
+    }
+    if (pipe(loop->wake_pipe) == -1) {
+        close(loop->epoll_fd);
+        return 1;
+    }
+    fcntl(loop->wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(loop->wake_pipe[1], F_SETFL, O_NONBLOCK);
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    pthread_mutex_init(&loop->pending_lock, NULL);
+    loop->pending = NULL;
+    loop->clients = NULL;
+    loop->deleted = NULL;
+    atomic_init(&loop->num_clients, 0);
+    loop->disconnects_seen = 0;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_pipe[0], &event) == -1 ||
+        pthread_create(&loop->thread, NULL, event_loop, loop) != 0) {
+        close(loop->epoll_fd);
+        close(loop->wake_pipe[0]);
+        close(loop->wake_pipe[1]);
+        pthread_mutex_destroy(&loop->pending_lock);
+        return 1;
+    }
+    return 0;
+}
+
 // Função principal
 void* client_manager(void* args) {
-    char *server_path = (char*) args;
-    
-    // Inicializar semáforos e mutex
-    sem_init(&space_in_buffer, 0, MAX_SESSION_COUNT); // Buffer inicialmente vazio
-    sem_init(&info_to_read, 0, 0); // Nenhuma informação disponível inicialmente
-    pthread_mutex_init(&buffer_mutex, NULL);
-    pthread_mutex_init(&buffer_index_mutex, NULL);
+    ClientManagerConfig *config = (ClientManagerConfig*) args;
+    if (sem_init(&session_slots, 0, (unsigned) config->max_sessions) == -1) {
+        perror("Erro ao criar as sessões");
+        exit(EXIT_FAILURE);
+    }
+
+    // Criar um ciclo de eventos por core
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = cores < 1 ? 1 : cores > MAX_EVENT_LOOPS ? MAX_EVENT_LOOPS : (int) cores;
+    while (num_loops < wanted && start_loop(&loops[num_loops]) == 0) {
+        num_loops++;
+    }
+    if (num_loops == 0) {
+        fprintf(stderr, "Failed to create event loops\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // associar handler ao sinal, depois de os ciclos existirem
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sigusr1_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGUSR1, &action, NULL) == -1) {
+        exit(EXIT_FAILURE);
+    }
 
     // Criar a tarefa anfitriã
-    if (pthread_create(&host_thread, NULL, host_task, (void*) server_path) != 0) {
+    if (pthread_create(&host_thread, NULL, host_task, (void*) config) != 0) {
         fprintf(stderr, "Failed to create host thread\n");
         exit(EXIT_FAILURE);
     }
@@ -334,11 +583,5 @@ void* client_manager(void* args) {
     // esperar que a tarefa anfirtriã acabe
     pthread_join(host_thread, NULL);
 
-    // Destruir semáforos e mutex
-    sem_destroy(&space_in_buffer);
-    sem_destroy(&info_to_read);
-    pthread_mutex_destroy(&buffer_mutex);
-    pthread_mutex_destroy(&buffer_index_mutex);
-
     return NULL;
-}
\ No newline at end of file
+}
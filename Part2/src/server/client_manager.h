@@ -1,41 +1,76 @@
-// @brief estrutura que contém as file descriptors dos pipes de um cliente
-typedef struct {
+#ifndef KVS_CLIENT_MANAGER_H
+#define KVS_CLIENT_MANAGER_H
+
+#include <stddef.h>
+
+#include "src/common/constants.h"
+#include "src/server/operations.h"
+#include "src/server/stats.h"
+
+// maior pedido de um cliente: opcode e chave
+#define MAX_REQUEST_SIZE (1 + MAX_STRING_SIZE + 1)
+// bytes lidos de uma vez do pipe de pedidos de um cliente
+#define CLIENT_INPUT_SIZE 512
+// maior resposta: a do STATS, com o tamanho do relatório
+#define CLIENT_OUTPUT_SIZE (2 + sizeof(uint32_t) + STATS_OUTPUT_SIZE)
+// máximo de ciclos de eventos, um por core
+#define MAX_EVENT_LOOPS 64
+
+// @brief estrutura que contém as file descriptors dos pipes de um cliente,
+// as chaves que subscreveu, os bytes de pedidos recebidos que ainda não
+// chegaram completos e a resposta que o pipe de respostas ainda não aceitou
+typedef struct Client {
     int req_fd;
     int resp_fd;
     int notif_fd;
+    Subscriptions subs;
+    char input[CLIENT_INPUT_SIZE];
+    size_t input_len;
+    char output[CLIENT_OUTPUT_SIZE];
+    size_t output_len;
+    size_t output_sent;
+    // apagado neste lote de eventos; só é libertado no fim dele
+    int deleted;
+    // clientes do mesmo ciclo de eventos
+    struct Client *prev;
+    struct Client *next;
 } Client;
 
-/// @brief Inicializa semáforos e mutexes e cria a host thread
-/// @param server_path 
+// @brief configuração do gestor de clientes, dada no arranque do servidor
+typedef struct {
+    const char *server_path;
+    // máximo de sessões ligadas ao mesmo tempo; as seguintes esperam que
+    // uma termine
+    int max_sessions;
+} ClientManagerConfig;
+
+/// @brief Cria um ciclo de eventos por core e a host thread
+/// @param args configuração do gestor (ClientManagerConfig*)
 /// @return void*
 void* client_manager(void *args);
 
-/// @brief thread gestora para tratar de um cliente e processar os seus pedidos
-void *manager_thread();
+/// @brief ciclo de eventos: espera com epoll por pedidos de todos os seus
+/// clientes, com os pipes de pedidos em modo não bloqueante, e trata cada
+/// pedido assim que chega completo
+/// @param arg ciclo de eventos a correr
+void *event_loop(void *arg);
 
-/// @brief thread anfitriã que lê pedidos de conexão de novos clientes
-/// @param arg pipe do servidor
-/// @return 
+/// @brief thread anfitriã que lê pedidos de conexão de novos clientes, abre
+/// os seus pipes e entrega-os ao ciclo de eventos com menos clientes,
+/// esperando que haja uma sessão livre
+/// @param arg configuração do gestor (ClientManagerConfig*)
+/// @return
 void *host_task(void* arg);
 
-/// @brief Apaga todas as subscrições de um cliente e remove-o da lista de
-/// clientes conectados
-/// @param client Cliente a apagar
-void delete_client(Client **client);
-
-/// @brief Adiciona um cliente à lista de clientes
-/// @param req_fd pipe de requests do cliente
-/// @param resp_fd pipe de response do cliente
-/// @param notif_fd pipe de notifications do cliente
-Client* add_client(int req_fd, int resp_fd, int notif_fd);
-
 /// @brief Fecha todos os pipes de um cliente
 /// @param req_fd pipe de requests do cliente
 /// @param resp_fd pipe de response do cliente
 /// @param notif_fd pipe de notifications do cliente
 void close_pipes(int req_fd, int resp_fd, int notif_fd);
 
-/// @brief Desconecta todos os clientes e apaga todas as suas subscrições
-/// quando o sinal SIGUSR1 é detetado
+/// @brief Pede a todos os ciclos de eventos que desconectem os seus clientes
+/// e apaguem as suas subscrições quando o sinal SIGUSR1 é detetado
 /// @param sig sinal a tratar
-void sigusr1_handler(int sig);
\ No newline at end of file
+void sigusr1_handler(int sig);
+
+#endif // KVS_CLIENT_MANAGER_H
@@ -0,0 +1,238 @@
+#include "dump.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// longest SHOW output line: "(key, value)\n"
+#define SHOW_LINE_SIZE (2 * MAX_STRING_SIZE + 5)
+// keys sampled per worker to choose the bounds of the key ranges
+#define DUMP_SAMPLES 32
+
+// State shared by the workers of a parallel dump. Worker i classifies the
+// i-th chunk of the pairs by key range, then moves them to their range, and
+// finally sorts and formats the i-th range.
+typedef struct {
+  PairCopy *pairs;
+  size_t count;
+  size_t workers;
+  const char *bounds[DUMP_MAX_WORKERS - 1]; // first key of each range but the first
+  unsigned char *ranges; // range of each pair
+  size_t counts[DUMP_MAX_WORKERS][DUMP_MAX_WORKERS]; // pairs of each chunk in each range
+  const PairCopy **sorted; // pairs grouped by range
+  char *buffers[DUMP_MAX_WORKERS]; // formatted output of each range
+  struct iovec iov[DUMP_MAX_WORKERS];
+  int failed[DUMP_MAX_WORKERS];
+} Dump;
+
+typedef struct {
+  Dump *dump;
+  size_t id;
+  void (*phase)(Dump*, size_t);
+} DumpWorker;
+
+static int compare_pairs(const void *a, const void *b) {
+  return strcmp(((const PairCopy*) a)->key, ((const PairCopy*) b)->key);
+}
+
+static int compare_pair_ptrs(const void *a, const void *b) {
+  return strcmp((*(const PairCopy* const*) a)->key, (*(const PairCopy* const*) b)->key);
+}
+
+static int compare_key_ptrs(const void *a, const void *b) {
+  return strcmp(*(const char* const*) a, *(const char* const*) b);
+}
+
+static size_t format_pair(char *dest, const PairCopy *pair) {
+  size_t len = 0;
+  dest[len++] = '(';
+  len += strn_memcpy(dest + len, pair->key, MAX_STRING_SIZE);
+  dest[len++] = ',';
+  dest[len++] = ' ';
+  len += strn_memcpy(dest + len, pair->value, MAX_STRING_SIZE);
+  dest[len++] = ')';
+  dest[len++] = '\n';
+  return len;
+}
+
+static size_t chunk_start(const Dump *dump, size_t id) {
+  return dump->count * id / dump->workers;
+}
+
+static size_t key_range(const Dump *dump, const char *key) {
+  size_t low = 0, high = dump->workers - 1;
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    if (strcmp(dump->bounds[mid], key) <= 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+static void classify_chunk(Dump *dump, size_t id) {
+  for (size_t i = chunk_start(dump, id); i < chunk_start(dump, id + 1); i++) {
+    size_t range = key_range(dump, dump->pairs[i].key);
+    dump->ranges[i] = (unsigned char) range;
+    dump->counts[id][range]++;
+  }
+}
+
+static void scatter_chunk(Dump *dump, size_t id) {
+  // the chunk's pairs of a range go after those of every earlier range, and
+  // those earlier chunks have in the same range
+  size_t offsets[DUMP_MAX_WORKERS];
+  size_t offset = 0;
+  for (size_t range = 0; range < dump->workers; range++) {
+    for (size_t chunk = 0; chunk < dump->workers; chunk++) {
+      if (chunk == id) {
+        offsets[range] = offset;
+      }
+      offset += dump->counts[chunk][range];
+    }
+  }
+  for (size_t i = chunk_start(dump, id); i < chunk_start(dump, id + 1); i++) {
+    dump->sorted[offsets[dump->ranges[i]]++] = &dump->pairs[i];
+  }
+}
+
+static void format_range(Dump *dump, size_t id) {
+  size_t start = 0, count = 0;
+  for (size_t range = 0; range <= id; range++) {
+    start += count;
+    count = 0;
+    for (size_t chunk = 0; chunk < dump->workers; chunk++) {
+      count += dump->counts[chunk][range];
+    }
+  }
+  if (count == 0) {
+    return;
+  }
+  qsort(dump->sorted + start, count, sizeof(PairCopy*), compare_pair_ptrs);
+
+  char *buffer = malloc(count * SHOW_LINE_SIZE);
+  if (buffer == NULL) {
+    dump->failed[id] = 1;
+    return;
+  }
+  size_t len = 0;
+  for (size_t i = start; i < start + count; i++) {
+    len += format_pair(buffer + len, dump->sorted[i]);
+  }
+  dump->buffers[id] = buffer;
+  dump->iov[id].iov_base = buffer;
+  dump->iov[id].iov_len = len;
+}
+
+static void *dump_worker(void *arg) {
+  DumpWorker *worker = (DumpWorker*) arg;
+  worker->phase(worker->dump, worker->id);
+  return NULL;
+}
+
+/// Runs a phase of the dump on every worker and waits for all of them. A
+/// worker whose thread cannot be created runs on the calling thread.
+/// @param dump Dump being made.
+/// @param phase Function run for each worker.
+static void run_phase(Dump *dump, void (*phase)(Dump*, size_t)) {
+  pthread_t threads[DUMP_MAX_WORKERS];
+  DumpWorker workers[DUMP_MAX_WORKERS];
+  int started[DUMP_MAX_WORKERS] = {0};
+  for (size_t i = 1; i < dump->workers; i++) {
+    workers[i] = (DumpWorker){dump, i, phase};
+    started[i] = pthread_create(&threads[i], NULL, dump_worker, &workers[i]) == 0;
+  }
+  phase(dump, 0);
+  for (size_t i = 1; i < dump->workers; i++) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    } else {
+      phase(dump, i);
+    }
+  }
+}
+
+static size_t dump_workers(size_t count) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t workers = count / DUMP_PAIRS_PER_WORKER;
+  if (cpus > 0 && workers > (size_t) cpus) {
+    workers = (size_t) cpus;
+  }
+  return workers < DUMP_MAX_WORKERS ? workers : DUMP_MAX_WORKERS;
+}
+
+/// Splits the pairs in key ranges of about the same size, from a sorted
+/// sample of their keys.
+/// @param dump Dump to set the bounds of.
+/// @return 0 on success, 1 on failure.
+static int choose_bounds(Dump *dump) {
+  size_t samples = dump->workers * DUMP_SAMPLES;
+  const char **sample = malloc(samples * sizeof(char*));
+  if (sample == NULL) {
+    return 1;
+  }
+  for (size_t i = 0; i < samples; i++) {
+    sample[i] = dump->pairs[i * (dump->count / samples)].key;
+  }
+  qsort(sample, samples, sizeof(char*), compare_key_ptrs);
+  for (size_t i = 1; i < dump->workers; i++) {
+    dump->bounds[i - 1] = sample[i * DUMP_SAMPLES];
+  }
+  free(sample);
+  return 0;
+}
+
+/// Sorts and formats pairs on several threads, then writes them at once.
+/// @return 0 if the pairs were written, 1 if they could not be dumped this way.
+static int dump_parallel(PairCopy *pairs, size_t count, size_t workers, OutBuffer *out) {
+  Dump *dump = calloc(1, sizeof(Dump));
+  if (dump == NULL) {
+    return 1;
+  }
+  dump->pairs = pairs;
+  dump->count = count;
+  dump->workers = workers;
+  dump->ranges = malloc(count);
+  dump->sorted = malloc(count * sizeof(PairCopy*));
+  int result = 1;
+  if (dump->ranges != NULL && dump->sorted != NULL && choose_bounds(dump) == 0) {
+    run_phase(dump, classify_chunk);
+    run_phase(dump, scatter_chunk);
+    run_phase(dump, format_range);
+
+    int failed = 0;
+    for (size_t i = 0; i < workers; i++) {
+      failed |= dump->failed[i];
+    }
+    if (!failed) {
+      outbuf_writev(out, dump->iov, (int) workers);
+      result = 0;
+    }
+  }
+
+  for (size_t i = 0; i < workers; i++) {
+    free(dump->buffers[i]);
+  }
+  free(dump->ranges);
+  free(dump->sorted);
+  free(dump);
+  return result;
+}
+
+void dump_pairs(PairCopy *pairs, size_t count, OutBuffer *out) {
+  size_t workers = dump_workers(count);
+  if (workers > 1 && dump_parallel(pairs, count, workers, out) == 0) {
+    return;
+  }
+
+  if (count > 0) {
+    qsort(pairs, count, sizeof(PairCopy), compare_pairs);
+  }
+  for (size_t i = 0; i < count; i++) {
+    char *content = outbuf_reserve(out, SHOW_LINE_SIZE);
+    outbuf_commit(out, format_pair(content, &pairs[i]));
+  }
+}
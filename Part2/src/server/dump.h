@@ -0,0 +1,29 @@
+#ifndef KVS_DUMP_H
+#define KVS_DUMP_H
+
+#include <stddef.h>
+
+#include "constants.h"
+#include "io.h"
+
+// most threads that sort and format a dump
+#define DUMP_MAX_WORKERS 8
+// fewest pairs given to each thread; smaller dumps use fewer threads
+#define DUMP_PAIRS_PER_WORKER 8192
+
+// Copy of a stored pair, taken for SHOW and backups.
+typedef struct {
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+} PairCopy;
+
+/// @brief Writes pairs as SHOW lists them, one "(key, value)" line per pair
+/// by key order. Large dumps are split in key ranges, each sorted and
+/// formatted by its own thread into its own buffer, and the buffers written
+/// in range order with writev().
+/// @param pairs pairs to write, reordered
+/// @param count number of pairs
+/// @param out output buffer to write to
+void dump_pairs(PairCopy *pairs, size_t count, OutBuffer *out);
+
+#endif // KVS_DUMP_H
@@ -0,0 +1,158 @@
+#include "epoch.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+// An object retired while the global epoch was e may still be reached by
+// readers that entered during e - 1 or e, so it is released once the epoch
+// reaches e + 2. Each thread keeps one limbo list per epoch modulo 3.
+#define EPOCH_LISTS 3
+
+typedef struct {
+  void *ptr;
+  void (*release)(void*, void*);
+  void *arg;
+} Retired;
+
+typedef struct {
+  unsigned long epoch; // epoch the objects were retired in
+  Retired *items;
+  size_t count;
+  size_t capacity;
+} Limbo;
+
+// Per-thread state. Records are never freed: when a thread exits its record
+// is left for the next thread to adopt, together with its limbo lists.
+typedef struct EpochRecord {
+  atomic_ulong epoch; // global epoch seen when the read section started
+  atomic_int active; // inside a read section
+  atomic_int owned; // used by a live thread
+  Limbo limbo[EPOCH_LISTS];
+  size_t pending; // retired since the last attempt to advance
+  struct EpochRecord *next;
+} EpochRecord;
+
+static atomic_ulong global_epoch = 1;
+static _Atomic(EpochRecord*) records = NULL;
+
+static _Thread_local EpochRecord *self = NULL;
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+
+static void disown_record(void *record) {
+  atomic_store(&((EpochRecord*) record)->owned, 0);
+}
+
+static void create_record_key() {
+  pthread_key_create(&record_key, disown_record);
+}
+
+static EpochRecord *thread_record() {
+  if (self != NULL) {
+    return self;
+  }
+  pthread_once(&record_key_once, create_record_key);
+
+  // adopt the record of a thread that exited
+  for (EpochRecord *record = atomic_load(&records); record != NULL; record = record->next) {
+    int free_record = 0;
+    if (atomic_compare_exchange_strong(&record->owned, &free_record, 1)) {
+      self = record;
+      break;
+    }
+  }
+
+  if (self == NULL) {
+    // without a record the thread could not read safely, so give up
+    EpochRecord *record = calloc(1, sizeof(EpochRecord));
+    if (record == NULL) {
+      abort();
+    }
+    atomic_init(&record->owned, 1);
+    record->next = atomic_load(&records);
+    while (!atomic_compare_exchange_weak(&records, &record->next, record))
+      ;
+    self = record;
+  }
+  pthread_setspecific(record_key, self);
+  return self;
+}
+
+static void release_limbo(Limbo *limbo) {
+  for (size_t i = 0; i < limbo->count; i++) {
+    limbo->items[i].release(limbo->items[i].ptr, limbo->items[i].arg);
+  }
+  limbo->count = 0;
+}
+
+// Moves the global epoch forward if every reader has seen the current one.
+static void try_advance() {
+  unsigned long epoch = atomic_load(&global_epoch);
+  for (EpochRecord *record = atomic_load(&records); record != NULL; record = record->next) {
+    if (atomic_load(&record->active) && atomic_load(&record->epoch) != epoch) {
+      return;
+    }
+  }
+  atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+}
+
+// Releases the objects of the calling thread no reader can reach anymore.
+static void reclaim(EpochRecord *record) {
+  unsigned long epoch = atomic_load(&global_epoch);
+  for (int i = 0; i < EPOCH_LISTS; i++) {
+    if (record->limbo[i].count > 0 && record->limbo[i].epoch + 2 <= epoch) {
+      release_limbo(&record->limbo[i]);
+    }
+  }
+}
+
+void epoch_enter() {
+  EpochRecord *record = thread_record();
+  atomic_store(&record->active, 1);
+  atomic_store(&record->epoch, atomic_load(&global_epoch));
+}
+
+void epoch_exit() {
+  atomic_store_explicit(&self->active, 0, memory_order_release);
+}
+
+void epoch_retire(void *ptr, void (*release)(void*, void*), void *arg) {
+  EpochRecord *record = thread_record();
+  unsigned long epoch = atomic_load(&global_epoch);
+  Limbo *limbo = &record->limbo[epoch % EPOCH_LISTS];
+
+  // the list still holds objects of epoch - 3 or older, which are safe
+  if (limbo->epoch != epoch) {
+    release_limbo(limbo);
+    limbo->epoch = epoch;
+  }
+
+  if (limbo->count == limbo->capacity) {
+    size_t capacity = limbo->capacity > 0 ? limbo->capacity * 2 : EPOCH_RETIRE_BATCH;
+    Retired *items = realloc(limbo->items, capacity * sizeof(Retired));
+    if (items == NULL) {
+      // the object is leaked rather than released under a reader
+      return;
+    }
+    limbo->items = items;
+    limbo->capacity = capacity;
+  }
+  limbo->items[limbo->count++] = (Retired){ptr, release, arg};
+
+  if (++record->pending >= EPOCH_RETIRE_BATCH) {
+    record->pending = 0;
+    try_advance();
+    reclaim(record);
+  }
+}
+
+void epoch_drain() {
+  for (EpochRecord *record = atomic_load(&records); record != NULL; record = record->next) {
+    for (int i = 0; i < EPOCH_LISTS; i++) {
+      release_limbo(&record->limbo[i]);
+    }
+    record->pending = 0;
+  }
+}
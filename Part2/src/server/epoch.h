@@ -0,0 +1,26 @@
+#ifndef KVS_EPOCH_H
+#define KVS_EPOCH_H
+
+// retired objects a thread gathers before it tries to advance the epoch
+#define EPOCH_RETIRE_BATCH 64
+
+/// @brief Starts a read section. Objects retired after the section started
+/// are not released before it ends, so shared nodes can be read without
+/// locks. Sections must not be nested.
+void epoch_enter();
+
+/// @brief Ends the read section of the calling thread
+void epoch_exit();
+
+/// @brief Hands over an object that was unlinked from every shared structure.
+/// It is released once every read section that could still reach it ended.
+/// @param ptr object to release
+/// @param release function that releases it, called with ptr and arg
+/// @param arg argument passed to release
+void epoch_retire(void *ptr, void (*release)(void*, void*), void *arg);
+
+/// @brief Releases every retired object at once. No thread may be inside a
+/// read section.
+void epoch_drain();
+
+#endif // KVS_EPOCH_H
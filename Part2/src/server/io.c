@@ -3,6 +3,11 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "io.h"
+
+// areas given to each writev(), within the limit of every system
+#define OUTBUF_MAX_IOV 1024
+
 // funções de escrita para o pipe
 void write_str(int fd, const char *str) {
   size_t len = strlen(str);
@@ -44,3 +49,121 @@ size_t strn_memcpy(char *dest, const char *src, size_t n) {
   memcpy(dest, src, bytes_to_copy);
   return bytes_to_copy;
 }
+
+void outbuf_init(OutBuffer *out, int fd) {
+  out->fd = fd;
+  out->len = 0;
+  out->sink = NULL;
+  out->sink_arg = NULL;
+  out->data = out->storage;
+}
+
+void outbuf_set_sink(OutBuffer *out, OutSink sink, void *arg) {
+  out->sink = sink;
+  out->sink_arg = arg;
+  if (sink == NULL) {
+    out->data = out->storage;
+  }
+}
+
+// Writes bytes to the buffer's file.
+static void emit(OutBuffer *out, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t result = write(out->fd, data, len);
+    if (result < 0) {
+      perror("Error writing output");
+      return;
+    }
+    data += result;
+    len -= (size_t)result;
+  }
+}
+
+// Empties the buffer, handing its storage to the sink if it has one; the
+// sink only has to write the bytes by the time it returns when sync is set.
+static void drain(OutBuffer *out, int sync) {
+  if (out->sink != NULL) {
+    if (out->len > 0 || sync) {
+      out->data = out->sink(out->data, out->len, sync, out->sink_arg);
+    }
+  } else if (out->len > 0) {
+    emit(out, out->data, out->len);
+  }
+  out->len = 0;
+}
+
+// Writes bytes the buffer could not hold, after what it holds. A sink only
+// takes whole buffers, so they go through the buffer.
+static void write_through(OutBuffer *out, const char *data, size_t len) {
+  drain(out, 0);
+  if (out->sink == NULL) {
+    emit(out, data, len);
+    return;
+  }
+  while (len > 0) {
+    size_t part = len < OUTBUF_SIZE ? len : OUTBUF_SIZE;
+    memcpy(out->data, data, part);
+    out->len = part;
+    drain(out, 0);
+    data += part;
+    len -= part;
+  }
+}
+
+void outbuf_flush(OutBuffer *out) {
+  drain(out, 1);
+}
+
+char *outbuf_reserve(OutBuffer *out, size_t len) {
+  if (out->len + len > OUTBUF_SIZE) {
+    drain(out, 0);
+  }
+  return out->data + out->len;
+}
+
+void outbuf_commit(OutBuffer *out, size_t len) {
+  out->len += len;
+}
+
+void outbuf_write(OutBuffer *out, const char *data, size_t len) {
+  if (len > OUTBUF_SIZE) {
+    // too big to be buffered: keep the order and write it directly
+    write_through(out, data, len);
+    return;
+  }
+  memcpy(outbuf_reserve(out, len), data, len);
+  outbuf_commit(out, len);
+}
+
+void outbuf_str(OutBuffer *out, const char *str) {
+  outbuf_write(out, str, strlen(str));
+}
+
+void outbuf_writev(OutBuffer *out, struct iovec *iov, int iovcnt) {
+  if (out->sink != NULL) {
+    // a sink only takes whole buffers, so the areas are gathered into them
+    for (int i = 0; i < iovcnt; i++) {
+      outbuf_write(out, iov[i].iov_base, iov[i].iov_len);
+    }
+    return;
+  }
+  drain(out, 0);
+  while (iovcnt > 0) {
+    ssize_t result = writev(out->fd, iov, iovcnt < OUTBUF_MAX_IOV ? iovcnt : OUTBUF_MAX_IOV);
+    if (result < 0) {
+      perror("Error writing output");
+      return;
+    }
+    // skip the areas written, and the written part of the last one
+    size_t written = (size_t)result;
+    while (iovcnt > 0 && written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char*)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+}
@@ -1,8 +1,31 @@
 #ifndef KVS_IO_H
 #define KVS_IO_H
 
+#include <sys/uio.h>
 #include <unistd.h>
 
+// bytes an output buffer holds before it is written to its file
+#define OUTBUF_SIZE (64 * 1024)
+
+/// Function an output buffer can hand its bytes to instead of writing them to
+/// its file. Called with the buffer's OUTBUF_SIZE bytes of storage and how
+/// many of them are used, whether the caller needs them written before it
+/// returns (outbuf_flush), and the argument given with it. Returns the
+/// storage the buffer goes on with: the same one once the bytes were
+/// written, or another of OUTBUF_SIZE bytes if the sink kept it to write
+/// later.
+typedef char *(*OutSink)(char *data, size_t len, int sync, void *arg);
+
+/// Output stream that gathers many small writes into few write() calls.
+typedef struct {
+  int fd;
+  size_t len;
+  OutSink sink; // NULL to write to fd
+  void *sink_arg;
+  char *data; // storage, or one given by the sink
+  char storage[OUTBUF_SIZE];
+} OutBuffer;
+
 /// Writes a string to the given file descriptor.
 /// @param fd The file descriptor to write to.
 /// @param str The string to write.
@@ -20,4 +43,52 @@ void write_uint(int fd, int value);
 /// @return Number of bytes copied
 size_t strn_memcpy(char *dest, const char *src, size_t n);
 
+/// @brief Initializes an output buffer
+/// @param out buffer to initialize
+/// @param fd file descriptor the buffer is flushed to
+void outbuf_init(OutBuffer *out, int fd);
+
+/// @brief Makes a buffer hand its bytes to a sink rather than write them
+/// @param out buffer, initialized and empty; when removing a sink, it must
+/// not hold any storage given by the sink anymore
+/// @param sink function receiving the bytes, NULL to write them to the file
+/// @param arg argument passed to sink
+void outbuf_set_sink(OutBuffer *out, OutSink sink, void *arg);
+
+/// @brief Writes everything buffered to the buffer's file, or hands it to
+/// the sink, waiting until the sink wrote it
+/// @param out buffer to flush
+void outbuf_flush(OutBuffer *out);
+
+/// @brief Gets room for up to len bytes at the end of the buffer, flushing it
+/// first if they would not fit. The bytes actually used must then be
+/// committed with outbuf_commit.
+/// @param out buffer to write to
+/// @param len maximum number of bytes to be written, at most OUTBUF_SIZE
+/// @return pointer to the reserved bytes
+char *outbuf_reserve(OutBuffer *out, size_t len);
+
+/// @brief Adds reserved bytes to the buffer contents
+/// @param out buffer written to
+/// @param len number of bytes used from the last reservation
+void outbuf_commit(OutBuffer *out, size_t len);
+
+/// @brief Appends bytes to the buffer
+/// @param out buffer to write to
+/// @param data bytes to append
+/// @param len number of bytes
+void outbuf_write(OutBuffer *out, const char *data, size_t len);
+
+/// @brief Appends a string to the buffer
+/// @param out buffer to write to
+/// @param str string to append, without its '\0'
+void outbuf_str(OutBuffer *out, const char *str);
+
+/// @brief Writes everything buffered, then a set of memory areas in order,
+/// with as few writev() calls as possible
+/// @param out buffer to write to
+/// @param iov areas to write, changed to track partial writes
+/// @param iovcnt number of areas
+void outbuf_writev(OutBuffer *out, struct iovec *iov, int iovcnt);
+
 #endif // KVS_IO_H
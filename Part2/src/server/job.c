@@ -0,0 +1,200 @@
+#include "job.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "constants.h"
+#include "operations.h"
+#include "stats.h"
+
+/// Copies tokens to text, terminating each one.
+/// @param tokens Tokens to copy.
+/// @param count Number of tokens.
+/// @param strings Array to store the copies in.
+/// @param text Where the copies are written.
+/// @return The byte of text after the last copy.
+static char *copy_tokens(const Token tokens[], size_t count, char *strings[], char *text) {
+  for (size_t i = 0; i < count; i++) {
+    memcpy(text, tokens[i].ptr, tokens[i].len);
+    text[tokens[i].len] = '\0';
+    strings[i] = text;
+    text += tokens[i].len + 1;
+  }
+  return text;
+}
+
+/// Parses the next command of a job file, reporting invalid ones.
+/// @param reader Reader over the job file.
+/// @param command Command to fill; CMD_INVALID if it could not be parsed.
+/// @param keys Room for MAX_WRITE_SIZE keys.
+/// @param values Room for MAX_WRITE_SIZE values.
+/// @param text Room for MAX_WRITE_SIZE keys and values, moved past the ones
+/// stored.
+/// @return The command parsed, EOC at the end of the file.
+static enum Command parse_command(JobReader *reader, JobCommand *command, char *keys[], char *values[], char **text) {
+  Token key_tokens[MAX_WRITE_SIZE], value_tokens[MAX_WRITE_SIZE];
+  uint64_t start = stats_now();
+  command->cmd = reader_get_next(reader);
+  command->num_pairs = 0;
+  command->keys = keys;
+  command->values = values;
+  command->delay = 0;
+
+  switch (command->cmd) {
+    case CMD_WRITE:
+      command->num_pairs = reader_parse_write(reader, key_tokens, value_tokens, MAX_WRITE_SIZE);
+      if (command->num_pairs == 0) {
+        command->cmd = CMD_INVALID;
+      }
+      *text = copy_tokens(key_tokens, command->num_pairs, keys, *text);
+      *text = copy_tokens(value_tokens, command->num_pairs, values, *text);
+      break;
+
+    case CMD_READ:
+    case CMD_DELETE:
+      command->num_pairs = reader_parse_read_delete(reader, key_tokens, MAX_WRITE_SIZE);
+      if (command->num_pairs == 0) {
+        command->cmd = CMD_INVALID;
+      }
+      *text = copy_tokens(key_tokens, command->num_pairs, keys, *text);
+      break;
+
+    case CMD_WAIT:
+      if (reader_parse_wait(reader, &command->delay, NULL) == -1) {
+        command->cmd = CMD_INVALID;
+      }
+      break;
+
+    case CMD_SHOW:
+    case CMD_BACKUP:
+    case CMD_STATS:
+    case CMD_HELP:
+    case CMD_EMPTY:
+    case CMD_INVALID:
+    case EOC:
+      break;
+  }
+
+  if (command->cmd == CMD_INVALID) {
+    fprintf(stderr, "Invalid command. See HELP for usage\n");
+  }
+  if (command->cmd != EOC) {
+    stats_record(STAT_PARSE, start);
+  }
+  return command->cmd;
+}
+
+static void execute_command(const JobCommand *command, JobState *job) {
+  switch (command->cmd) {
+    case CMD_WRITE:
+      if (kvs_write(command->num_pairs, command->keys, command->values)) {
+        fprintf(stderr, "Failed to write pair\n");
+      }
+      break;
+
+    case CMD_READ:
+      if (kvs_read(command->num_pairs, command->keys, job->out)) {
+        fprintf(stderr, "Failed to read pair\n");
+      }
+      break;
+
+    case CMD_DELETE:
+      if (kvs_delete(command->num_pairs, command->keys, job->out)) {
+        fprintf(stderr, "Failed to delete pair\n");
+      }
+      break;
+
+    case CMD_SHOW:
+      kvs_show(job->out);
+      break;
+
+    case CMD_WAIT:
+      if (command->delay > 0) {
+        kvs_wait(job->out, command->delay);
+      }
+      break;
+
+    case CMD_BACKUP:
+      if (kvs_backup(job->pathname, job->backup_num)) {
+        fprintf(stderr, "Failed to perform backup.\n");
+      } else job->backup_num++;
+      break;
+
+    case CMD_STATS: {
+      char *content = outbuf_reserve(job->out, STATS_OUTPUT_SIZE);
+      outbuf_commit(job->out, stats_format(content));
+      break;
+    }
+
+    case CMD_HELP: {
+      const char *content =
+            "Available commands:\n"
+            "  WRITE [(key,value),(key2,value2),...]\n"
+            "  READ [key,key2,...]\n"
+            "  DELETE [key,key2,...]\n"
+            "  SHOW\n"
+            "  WAIT <delay_ms>\n"
+            "  BACKUP\n"
+            "  STATS\n"
+            "  HELP\n"
+      ;
+      outbuf_str(job->out, content);
+      break;
+    }
+
+    case CMD_INVALID:
+    case CMD_EMPTY:
+    case EOC:
+      break;
+  }
+}
+
+int fill_batch(JobReader *reader, CommandBatch *batch) {
+  size_t pairs = 0;
+  char *text = batch->text;
+  batch->count = 0;
+  batch->last = 0;
+  while (batch->count < JOB_BATCH_COMMANDS && pairs + MAX_WRITE_SIZE <= JOB_BATCH_PAIRS) {
+    JobCommand *command = &batch->commands[batch->count];
+    enum Command cmd = parse_command(reader, command, batch->keys + pairs, batch->values + pairs, &text);
+    if (cmd == EOC) {
+      batch->last = 1;
+      break;
+    }
+    if (cmd != CMD_EMPTY && cmd != CMD_INVALID) {
+      pairs += command->num_pairs;
+      batch->count++;
+    }
+  }
+  return batch->last;
+}
+
+static int is_change(enum Command cmd) {
+  return cmd == CMD_WRITE || cmd == CMD_DELETE;
+}
+
+void run_batch(CommandBatch *batch, JobState *job) {
+  size_t i = 0;
+  while (i < batch->count) {
+    JobCommand *command = &batch->commands[i];
+    if (job->batch_changes && is_change(command->cmd)) {
+      KvsChange changes[JOB_BATCH_COMMANDS];
+      size_t count = 0;
+      for (; i < batch->count && is_change(batch->commands[i].cmd); i++, count++) {
+        changes[count].deleting = batch->commands[i].cmd == CMD_DELETE;
+        changes[count].num_pairs = batch->commands[i].num_pairs;
+        changes[count].keys = batch->commands[i].keys;
+        changes[count].values = batch->commands[i].values;
+      }
+      if (kvs_apply(count, changes, job->out)) {
+        fprintf(stderr, "Failed to apply changes\n");
+      }
+      continue;
+    }
+    if (command->cmd == CMD_WAIT || command->cmd == CMD_BACKUP) {
+      outbuf_flush(job->out);
+    }
+    execute_command(command, job);
+    i++;
+  }
+}
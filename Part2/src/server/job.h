@@ -0,0 +1,62 @@
+#ifndef KVS_JOB_H
+#define KVS_JOB_H
+
+#include <stddef.h>
+
+#include "constants.h"
+#include "io.h"
+#include "parser.h"
+
+// commands parsed into each batch
+#define JOB_BATCH_COMMANDS 64
+// keys (and values) held by each batch, at least MAX_WRITE_SIZE
+#define JOB_BATCH_PAIRS 4096
+// bytes of the terminated keys and values of a full batch
+#define JOB_BATCH_TEXT (JOB_BATCH_PAIRS * 2 * MAX_STRING_SIZE)
+
+// A command parsed from a job file. Keys and values point into the text of
+// the batch holding the command.
+typedef struct {
+  enum Command cmd;
+  size_t num_pairs; // pairs of a WRITE, keys of a READ or DELETE
+  char **keys;
+  char **values; // only used by WRITE
+  unsigned int delay; // only used by WAIT
+} JobCommand;
+
+// State of a job file being run.
+typedef struct {
+  const char *pathname; // path of the job file
+  int backup_num; // number of the next backup
+  OutBuffer *out; // output of the job
+  int batch_changes; // apply runs of WRITE and DELETE under one locking
+} JobState;
+
+// Commands parsed ahead of their execution. Their keys and values are
+// copied from the reader into the batch's text, terminated, since the table
+// takes C strings, and pointed to by the batch's arrays.
+typedef struct {
+  JobCommand commands[JOB_BATCH_COMMANDS];
+  size_t count;
+  int last; // the job file ends with this batch
+  char *keys[JOB_BATCH_PAIRS];
+  char *values[JOB_BATCH_PAIRS];
+  char text[JOB_BATCH_TEXT];
+} CommandBatch;
+
+/// @brief Parses the next commands of a job file into a batch, until it is
+/// full or has no room for another WRITE
+/// @param reader reader over the job file
+/// @param batch batch to fill
+/// @return 1 if the batch holds the last commands of the file, 0 otherwise
+int fill_batch(JobReader *reader, CommandBatch *batch);
+
+/// @brief Runs the commands of a batch in order. WAIT and BACKUP are
+/// barriers: the output of every command before them is flushed first.
+/// With batch_changes, runs of consecutive WRITE and DELETE commands are
+/// applied together
+/// @param batch commands to run
+/// @param job job file the commands belong to
+void run_batch(CommandBatch *batch, JobState *job);
+
+#endif // KVS_JOB_H
@@ -2,160 +2,243 @@
 #include "string.h"
 #include <stdio.h>
 #include <stdlib.h>
-#include <ctype.h>
-#include <src/common/io.h>
-
-// Hash function based on key initial.
-// @param key Lowercase alphabetical string.
-// @return hash.
-// NOTE: This is not an ideal hash function, but is useful for test purposes of the project
-int hash(const char *key) {
-    int firstLetter = tolower(key[0]);
-    if (firstLetter >= 'a' && firstLetter <= 'z') {
-        return firstLetter - 'a';
-    } else if (firstLetter >= '0' && firstLetter <= '9') {
-        return firstLetter - '0';
-    }
-    return -1; // Invalid index for non-alphabetic or number strings
+#include "notifier.h"
+#include "stats.h"
+
+// Multiply-and-fold constants, as used by wyhash.
+#define HASH_P0 0xa0761d6478bd642fULL
+#define HASH_P1 0xe7037ed1a0b428dbULL
+#define HASH_P2 0x8ebc6af09c88c6e3ULL
+
+static uint64_t hash_mix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
 }
 
-/// @brief Initializes clients of a new key
-/// @param key
-void initKeyClients(KeyNode** keyNode) {
-    for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-        (*keyNode)->clients[i] = -1;
+static uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// wyhash-style hash over every byte of the key.
+uint64_t hash(const char *key) {
+    const unsigned char *p = (const unsigned char *)key;
+    size_t len = strlen(key);
+    uint64_t seed = HASH_P0 ^ hash_mix(len ^ HASH_P0, HASH_P1);
+    uint64_t a, b;
+
+    if (len <= 16) {
+        if (len >= 8) {
+            a = read64(p);
+            b = read64(p + len - 8);
+        } else if (len >= 4) {
+            a = read32(p);
+            b = read32(p + len - 4);
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        while (i > 16) {
+            seed = hash_mix(read64(p) ^ HASH_P1, read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
     }
+    return hash_mix(HASH_P1 ^ len, hash_mix(a ^ HASH_P1, b ^ seed ^ HASH_P2));
 }
 
-struct HashTable* create_hash_table() {
-  HashTable *ht = malloc(sizeof(HashTable));
-  if (!ht) return NULL;
-  for (int i = 0; i < TABLE_SIZE; i++) {
-      ht->table[i] = NULL;
-  }
-  return ht;
+size_t key_stripe(HashTable *ht, const char *key) {
+    return (size_t)(hash(key) & (ht->num_stripes - 1));
 }
 
-int write_pair(HashTable *ht, const char *key, const char *value) {
-    int index = hash(key);
+// Notification pipes of the clients subscribed to a key. Only keys with
+// subscribers have one, grown as clients subscribe. The pipes are kept
+// packed in fds, which notifications are posted from, and indexed by a
+// linear probing table after them (twice as many slots as fds), so adding
+// and removing a client costs the same however many are subscribed.
+typedef struct SubscriberSet {
+    size_t count;
+    size_t capacity; // a power of two
+    int fds[];
+} SubscriberSet;
+
+// subscribers a set has room for when created
+#define INITIAL_SUBSCRIBERS 4
+
+/// Index of a set: each slot holds the position in fds of a subscriber
+/// plus one, or 0 if it is free.
+static uint32_t *subscriber_index(SubscriberSet *set) {
+    return (uint32_t *)(set->fds + set->capacity);
+}
 
-    KeyNode *keyNode = ht->table[index];
+/// Slot of the index a client's lookup starts at.
+static size_t subscriber_home(int notif_fd, size_t mask) {
+    return ((uint32_t)notif_fd * 2654435769u) & mask;
+}
 
-    // Search for the key node
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            free(keyNode->value);
-            keyNode->value = strdup(value);
-            notify(keyNode, keyNode->value);
-            return SUCCESS;
-        }
-        keyNode = keyNode->next; // Move to the next node
+/// Slot of the index holding a client, or the free slot it would go in.
+static size_t find_subscriber(SubscriberSet *set, int notif_fd) {
+    uint32_t *index = subscriber_index(set);
+    size_t mask = 2 * set->capacity - 1;
+    size_t i = subscriber_home(notif_fd, mask);
+    while (index[i] != 0 && set->fds[index[i] - 1] != notif_fd) {
+        i = (i + 1) & mask;
     }
+    return i;
+}
 
-    // Key not found, create a new key node
-    keyNode = malloc(sizeof(KeyNode));
-    keyNode->key = strdup(key); // Allocate memory for the key
-    keyNode->value = strdup(value); // Allocate memory for the value
-    initKeyClients(&keyNode); // inicializa os clientes subscritos a essa chave
-    keyNode->next = ht->table[index]; // Link to existing nodes
-    ht->table[index] = keyNode; // Place new key node at the start of the list
-
-    return SUCCESS;
+void initKeyClients(KeyNode** keyNode) {
+    (*keyNode)->subscribers = NULL;
 }
 
-char* read_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-    char* value;
-
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            value = strdup(keyNode->value);
-            return value; // Return copy of the value if found
-        }
-        keyNode = keyNode->next; // Move to the next node
+int add_subscriber(KeyNode *keyNode, int notif_fd) {
+    SubscriberSet *set = keyNode->subscribers;
+    if (set != NULL && subscriber_index(set)[find_subscriber(set, notif_fd)] != 0) {
+        return 1;
     }
-    return NULL; // Key not found
-}
-
-int delete_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-    KeyNode *prevNode = NULL;
-
-    // Search for the key node
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            // Key found; delete this node
-            if (prevNode == NULL) {
-                // Node to delete is the first node in the list
-                ht->table[index] = keyNode->next; // Update the table to point to the next node
-            } else {
-                // Node to delete is not the first; bypass it
-                prevNode->next = keyNode->next; // Link the previous node to the next node
-            }
-            // Free the memory allocated for the key and value
-            notify(keyNode, NULL); // notify subscribed clients of deletion
-            free(keyNode->key);
-            free(keyNode->value);
-            free(keyNode); // Free the key node itself
-            return 0; // Exit the function
+    if (set == NULL || set->count == set->capacity) {
+        size_t capacity = set != NULL ? set->capacity * 2 : INITIAL_SUBSCRIBERS;
+        SubscriberSet *grown = calloc(1, sizeof(SubscriberSet) + capacity * sizeof(int) +
+                                             2 * capacity * sizeof(uint32_t));
+        if (grown == NULL) {
+            return 0;
+        }
+        grown->capacity = capacity;
+        // the index is rebuilt for the larger table
+        for (size_t i = 0; set != NULL && i < set->count; i++) {
+            grown->fds[i] = set->fds[i];
+            subscriber_index(grown)[find_subscriber(grown, set->fds[i])] = (uint32_t)i + 1;
+            grown->count++;
         }
-        prevNode = keyNode; // Move prevNode to current node
-        keyNode = keyNode->next; // Move to the next node
+        free(set);
+        keyNode->subscribers = set = grown;
     }
-    
+    set->fds[set->count++] = notif_fd;
+    subscriber_index(set)[find_subscriber(set, notif_fd)] = (uint32_t)set->count;
     return 1;
 }
 
-KeyNode* get_key_node(HashTable *ht, const char *key) {
-    // get hash_table index
-    if (ht == NULL || key == NULL) {
-        return NULL;
+int remove_subscriber(KeyNode *keyNode, int notif_fd) {
+    SubscriberSet *set = keyNode->subscribers;
+    if (set == NULL) {
+        return FAILURE;
+    }
+    uint32_t *index = subscriber_index(set);
+    size_t i = find_subscriber(set, notif_fd);
+    if (index[i] == 0) {
+        return FAILURE;
+    }
+    size_t position = index[i] - 1;
+
+    // the slots after it that probed past it move back, so no lookup stops
+    // short at the freed slot
+    size_t mask = 2 * set->capacity - 1;
+    for (size_t j = (i + 1) & mask; index[j] != 0; j = (j + 1) & mask) {
+        size_t home = subscriber_home(set->fds[index[j] - 1], mask);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            index[i] = index[j];
+            i = j;
+        }
+    }
+    index[i] = 0;
+
+    // the last client fills its place in fds
+    if (--set->count == 0) {
+        free(set);
+        keyNode->subscribers = NULL;
+    } else if (position < set->count) {
+        int last = set->fds[set->count];
+        index[find_subscriber(set, last)] = (uint32_t)position + 1;
+        set->fds[position] = last;
+    }
+    return SUCCESS;
+}
+
+void free_subscribers(KeyNode *keyNode) {
+    free(keyNode->subscribers);
+    keyNode->subscribers = NULL;
+}
+
+static void free_node_subscribers(KeyNode *keyNode, void *arg) {
+    (void) arg;
+    free_subscribers(keyNode);
+}
+
+void free_all_subscribers(HashTable *ht) {
+    for (size_t i = 0; i < ht->num_stripes; i++) {
+        visit_nodes(ht, i, free_node_subscribers, NULL);
     }
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
+}
 
-    // search key in hash_table index
-    while (keyNode != NULL && strcmp(keyNode->key, key)) {
-        keyNode = keyNode->next;
+char* read_pair(HashTable *ht, const char *key) {
+    KeyNode *keyNode = get_key_node(ht, key);
+    if (keyNode == NULL) {
+        return NULL; // Key not found
     }
+    return strdup(keyNode->value); // Return copy of the value if found
+}
 
-    return keyNode;
+const char* lookup_value(HashTable *ht, const char *key) {
+    KeyNode *keyNode = get_key_node(ht, key);
+    return keyNode != NULL ? keyNode->value : NULL;
 }
 
-int notify(KeyNode *keyNode, char *value) {
-    // Escrever mensagem para os notifications pipes dos clientes
-    for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-        if (keyNode->clients[i] != -1) {
-            char message[2*(MAX_STRING_SIZE+1)];
-            // Construir mensagem
-            memset(message, '\0', sizeof(message));
-            strcpy(message, keyNode->key);
-            if (value == NULL) {
-                strcpy(message + MAX_STRING_SIZE + 1, "DELETED");
-            } else {
-                strcpy(message + MAX_STRING_SIZE + 1, value);
-            }
-            if (write_all(keyNode->clients[i], message, sizeof(message)) == -1){
-                perror("Erro ao escrever para o pipe de notificações\n");
-                return  FAILURE;
-            }
-        }
+uint64_t start_version(HashTable *ht) {
+    return ht->version++;
+}
+
+size_t table_count(HashTable *ht) {
+    size_t count = 0;
+    for (size_t i = 0; i < ht->num_stripes; i++) {
+        count += ht->segments[i].count;
     }
-  return SUCCESS;
-}
-
-void free_table(HashTable *ht) {
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        KeyNode *keyNode = ht->table[i];
-        while (keyNode != NULL) {
-            KeyNode *temp = keyNode;
-            keyNode = keyNode->next;
-            free(temp->key);
-            free(temp->value);
-            free(temp);
-        }
+    return count;
+}
+
+// Writers of a segment are serialized by its stripe lock, so seq only needs
+// to be published in order with the changes it guards.
+void segment_write_begin(Segment *segment) {
+    unsigned seq = atomic_load_explicit(&segment->seq, memory_order_relaxed);
+    atomic_store_explicit(&segment->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+void segment_write_end(Segment *segment) {
+    unsigned seq = atomic_load_explicit(&segment->seq, memory_order_relaxed);
+    atomic_store_explicit(&segment->seq, seq + 1, memory_order_release);
+}
+
+unsigned segment_read_begin(Segment *segment) {
+    return atomic_load_explicit(&segment->seq, memory_order_acquire);
+}
+
+int segment_read_valid(Segment *segment, unsigned seq) {
+    atomic_thread_fence(memory_order_acquire);
+    return (seq & 1) == 0 && atomic_load_explicit(&segment->seq, memory_order_relaxed) == seq;
+}
+
+int notify(KeyNode *keyNode, char *value) {
+    SubscriberSet *set = keyNode->subscribers;
+    if (set == NULL) {
+        return SUCCESS;
     }
-    free(ht);
-}
\ No newline at end of file
+    // only changes to subscribed keys are timed; the dispatcher writes to
+    // the clients' pipes, so a slow client never holds up the writer
+    uint64_t start = stats_now();
+    int result = notifier_post(set->fds, set->count, keyNode->key, value != NULL ? value : "DELETED");
+    stats_record(STAT_NOTIFY, start);
+    return result;
+}
@@ -1,35 +1,147 @@
 #ifndef KEY_VALUE_STORE_H
 #define KEY_VALUE_STORE_H
 
-#define TABLE_SIZE 26
+// largest number of table segments; each segment is guarded by its own lock
+// stripe, and their number is chosen when the table is created
+#define MAX_STRIPE_BITS 10
+#define MAX_TABLE_STRIPES (1 << MAX_STRIPE_BITS)
+// segments and stripe locks are aligned to it, so neighbours never share a line
+#define CACHE_LINE_SIZE 64
+// buckets of a segment when the table is created (power of two)
+#define INITIAL_SEGMENT_SIZE 8
+// average chain length that makes a segment start growing
+#define MAX_LOAD_FACTOR 2
+// buckets moved to the grown array by each write while a segment is growing
+#define REHASH_STEP 4
 
 #include "src/common/constants.h"
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#ifdef KVS_OPEN_ADDRESSING
+
+// slots probed together by one SIMD comparison of their control bytes
+#define GROUP_SIZE 16
+
+// Node stored inline in the slot array of an open addressing segment. Keys and
+// values are short enough to live next to each other in the slot.
+typedef struct KeyNode {
+    uint64_t hash;
+    uint64_t version; // table version when the value was last written
+    char key[MAX_STRING_SIZE];
+    char value[MAX_STRING_SIZE];
+    // notification pipes of the subscribed clients, NULL while there are none
+    struct SubscriberSet *subscribers;
+} KeyNode;
+
+/// Part of the table owned by a single lock stripe, laid out as a Swiss table:
+/// ctrl holds one byte per slot, either EMPTY, DELETED or 7 bits of the hash
+/// of the key in that slot, so a lookup only touches the slots whose byte
+/// matches. A segment is rehashed on its own when it fills up.
+typedef struct Segment {
+    _Alignas(CACHE_LINE_SIZE) int8_t *ctrl;
+    KeyNode *slots;
+    size_t capacity; // number of slots, a power of two multiple of GROUP_SIZE
+    size_t count;
+    size_t tombstones; // DELETED control bytes
+    atomic_uint seq; // odd while a writer changes the segment
+} Segment;
+
+#else
 
 typedef struct KeyNode {
     char *key;
     char *value;
-    // file descriptors for subscribed client's notifications pipes
-    int clients[MAX_SESSION_COUNT];
+    // full hash of the key, kept to skip most string comparisons and rehashing
+    uint64_t hash;
+    uint64_t version; // table version when the value was last written
+    // notification pipes of the subscribed clients, NULL while there are none
+    struct SubscriberSet *subscribers;
     struct KeyNode *next;
 } KeyNode;
 
+// Bucket array of a segment. The size lives with the buckets so that readers
+// without locks load both through a single pointer.
+typedef struct BucketArray {
+    size_t size;
+    KeyNode *buckets[];
+} BucketArray;
+
+/// Part of the table owned by a single lock stripe. A segment grows
+/// incrementally: while rehash_table is set, every write moves a few buckets
+/// from table into rehash_table, and lookups search both arrays. Writers hold
+/// the stripe lock; readers walk the chains without locks, inside an epoch.
+typedef struct Segment {
+    _Alignas(CACHE_LINE_SIZE) BucketArray *table;
+    BucketArray *rehash_table;
+    size_t rehash_index; // next bucket of table to be moved
+    size_t count;
+    atomic_uint seq; // odd while a writer changes the segment
+} Segment;
+
+// values are read without taking the stripe locks
+#define KVS_LOCK_FREE_READS
+
+#endif
+
 typedef struct HashTable {
-    KeyNode *table[TABLE_SIZE];
+    Segment *segments; // one per stripe, each on its own cache lines
+    size_t num_stripes; // a power of two, at most MAX_TABLE_STRIPES
+    // stamped on every node written; raised when a backup starts, so nodes
+    // stamped with an older version are unchanged since it started
+    uint64_t version;
+#ifndef KVS_OPEN_ADDRESSING
+    // nodes, keys and values of the chained backend
+    struct SlabAllocator *allocator;
+    // snapshot mapped by adopt_mapping; its keys and values are used in place
+    char *mapping;
+    size_t mapping_len;
+#endif
 } HashTable;
 
-/// @brief Hashing function to transform the key of the pair into an index
+/// @brief Hashing function over the whole key
 /// @param key Key of the pair
-/// @return Index of key to hash_table
-int hash(const char *key);
+/// @return 64-bit hash of the key
+uint64_t hash(const char *key);
 
-/// @brief Initializes all clients subscribed to key with -1
+/// @brief Gets the lock stripe (and table segment) that holds a key
+/// @param ht hashtable
+/// @param key Key of the pair
+/// @return Stripe index, lower than ht->num_stripes
+size_t key_stripe(HashTable *ht, const char *key);
+
+/// @brief Initializes a new key with no subscribed clients
 /// @param keyNode keyNode to initialize
 void initKeyClients(KeyNode** keyNode);
 
+/// @brief Subscribes a client to a key. The caller must hold the write lock
+/// of the key's stripe.
+/// @param keyNode keyNode of the key
+/// @param notif_fd notifications pipe of the client
+/// @return 1 if the client is subscribed, 0 if there was no memory for it
+int add_subscriber(KeyNode *keyNode, int notif_fd);
+
+/// @brief Unsubscribes a client from a key. The caller must hold the write
+/// lock of the key's stripe.
+/// @param keyNode keyNode of the key
+/// @param notif_fd notifications pipe of the client
+/// @return 0 if the client was subscribed, 1 otherwise
+int remove_subscriber(KeyNode *keyNode, int notif_fd);
+
+/// @brief Unsubscribes every client from a key being deleted
+/// @param keyNode keyNode of the key
+void free_subscribers(KeyNode *keyNode);
+
+/// @brief Unsubscribes every client from every key, before the table is freed
+/// @param ht hashtable
+void free_all_subscribers(HashTable *ht);
+
 /// Creates a new event hash table.
+/// @param num_stripes Number of segments, each guarded by its own lock
+/// stripe; a power of two, at most MAX_TABLE_STRIPES.
 /// @return Newly created hash table, NULL on failure
-struct HashTable *create_hash_table();
+struct HashTable *create_hash_table(size_t num_stripes);
 
 /// Appends a new key value pair to the hash table.
 /// @param ht Hash table to be modified.
@@ -38,12 +150,49 @@ struct HashTable *create_hash_table();
 /// @return 0 if the node was appended successfully, 1 otherwise.
 int write_pair(HashTable *ht, const char *key, const char *value);
 
+/// Sizes the segments of an empty table for a number of pairs, so loading
+/// them does not grow the segments one write at a time.
+/// @param ht Hash table about to be loaded.
+/// @param count Number of pairs to be loaded.
+/// @return 0 on success, 1 otherwise.
+int reserve_pairs(HashTable *ht, size_t count);
+
+/// Tells a table about to adopt pairs where the mapped snapshot they point
+/// into lies, so the strings it replaces in the mapping are never freed.
+/// @param ht Hash table about to be loaded.
+/// @param addr Start of the mapping.
+/// @param len Length of the mapping.
+void expect_mapping(HashTable *ht, const void *addr, size_t len);
+
+/// Hands over the mapped snapshot the pairs given to adopt_pair point into,
+/// once they are all stored. The table unmaps it when freed, or at once if
+/// the backend copied the pairs. A table adopts at most one mapping.
+/// @param ht Hash table the snapshot was loaded into.
+/// @param addr Start of the mapping.
+/// @param len Length of the mapping.
+void adopt_mapping(HashTable *ht, void *addr, size_t len);
+
+/// Stores a pair whose key and value live in the adopted mapping, using them
+/// in place where the backend allows it.
+/// @param ht Hash table to be modified.
+/// @param key Key of the pair, inside the mapping.
+/// @param value Value of the pair, inside the mapping.
+/// @return 0 if the pair was stored successfully, 1 otherwise.
+int adopt_pair(HashTable *ht, const char *key, const char *value);
+
 /// Deletes the value of given key.
 /// @param ht Hash table to delete from.
 /// @param key Key of the pair to be deleted.
 /// @return 0 if the node was deleted successfully, 1 otherwise.
 char* read_pair(HashTable *ht, const char *key);
 
+/// Gets the stored value of a key without copying it.
+/// @param ht Hash table to search.
+/// @param key Key of the pair to read.
+/// @return Value of the pair, or NULL if the key is not stored. The value is
+/// only valid while the caller holds the lock of the key's stripe.
+const char* lookup_value(HashTable *ht, const char *key);
+
 /// Appends a new node to the list.
 /// @param list Event list to be modified.
 /// @param key Key of the pair to read.
@@ -60,9 +209,72 @@ void free_table(HashTable *ht);
 /// @return keyNode with a certain key
 KeyNode* get_key_node(HashTable *ht, const char *key);
 
-/// @brief notifies all subscribed clients of a change in key
+/// @brief Starts a new version of the table. The caller must hold every
+/// stripe lock.
+/// @param ht hashtable
+/// @return previous version: nodes stamped with it or an older one were not
+/// written after this call
+uint64_t start_version(HashTable *ht);
+
+/// @brief Calls visit for every node stored in a stripe
+/// @param ht hashtable
+/// @param stripe stripe to walk, the caller must hold its lock
+/// @param visit function called with each node and arg
+/// @param arg argument passed to visit
+void visit_nodes(HashTable *ht, size_t stripe, void (*visit)(KeyNode*, void*), void *arg);
+
+/// @brief Counts the pairs stored in the table
+/// @param ht hashtable, the caller must hold every stripe lock
+/// @return number of pairs
+size_t table_count(HashTable *ht);
+
+/// @brief Starts a change to a segment; optimistic reads of it that overlap
+/// the change fail validation. The caller must hold the segment's stripe lock.
+/// @param segment segment about to change
+void segment_write_begin(Segment *segment);
+
+/// @brief Ends a change started with segment_write_begin
+/// @param segment segment that changed
+void segment_write_end(Segment *segment);
+
+/// @brief Starts an optimistic read of a segment, without taking its lock
+/// @param segment segment to read
+/// @return sequence number to validate the read with
+unsigned segment_read_begin(Segment *segment);
+
+/// @brief Checks that no writer changed a segment during an optimistic read
+/// @param segment segment read
+/// @param seq number returned by segment_read_begin
+/// @return 1 if everything read since segment_read_begin is consistent, 0 otherwise
+int segment_read_valid(Segment *segment, unsigned seq);
+
+/// @brief Copies the value of a key without holding its stripe lock. With
+/// KVS_LOCK_FREE_READS the copy never fails and seq is not used; otherwise
+/// every pointer is validated before it is followed, so a concurrent writer
+/// makes the copy fail instead of crashing it.
+/// @param ht hashtable
+/// @param key key to search for
+/// @param dest where to copy the value, with room for MAX_STRING_SIZE bytes
+/// @param seq number returned by segment_read_begin for the key's segment
+/// @return 1 if the value was copied, 0 if the key is not stored, -1 if a
+/// writer changed the segment
+int copy_value(HashTable *ht, const char *key, char *dest, unsigned seq);
+
+/// @brief Calls visit with a copy of every pair of a stripe, without holding
+/// its lock
+/// @param ht hashtable
+/// @param stripe stripe to walk
+/// @param seq number returned by segment_read_begin for the stripe's segment
+/// @param visit function called with each key, value and arg
+/// @param arg argument passed to visit
+/// @return 0 if the pairs visited are consistent, -1 if a writer changed the
+/// segment and they must be discarded
+int copy_pairs(HashTable *ht, size_t stripe, unsigned seq, void (*visit)(const char*, const char*, void*), void *arg);
+
+/// @brief notifies all subscribed clients of a change in key, queueing the
+/// notification for the dispatcher
 /// @param keyNode keyNode changed
-/// @param value value key was changed to
+/// @param value value key was changed to, NULL if it was deleted
 /// @return 0 if operation is successful, 1 otherwise
 int notify(KeyNode *keyNode, char *value);
 
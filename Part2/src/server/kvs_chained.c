@@ -0,0 +1,489 @@
+#include "kvs.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "epoch.h"
+#include "slab.h"
+#include "src/common/constants.h"
+
+// Separate chaining backend: every bucket of a segment holds a linked list of
+// nodes. Nodes, keys and values come from the table's slab allocator.
+//
+// Readers take no locks. Writers, serialized by the stripe locks, only publish
+// fully built nodes, arrays and values, never change a node that readers can
+// reach other than swapping its value, and retire whatever they unlink: it is
+// released once every reader that could still hold it left its epoch.
+//
+// Pairs loaded from a mapped snapshot keep their keys and values in the
+// mapping until they are overwritten or deleted; only their nodes are
+// allocated.
+
+static char *copy_string(SlabAllocator *allocator, const char *str) {
+    size_t size = strlen(str) + 1;
+    char *copy = slab_alloc(allocator, size);
+    if (copy != NULL) {
+        memcpy(copy, str, size);
+    }
+    return copy;
+}
+
+static void free_string(SlabAllocator *allocator, char *str) {
+    slab_free(allocator, str, strlen(str) + 1);
+}
+
+static int in_mapping(HashTable *ht, const char *str) {
+    return ht->mapping != NULL && str >= ht->mapping && str < ht->mapping + ht->mapping_len;
+}
+
+static void release_string(void *str, void *table) {
+    HashTable *ht = table;
+    if (!in_mapping(ht, str)) {
+        free_string(ht->allocator, str);
+    }
+}
+
+static void release_node(void *keyNode, void *allocator) {
+    slab_free(allocator, keyNode, sizeof(KeyNode));
+}
+
+static void release_array(void *array, void *unused) {
+    (void) unused;
+    free(array);
+}
+
+static BucketArray *create_array(size_t size) {
+    BucketArray *array = calloc(1, sizeof(BucketArray) + size * sizeof(KeyNode*));
+    if (array != NULL) {
+        array->size = size;
+    }
+    return array;
+}
+
+// Makes a pointer visible to readers only after everything it points to.
+static void publish(KeyNode **link, KeyNode *keyNode) {
+    __atomic_store_n(link, keyNode, __ATOMIC_RELEASE);
+}
+
+static KeyNode *load_link(KeyNode **link) {
+    return __atomic_load_n(link, __ATOMIC_ACQUIRE);
+}
+
+// Bucket of a hash inside a bucket array, using the bits above any stripe.
+static size_t bucket_index(uint64_t h, size_t size) {
+    return (size_t)(h >> MAX_STRIPE_BITS) & (size - 1);
+}
+
+// Moves one bucket of a growing segment to the grown array. A reader may be
+// walking the old chain, so its nodes are not relinked: copies are linked into
+// the grown array first, and only then is the old chain cut and retired.
+// @return 0 on success, 1 if the copies could not be allocated.
+static int move_bucket(HashTable *ht, Segment *segment, size_t index) {
+    BucketArray *grown = segment->rehash_table;
+    KeyNode *chain = segment->table->buckets[index];
+
+    KeyNode *copies = NULL;
+    for (KeyNode *keyNode = chain; keyNode != NULL; keyNode = keyNode->next) {
+        KeyNode *copy = slab_alloc(ht->allocator, sizeof(KeyNode));
+        if (copy == NULL) {
+            while (copies != NULL) {
+                KeyNode *next = copies->next;
+                slab_free(ht->allocator, copies, sizeof(KeyNode));
+                copies = next;
+            }
+            return 1;
+        }
+        *copy = *keyNode; // shares the key and value strings
+        copy->next = copies;
+        copies = copy;
+    }
+
+    while (copies != NULL) {
+        KeyNode *next = copies->next;
+        KeyNode **head = &grown->buckets[bucket_index(copies->hash, grown->size)];
+        copies->next = *head;
+        publish(head, copies);
+        copies = next;
+    }
+
+    publish(&segment->table->buckets[index], NULL);
+    while (chain != NULL) {
+        KeyNode *next = chain->next;
+        epoch_retire(chain, release_node, ht->allocator);
+        chain = next;
+    }
+    return 0;
+}
+
+// Moves up to REHASH_STEP buckets of a growing segment to its new array, and
+// installs the new array once every bucket was moved.
+static void rehash_step(HashTable *ht, Segment *segment) {
+    for (int step = 0; step < REHASH_STEP && segment->rehash_index < segment->table->size; step++) {
+        if (move_bucket(ht, segment, segment->rehash_index) != 0) {
+            return; // try again on the next write
+        }
+        segment->rehash_index++;
+    }
+
+    if (segment->rehash_index == segment->table->size) {
+        // table is replaced before rehash_table is cleared, see find_node
+        BucketArray *old = segment->table;
+        __atomic_store_n(&segment->table, segment->rehash_table, __ATOMIC_RELEASE);
+        __atomic_store_n(&segment->rehash_table, NULL, __ATOMIC_RELEASE);
+        segment->rehash_index = 0;
+        epoch_retire(old, release_array, NULL);
+    }
+}
+
+// Starts growing a segment once its load factor is exceeded. If the new array
+// cannot be allocated the segment simply keeps its current size.
+static void maybe_grow(Segment *segment) {
+    size_t size = segment->table->size;
+    if (segment->rehash_table != NULL || segment->count <= size * MAX_LOAD_FACTOR) {
+        return;
+    }
+    BucketArray *grown = create_array(size * 2);
+    if (grown == NULL) {
+        return;
+    }
+    segment->rehash_index = 0;
+    __atomic_store_n(&segment->rehash_table, grown, __ATOMIC_RELEASE);
+}
+
+// Gets the link that points to the node of a key, or NULL if it is not stored.
+// Only writers, holding the stripe lock, change links.
+static KeyNode **find_slot(Segment *segment, uint64_t h, const char *key) {
+    KeyNode **slot = &segment->table->buckets[bucket_index(h, segment->table->size)];
+    for (KeyNode **it = slot; *it != NULL; it = &(*it)->next) {
+        if ((*it)->hash == h && strcmp((*it)->key, key) == 0) {
+            return it;
+        }
+    }
+    if (segment->rehash_table != NULL) {
+        BucketArray *grown = segment->rehash_table;
+        slot = &grown->buckets[bucket_index(h, grown->size)];
+        for (KeyNode **it = slot; *it != NULL; it = &(*it)->next) {
+            if ((*it)->hash == h && strcmp((*it)->key, key) == 0) {
+                return it;
+            }
+        }
+    }
+    return NULL;
+}
+
+static KeyNode *search_chain(BucketArray *array, uint64_t h, const char *key) {
+    KeyNode *keyNode = load_link(&array->buckets[bucket_index(h, array->size)]);
+    for (; keyNode != NULL; keyNode = load_link(&keyNode->next)) {
+        if (keyNode->hash == h && strcmp(keyNode->key, key) == 0) {
+            return keyNode;
+        }
+    }
+    return NULL;
+}
+
+// Finds the node of a key without taking the stripe lock; the caller must be
+// inside an epoch or hold the lock. A bucket is always linked into the grown
+// array before it is cut from the old one, so a reader that finds neither
+// copy saw table replaced, and searches again.
+static KeyNode *find_node(Segment *segment, uint64_t h, const char *key) {
+    while (1) {
+        BucketArray *table = __atomic_load_n(&segment->table, __ATOMIC_ACQUIRE);
+        KeyNode *keyNode = search_chain(table, h, key);
+        if (keyNode != NULL) {
+            return keyNode;
+        }
+        BucketArray *grown = __atomic_load_n(&segment->rehash_table, __ATOMIC_ACQUIRE);
+        if (grown != NULL && (keyNode = search_chain(grown, h, key)) != NULL) {
+            return keyNode;
+        }
+        if (__atomic_load_n(&segment->table, __ATOMIC_ACQUIRE) == table) {
+            return NULL;
+        }
+    }
+}
+
+static Segment *key_segment(HashTable *ht, uint64_t h) {
+    return &ht->segments[h & (ht->num_stripes - 1)];
+}
+
+struct HashTable* create_hash_table(size_t num_stripes) {
+  HashTable *ht = malloc(sizeof(HashTable));
+  if (!ht) return NULL;
+  ht->segments = aligned_alloc(CACHE_LINE_SIZE, num_stripes * sizeof(Segment));
+  ht->allocator = slab_create();
+  if (ht->segments == NULL || ht->allocator == NULL) {
+      free(ht->segments);
+      if (ht->allocator != NULL) slab_destroy(ht->allocator);
+      free(ht);
+      return NULL;
+  }
+  ht->num_stripes = num_stripes;
+  ht->version = 0;
+  ht->mapping = NULL;
+  ht->mapping_len = 0;
+  for (size_t i = 0; i < num_stripes; i++) {
+      Segment *segment = &ht->segments[i];
+      segment->table = create_array(INITIAL_SEGMENT_SIZE);
+      if (segment->table == NULL) {
+          for (size_t j = 0; j < i; j++) {
+              free(ht->segments[j].table);
+          }
+          slab_destroy(ht->allocator);
+          free(ht->segments);
+          free(ht);
+          return NULL;
+      }
+      segment->rehash_table = NULL;
+      segment->rehash_index = 0;
+      segment->count = 0;
+      atomic_init(&segment->seq, 0);
+  }
+  return ht;
+}
+
+// Fills a new node and adds it to its segment.
+static void link_node(HashTable *ht, Segment *segment, KeyNode *keyNode, uint64_t h, char *key, char *value) {
+    keyNode->key = key;
+    keyNode->value = value;
+    keyNode->hash = h;
+    keyNode->version = ht->version;
+    initKeyClients(&keyNode); // inicializa os clientes subscritos a essa chave
+
+    // New nodes go to the grown array while a segment is being rehashed
+    BucketArray *array = segment->rehash_table != NULL ? segment->rehash_table : segment->table;
+    KeyNode **head = &array->buckets[bucket_index(h, array->size)];
+    keyNode->next = *head; // Link to existing nodes
+    publish(head, keyNode); // Place new key node at the start of the list
+    segment->count++;
+
+    maybe_grow(segment);
+}
+
+static int store_pair(HashTable *ht, Segment *segment, uint64_t h, const char *key, const char *value) {
+    if (segment->rehash_table != NULL) {
+        rehash_step(ht, segment);
+    }
+
+    // Search for the key node
+    KeyNode **slot = find_slot(segment, h, key);
+    if (slot != NULL) {
+        // readers may be copying the old value, so it is swapped and retired
+        KeyNode *keyNode = *slot;
+        char *copy = copy_string(ht->allocator, value);
+        if (copy == NULL) {
+            return FAILURE;
+        }
+        char *old = keyNode->value;
+        __atomic_store_n(&keyNode->value, copy, __ATOMIC_RELEASE);
+        keyNode->version = ht->version;
+        epoch_retire(old, release_string, ht);
+        notify(keyNode, keyNode->value);
+        return SUCCESS;
+    }
+
+    // Key not found, create a new key node
+    KeyNode *keyNode = slab_alloc(ht->allocator, sizeof(KeyNode));
+    char *key_copy = copy_string(ht->allocator, key);
+    char *value_copy = copy_string(ht->allocator, value);
+    if (keyNode == NULL || key_copy == NULL || value_copy == NULL) {
+        slab_free(ht->allocator, keyNode, sizeof(KeyNode));
+        if (key_copy != NULL) free_string(ht->allocator, key_copy);
+        if (value_copy != NULL) free_string(ht->allocator, value_copy);
+        return FAILURE;
+    }
+    link_node(ht, segment, keyNode, h, key_copy, value_copy);
+    return SUCCESS;
+}
+
+int write_pair(HashTable *ht, const char *key, const char *value) {
+    if (strlen(key) >= MAX_STRING_SIZE || strlen(value) >= MAX_STRING_SIZE) {
+        return FAILURE;
+    }
+    uint64_t h = hash(key);
+    Segment *segment = key_segment(ht, h);
+
+    segment_write_begin(segment);
+    int result = store_pair(ht, segment, h, key, value);
+    segment_write_end(segment);
+    return result;
+}
+
+int reserve_pairs(HashTable *ht, size_t count) {
+    size_t per_segment = count / ht->num_stripes + 1;
+    size_t size = INITIAL_SEGMENT_SIZE;
+    while (size * MAX_LOAD_FACTOR < per_segment) {
+        size *= 2;
+    }
+    for (size_t i = 0; i < ht->num_stripes; i++) {
+        Segment *segment = &ht->segments[i];
+        if (segment->count > 0 || segment->rehash_table != NULL || segment->table->size >= size) {
+            continue;
+        }
+        BucketArray *array = create_array(size);
+        if (array == NULL) {
+            return FAILURE;
+        }
+        BucketArray *old = segment->table;
+        segment_write_begin(segment);
+        __atomic_store_n(&segment->table, array, __ATOMIC_RELEASE);
+        segment_write_end(segment);
+        epoch_retire(old, release_array, NULL);
+    }
+    return SUCCESS;
+}
+
+// A key adopted twice points to the later value. The old one is retired
+// like any overwritten value; release_string leaves it alone if it lies in
+// the mapping, which expect_mapping made known.
+int adopt_pair(HashTable *ht, const char *key, const char *value) {
+    uint64_t h = hash(key);
+    Segment *segment = key_segment(ht, h);
+    int result = SUCCESS;
+
+    segment_write_begin(segment);
+    if (segment->rehash_table != NULL) {
+        rehash_step(ht, segment);
+    }
+    KeyNode **slot = find_slot(segment, h, key);
+    if (slot != NULL) {
+        char *old = (*slot)->value;
+        __atomic_store_n(&(*slot)->value, (char*) value, __ATOMIC_RELEASE);
+        epoch_retire(old, release_string, ht);
+    } else {
+        KeyNode *keyNode = slab_alloc(ht->allocator, sizeof(KeyNode));
+        if (keyNode == NULL) {
+            result = FAILURE;
+        } else {
+            link_node(ht, segment, keyNode, h, (char*) key, (char*) value);
+        }
+    }
+    segment_write_end(segment);
+    return result;
+}
+
+void expect_mapping(HashTable *ht, const void *addr, size_t len) {
+    ht->mapping = (char*) addr;
+    ht->mapping_len = len;
+}
+
+void adopt_mapping(HashTable *ht, void *addr, size_t len) {
+    ht->mapping = addr;
+    ht->mapping_len = len;
+}
+
+static int remove_pair(HashTable *ht, Segment *segment, uint64_t h, const char *key) {
+    if (segment->rehash_table != NULL) {
+        rehash_step(ht, segment);
+    }
+
+    // Search for the key node
+    KeyNode **slot = find_slot(segment, h, key);
+    if (slot == NULL) {
+        return 1;
+    }
+
+    // Key found; bypass it in its list, readers on it still reach the rest
+    KeyNode *keyNode = *slot;
+    publish(slot, keyNode->next);
+    segment->count--;
+
+    // Give the node, key and value back to the allocator once unreachable
+    notify(keyNode, NULL); // notify subscribed clients of deletion
+    free_subscribers(keyNode);
+    epoch_retire(keyNode->key, release_string, ht);
+    epoch_retire(keyNode->value, release_string, ht);
+    epoch_retire(keyNode, release_node, ht->allocator);
+    return 0;
+}
+
+int delete_pair(HashTable *ht, const char *key) {
+    uint64_t h = hash(key);
+    Segment *segment = key_segment(ht, h);
+
+    segment_write_begin(segment);
+    int result = remove_pair(ht, segment, h, key);
+    segment_write_end(segment);
+    return result;
+}
+
+KeyNode* get_key_node(HashTable *ht, const char *key) {
+    if (ht == NULL || key == NULL) {
+        return NULL;
+    }
+    uint64_t h = hash(key);
+    return find_node(key_segment(ht, h), h, key);
+}
+
+static void visit_array(BucketArray *array, void (*visit)(KeyNode*, void*), void *arg) {
+    for (size_t i = 0; i < array->size; i++) {
+        for (KeyNode *keyNode = load_link(&array->buckets[i]); keyNode != NULL; keyNode = load_link(&keyNode->next)) {
+            visit(keyNode, arg);
+        }
+    }
+}
+
+void visit_nodes(HashTable *ht, size_t stripe, void (*visit)(KeyNode*, void*), void *arg) {
+    Segment *segment = &ht->segments[stripe];
+    visit_array(segment->table, visit, arg);
+    if (segment->rehash_table != NULL) {
+        visit_array(segment->rehash_table, visit, arg);
+    }
+}
+
+int copy_value(HashTable *ht, const char *key, char *dest, unsigned seq) {
+    (void) seq;
+    uint64_t h = hash(key);
+
+    epoch_enter();
+    KeyNode *keyNode = find_node(key_segment(ht, h), h, key);
+    if (keyNode != NULL) {
+        strcpy(dest, __atomic_load_n(&keyNode->value, __ATOMIC_ACQUIRE));
+    }
+    epoch_exit();
+    return keyNode != NULL;
+}
+
+typedef struct {
+    void (*visit)(const char*, const char*, void*);
+    void *arg;
+} PairVisitor;
+
+static void visit_pair(KeyNode *keyNode, void *arg) {
+    PairVisitor *visitor = (PairVisitor*) arg;
+    visitor->visit(keyNode->key, __atomic_load_n(&keyNode->value, __ATOMIC_ACQUIRE), visitor->arg);
+}
+
+// Walks the segment inside an epoch. A node being moved by a rehash may be
+// visited in both arrays or in neither, but then seq has changed too.
+int copy_pairs(HashTable *ht, size_t stripe, unsigned seq, void (*visit)(const char*, const char*, void*), void *arg) {
+    Segment *segment = &ht->segments[stripe];
+    PairVisitor visitor = {visit, arg};
+
+    epoch_enter();
+    BucketArray *table = __atomic_load_n(&segment->table, __ATOMIC_ACQUIRE);
+    BucketArray *grown = __atomic_load_n(&segment->rehash_table, __ATOMIC_ACQUIRE);
+    visit_array(table, visit_pair, &visitor);
+    if (grown != NULL) {
+        visit_array(grown, visit_pair, &visitor);
+    }
+    epoch_exit();
+    return segment_read_valid(segment, seq) ? 0 : -1;
+}
+
+// Nodes, keys and values live in the allocator's slabs and are released with
+// them, so only the bucket arrays are freed one by one. Retired objects are
+// released first, while the allocator and the mapping still exist.
+void free_table(HashTable *ht) {
+    epoch_drain();
+    free_all_subscribers(ht);
+    for (size_t i = 0; i < ht->num_stripes; i++) {
+        free(ht->segments[i].table);
+        free(ht->segments[i].rehash_table);
+    }
+    slab_destroy(ht->allocator);
+    if (ht->mapping != NULL) {
+        munmap(ht->mapping, ht->mapping_len);
+    }
+    free(ht->segments);
+    free(ht);
+}
@@ -0,0 +1,428 @@
+#include "kvs.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "epoch.h"
+#include "src/common/constants.h"
+
+// Open addressing backend (Swiss table). Slots are probed a group at a time:
+// the GROUP_SIZE control bytes of a group are compared against the 7-bit tag
+// of the key in one SSE2 instruction, and only matching slots are compared.
+//
+// Optimistic readers probe a segment while a writer may be changing it. They
+// do so inside an epoch, and slot arrays replaced by a rehash are retired
+// rather than freed, so the arrays a reader validated stay mapped until it
+// leaves; keys and values are copied with a bound.
+
+#define CTRL_EMPTY ((int8_t) -128)
+#define CTRL_DELETED ((int8_t) -2)
+
+// A segment is rehashed once used slots (full or deleted) exceed 7/8.
+#define MAX_FILL_NUM 7
+#define MAX_FILL_DEN 8
+
+// Bit mask with bit i set when byte i of a group satisfies the condition.
+typedef uint32_t GroupMask;
+
+#ifdef __SSE2__
+
+static GroupMask match_tag(const int8_t *group, int8_t tag) {
+    __m128i ctrl = _mm_loadu_si128((const __m128i *) group);
+    return (GroupMask) _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(tag)));
+}
+
+// EMPTY and DELETED are the only control bytes with the sign bit set.
+static GroupMask match_free(const int8_t *group) {
+    return (GroupMask) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) group));
+}
+
+#else
+
+static GroupMask match_tag(const int8_t *group, int8_t tag) {
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++) {
+        if (group[i] == tag) {
+            mask |= (GroupMask) 1 << i;
+        }
+    }
+    return mask;
+}
+
+static GroupMask match_free(const int8_t *group) {
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++) {
+        if (group[i] < 0) {
+            mask |= (GroupMask) 1 << i;
+        }
+    }
+    return mask;
+}
+
+#endif
+
+static int lowest_bit(GroupMask mask) {
+    return __builtin_ctz(mask);
+}
+
+// 7 bits of the hash stored in the control byte of a full slot.
+static int8_t hash_tag(uint64_t h) {
+    return (int8_t) (h >> 57);
+}
+
+// First group probed for a hash, using the bits above any stripe.
+static size_t first_group(uint64_t h, size_t groups) {
+    return (size_t) (h >> MAX_STRIPE_BITS) & (groups - 1);
+}
+
+static Segment *key_segment(HashTable *ht, uint64_t h) {
+    return &ht->segments[h & (ht->num_stripes - 1)];
+}
+
+static int init_segment(Segment *segment, size_t capacity) {
+    segment->ctrl = malloc(capacity * sizeof(int8_t));
+    segment->slots = malloc(capacity * sizeof(KeyNode));
+    if (segment->ctrl == NULL || segment->slots == NULL) {
+        free(segment->ctrl);
+        free(segment->slots);
+        return 1;
+    }
+    memset(segment->ctrl, CTRL_EMPTY, capacity);
+    segment->capacity = capacity;
+    segment->count = 0;
+    segment->tombstones = 0;
+    return 0;
+}
+
+// Finds the slot holding a key, or -1. Probing stops at the first group that
+// has an empty slot, since the key would have been inserted there.
+static long find_index(const Segment *segment, uint64_t h, const char *key) {
+    size_t groups = segment->capacity / GROUP_SIZE;
+    size_t group = first_group(h, groups);
+    int8_t tag = hash_tag(h);
+
+    for (size_t probe = 1; probe <= groups; probe++) {
+        const int8_t *ctrl = segment->ctrl + group * GROUP_SIZE;
+        for (GroupMask mask = match_tag(ctrl, tag); mask != 0; mask &= mask - 1) {
+            size_t index = group * GROUP_SIZE + (size_t) lowest_bit(mask);
+            const KeyNode *slot = &segment->slots[index];
+            if (slot->hash == h && strcmp(slot->key, key) == 0) {
+                return (long) index;
+            }
+        }
+        if (match_tag(ctrl, CTRL_EMPTY) != 0) {
+            return -1;
+        }
+        // triangular probing visits every group of a power of two table
+        group = (group + probe) & (groups - 1);
+    }
+    return -1;
+}
+
+// First empty or deleted slot in the probe sequence of a hash.
+static size_t find_free_index(const Segment *segment, uint64_t h) {
+    size_t groups = segment->capacity / GROUP_SIZE;
+    size_t group = first_group(h, groups);
+
+    for (size_t probe = 1;; probe++) {
+        GroupMask mask = match_free(segment->ctrl + group * GROUP_SIZE);
+        if (mask != 0) {
+            return group * GROUP_SIZE + (size_t) lowest_bit(mask);
+        }
+        group = (group + probe) & (groups - 1);
+    }
+}
+
+static void release_array(void *array, void *unused) {
+    (void) unused;
+    free(array);
+}
+
+// Rebuilds a segment with the given capacity, dropping its tombstones.
+static int rehash_segment(Segment *segment, size_t capacity) {
+    Segment grown;
+    if (init_segment(&grown, capacity) != 0) {
+        return 1;
+    }
+    for (size_t i = 0; i < segment->capacity; i++) {
+        if (segment->ctrl[i] >= 0) {
+            size_t index = find_free_index(&grown, segment->slots[i].hash);
+            grown.ctrl[index] = segment->ctrl[i];
+            grown.slots[index] = segment->slots[i];
+        }
+    }
+    // readers may still be probing the old arrays
+    int8_t *old_ctrl = segment->ctrl;
+    KeyNode *old_slots = segment->slots;
+    segment->ctrl = grown.ctrl;
+    segment->slots = grown.slots;
+    segment->capacity = grown.capacity;
+    segment->tombstones = 0;
+    epoch_retire(old_ctrl, release_array, NULL);
+    epoch_retire(old_slots, release_array, NULL);
+    return 0;
+}
+
+// Makes room for one more key. Segments mostly filled with tombstones are
+// rebuilt in place instead of doubled.
+static int reserve_slot(Segment *segment) {
+    size_t used = segment->count + segment->tombstones + 1;
+    if (used * MAX_FILL_DEN <= segment->capacity * MAX_FILL_NUM) {
+        return 0;
+    }
+    size_t capacity = segment->capacity;
+    if ((segment->count + 1) * 2 * MAX_FILL_DEN > capacity * MAX_FILL_NUM) {
+        capacity *= 2;
+    }
+    return rehash_segment(segment, capacity);
+}
+
+struct HashTable* create_hash_table(size_t num_stripes) {
+  HashTable *ht = malloc(sizeof(HashTable));
+  if (!ht) return NULL;
+  ht->segments = aligned_alloc(CACHE_LINE_SIZE, num_stripes * sizeof(Segment));
+  if (ht->segments == NULL) {
+      free(ht);
+      return NULL;
+  }
+  ht->num_stripes = num_stripes;
+  ht->version = 0;
+  for (size_t i = 0; i < num_stripes; i++) {
+      atomic_init(&ht->segments[i].seq, 0);
+      if (init_segment(&ht->segments[i], GROUP_SIZE) != 0) {
+          for (size_t j = 0; j < i; j++) {
+              free(ht->segments[j].ctrl);
+              free(ht->segments[j].slots);
+          }
+          free(ht->segments);
+          free(ht);
+          return NULL;
+      }
+  }
+  return ht;
+}
+
+static int store_pair(Segment *segment, uint64_t h, const char *key, const char *value, uint64_t version) {
+    // Search for the key node
+    long found = find_index(segment, h, key);
+    if (found >= 0) {
+        KeyNode *keyNode = &segment->slots[found];
+        strcpy(keyNode->value, value);
+        keyNode->version = version;
+        notify(keyNode, keyNode->value);
+        return SUCCESS;
+    }
+
+    // Key not found, store it in the first free slot of its probe sequence
+    if (reserve_slot(segment) != 0) {
+        return FAILURE;
+    }
+    size_t index = find_free_index(segment, h);
+    if (segment->ctrl[index] == CTRL_DELETED) {
+        segment->tombstones--;
+    }
+    segment->ctrl[index] = hash_tag(h);
+    KeyNode *keyNode = &segment->slots[index];
+    keyNode->hash = h;
+    keyNode->version = version;
+    strcpy(keyNode->key, key);
+    strcpy(keyNode->value, value);
+    initKeyClients(&keyNode); // inicializa os clientes subscritos a essa chave
+    segment->count++;
+
+    return SUCCESS;
+}
+
+int write_pair(HashTable *ht, const char *key, const char *value) {
+    if (strlen(key) >= MAX_STRING_SIZE || strlen(value) >= MAX_STRING_SIZE) {
+        return FAILURE;
+    }
+    uint64_t h = hash(key);
+    Segment *segment = key_segment(ht, h);
+
+    segment_write_begin(segment);
+    int result = store_pair(segment, h, key, value, ht->version);
+    segment_write_end(segment);
+    return result;
+}
+
+int reserve_pairs(HashTable *ht, size_t count) {
+    size_t per_segment = count / ht->num_stripes + 1;
+    size_t capacity = GROUP_SIZE;
+    while (per_segment * MAX_FILL_DEN > capacity * MAX_FILL_NUM) {
+        capacity *= 2;
+    }
+    for (size_t i = 0; i < ht->num_stripes; i++) {
+        Segment *segment = &ht->segments[i];
+        if (segment->count > 0 || segment->capacity >= capacity) {
+            continue;
+        }
+        segment_write_begin(segment);
+        int result = rehash_segment(segment, capacity);
+        segment_write_end(segment);
+        if (result != 0) {
+            return FAILURE;
+        }
+    }
+    return SUCCESS;
+}
+
+// Keys and values are stored inline, so adopted pairs are copied like any
+// other and the mapping is not needed once they all are.
+int adopt_pair(HashTable *ht, const char *key, const char *value) {
+    return write_pair(ht, key, value);
+}
+
+void expect_mapping(HashTable *ht, const void *addr, size_t len) {
+    (void) ht;
+    (void) addr;
+    (void) len;
+}
+
+void adopt_mapping(HashTable *ht, void *addr, size_t len) {
+    (void) ht;
+    munmap(addr, len);
+}
+
+static int remove_pair(Segment *segment, uint64_t h, const char *key) {
+    long found = find_index(segment, h, key);
+    if (found < 0) {
+        return 1;
+    }
+    size_t index = (size_t) found;
+    notify(&segment->slots[index], NULL); // notify subscribed clients of deletion
+    free_subscribers(&segment->slots[index]);
+
+    // A slot can go back to EMPTY only if its group already stops lookups;
+    // otherwise keys further along the probe sequence would become unreachable.
+    const int8_t *group = segment->ctrl + (index / GROUP_SIZE) * GROUP_SIZE;
+    if (match_tag(group, CTRL_EMPTY) != 0) {
+        segment->ctrl[index] = CTRL_EMPTY;
+    } else {
+        segment->ctrl[index] = CTRL_DELETED;
+        segment->tombstones++;
+    }
+    segment->count--;
+    return 0;
+}
+
+int delete_pair(HashTable *ht, const char *key) {
+    uint64_t h = hash(key);
+    Segment *segment = key_segment(ht, h);
+
+    segment_write_begin(segment);
+    int result = remove_pair(segment, h, key);
+    segment_write_end(segment);
+    return result;
+}
+
+KeyNode* get_key_node(HashTable *ht, const char *key) {
+    if (ht == NULL || key == NULL) {
+        return NULL;
+    }
+    uint64_t h = hash(key);
+    Segment *segment = key_segment(ht, h);
+    long found = find_index(segment, h, key);
+    return found >= 0 ? &segment->slots[found] : NULL;
+}
+
+void visit_nodes(HashTable *ht, size_t stripe, void (*visit)(KeyNode*, void*), void *arg) {
+    Segment *segment = &ht->segments[stripe];
+    for (size_t i = 0; i < segment->capacity; i++) {
+        if (segment->ctrl[i] >= 0) {
+            visit(&segment->slots[i], arg);
+        }
+    }
+}
+
+// Copies a string that a writer may be changing, stopping at MAX_STRING_SIZE.
+static void copy_bounded(char *dest, const char *src) {
+    size_t i = 0;
+    while (i < MAX_STRING_SIZE - 1 && src[i] != '\0') {
+        dest[i] = src[i];
+        i++;
+    }
+    dest[i] = '\0';
+}
+
+// Looks a key up in the arrays of a segment a writer may be changing. The
+// caller must be inside an epoch, so retired arrays stay mapped.
+// @return 1 if found, 0 if not, -1 if the segment changed meanwhile.
+static int probe_value(Segment *segment, uint64_t h, const char *key, char *dest, unsigned seq) {
+    const int8_t *ctrl = __atomic_load_n(&segment->ctrl, __ATOMIC_ACQUIRE);
+    const KeyNode *slots = __atomic_load_n(&segment->slots, __ATOMIC_ACQUIRE);
+    size_t capacity = __atomic_load_n(&segment->capacity, __ATOMIC_ACQUIRE);
+    if (!segment_read_valid(segment, seq)) {
+        return -1;
+    }
+
+    // same probe sequence as find_index, over the validated arrays
+    size_t groups = capacity / GROUP_SIZE;
+    size_t group = first_group(h, groups);
+    int8_t tag = hash_tag(h);
+    for (size_t probe = 1; probe <= groups; probe++) {
+        const int8_t *group_ctrl = ctrl + group * GROUP_SIZE;
+        for (GroupMask mask = match_tag(group_ctrl, tag); mask != 0; mask &= mask - 1) {
+            const KeyNode *slot = &slots[group * GROUP_SIZE + (size_t) lowest_bit(mask)];
+            if (slot->hash == h && strncmp(slot->key, key, MAX_STRING_SIZE) == 0) {
+                copy_bounded(dest, slot->value);
+                return segment_read_valid(segment, seq) ? 1 : -1;
+            }
+        }
+        if (match_tag(group_ctrl, CTRL_EMPTY) != 0) {
+            break;
+        }
+        group = (group + probe) & (groups - 1);
+    }
+    return segment_read_valid(segment, seq) ? 0 : -1;
+}
+
+int copy_value(HashTable *ht, const char *key, char *dest, unsigned seq) {
+    uint64_t h = hash(key);
+    Segment *segment = key_segment(ht, h);
+
+    epoch_enter();
+    int found = probe_value(segment, h, key, dest, seq);
+    epoch_exit();
+    return found;
+}
+
+int copy_pairs(HashTable *ht, size_t stripe, unsigned seq, void (*visit)(const char*, const char*, void*), void *arg) {
+    Segment *segment = &ht->segments[stripe];
+
+    epoch_enter();
+    const int8_t *ctrl = __atomic_load_n(&segment->ctrl, __ATOMIC_ACQUIRE);
+    const KeyNode *slots = __atomic_load_n(&segment->slots, __ATOMIC_ACQUIRE);
+    size_t capacity = __atomic_load_n(&segment->capacity, __ATOMIC_ACQUIRE);
+    if (!segment_read_valid(segment, seq)) {
+        epoch_exit();
+        return -1;
+    }
+
+    char key[MAX_STRING_SIZE], value[MAX_STRING_SIZE];
+    for (size_t i = 0; i < capacity; i++) {
+        if (ctrl[i] >= 0) {
+            copy_bounded(key, slots[i].key);
+            copy_bounded(value, slots[i].value);
+            visit(key, value, arg);
+        }
+    }
+    epoch_exit();
+    return segment_read_valid(segment, seq) ? 0 : -1;
+}
+
+// Retired slot arrays are released first, with every other retired object.
+void free_table(HashTable *ht) {
+    epoch_drain();
+    free_all_subscribers(ht);
+    for (size_t i = 0; i < ht->num_stripes; i++) {
+        free(ht->segments[i].ctrl);
+        free(ht->segments[i].slots);
+    }
+    free(ht->segments);
+    free(ht);
+}
@@ -13,19 +13,25 @@
 #include "constants.h"
 #include "parser.h"
 #include "operations.h"
-#include "threads.h"
+#include "wal.h"
+#include "scheduler.h"
+#include "job.h"
+#include "pipeline.h"
+#include "notifier.h"
 #include <src/server/client_manager.h>
 
-char *server_pipe;
+ClientManagerConfig manager_config = {NULL, MAX_SESSION_COUNT};
 
 pthread_t client_manager_thread;
 
+// runs of WRITE and DELETE commands are applied as one batch
+static int batch_changes = 0;
+
 /**
  * @brief Reads and parses a single input file
  * @param pathname File to read
- * @param max_backups Maximum simultaneous backups allowed
 */
-void readFile(char pathname[], int max_backups) {
+void readFile(const char *pathname) {
   // open file
   int file = open(pathname, O_RDONLY);
   if (file == -1) {
@@ -33,157 +39,75 @@ void readFile(char pathname[], int max_backups) {
     return;
   }
 
-  int backup_num = 1, simultaneous_backups = 0;
-  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-  unsigned int delay;
-  size_t num_pairs;
-  
   // get .out filename
   char pathname_out[PATH_MAX];
   strcpy(pathname_out, pathname);
   char *dotPos = strrchr(pathname_out, '.');
   strcpy(dotPos, ".out");
 
-  // open output file
+  // open output file, written through a buffer
   int file_out = open(pathname_out, O_CREAT | O_WRONLY | O_TRUNC, 0644);
-
-  // read file
-  int running = 1;
-  while(running) {
-    switch (get_next(file)) {
-      case CMD_WRITE:
-        num_pairs = parse_write(file, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-        if (num_pairs == 0) {
-          fprintf(stderr, "Invalid command. See HELP for usage\n");
-          continue;
-        }
-        if (kvs_write(num_pairs, keys, values)) {
-          fprintf(stderr, "Failed to write pair\n");
-        }
-        break;
-
-      case CMD_READ:
-        num_pairs = parse_read_delete(file, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-
-        if (num_pairs == 0) {
-          fprintf(stderr, "Invalid command. See HELP for usage\n");
-          continue;
-        }
-
-        if (kvs_read(num_pairs, keys, file_out)) {
-          fprintf(stderr, "Failed to read pair\n");
-        }
-        break;
-
-      case CMD_DELETE:
-        num_pairs = parse_read_delete(file, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-
-        if (num_pairs == 0) {
-          fprintf(stderr, "Invalid command. See HELP for usage\n");
-          continue;
-        }
-
-        if (kvs_delete(num_pairs, keys, file_out)) {
-          fprintf(stderr, "Failed to delete pair\n");
-        }
-        break;
-
-      case CMD_SHOW:
-        kvs_show(file_out);
-        break;
-
-      case CMD_WAIT:
-        if (parse_wait(file, &delay, NULL) == -1) {
-          fprintf(stderr, "Invalid command. See HELP for usage\n");
-          continue;
-        }
-
-        if (delay > 0) {
-          kvs_wait(file_out, delay);
-        }
-        break;
-
-      case CMD_BACKUP:
-        if (kvs_backup(pathname, max_backups, &simultaneous_backups, backup_num)) {
-          fprintf(stderr, "Failed to perform backup.\n");
-        } else backup_num++;
-        break;
-
-      case CMD_INVALID:
-        fprintf(stderr, "Invalid command. See HELP for usage\n");
-        break;
-
-      case CMD_HELP: {
-        const char *content = 
-              "Available commands:\n"
-              "  WRITE [(key,value),(key2,value2),...]\n"
-              "  READ [key,key2,...]\n"
-              "  DELETE [key,key2,...]\n"
-              "  SHOW\n"
-              "  WAIT <delay_ms>\n"
-              "  BACKUP\n"
-              "  HELP\n"
-        ;
-        write(file_out, content, strlen(content));
-        break;
-      }
-        
-      case CMD_EMPTY:
-        break;
-
-      case EOC:
-        running = 0;
-        break;
+  OutBuffer *out = malloc(sizeof(OutBuffer));
+  if (file_out == -1 || out == NULL) {
+    fprintf(stderr, "Failed to open output file %s\n", pathname_out);
+    if (file_out != -1) close(file_out);
+    free(out);
+    close(file);
+    return;
+  }
+  outbuf_init(out, file_out);
+
+  // map the whole file, so it is parsed without a read() per block
+  JobReader reader;
+  if (reader_open(&reader, file) != 0) {
+    fprintf(stderr, "Failed to read file %s\n", pathname);
+    free(out);
+    close(file_out);
+    close(file);
+    return;
+  }
+  JobState job = {pathname, 1, out, batch_changes};
+
+  // large files are parsed, run and written by separate threads
+  if (reader.len < PIPELINE_MIN_JOB_SIZE || run_pipelined(&reader, &job) != 0) {
+    CommandBatch *batch = malloc(sizeof(CommandBatch));
+    int last = batch == NULL;
+    if (batch == NULL) {
+      fprintf(stderr, "Failed to allocate memory\n");
+    }
+    while (!last) {
+      last = fill_batch(&reader, batch);
+      run_batch(batch, &job);
     }
+    free(batch);
   }
   // cleanup
+  outbuf_flush(out);
+  free(out);
+  reader_close(&reader);
   close(file);
   close(file_out);
 }
 
-/**
- * @brief Read a single input file using a thread
- * @param args readFile args
-*/
-void* threadWorker(void* args) {
-  sigset_t set;
-  // Block SIGUSR1 in this thread
-  sigemptyset(&set);
-  sigaddset(&set, SIGUSR1);
-  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
-      perror("Erro ao ignorar o sinal\n");
-      pthread_exit(NULL);
-  }
-
-  ThreadArgs* threadArgs = (ThreadArgs*) args;
-
-  readFile(threadArgs->pathname, threadArgs->max_backups);
-
-  free(threadArgs);
-  return NULL;
-}
-
 /**
  * @brief Read all .job files in directory
  * @param directory Directory to read
- * @param max_backups Maximum simultaneous backups allowed
- * @param max_threads Maximum simultaneous threads allowed
+ * @param max_threads Number of worker threads running the files
+ * @param largest_first Start the largest files first
 */
-void readDir(char directory[], int max_backups, int max_threads) {
+void readDir(char directory[], int max_threads, int largest_first) {
   DIR *dir = opendir(directory);
   if (dir == NULL) {
     fprintf(stderr, "Failed to open directory\n");
     return;
   }
 
-  // array of threads
-  pthread_t threads[max_threads];
-  int thread_count = 0;
+  // list every job file first, so the pool can balance them
+  JobFile *jobs = NULL;
+  size_t job_count = 0, job_capacity = 0;
 
   struct dirent *entry;
   while ((entry = readdir(dir)) != NULL) {
-    char pathname[PATH_MAX];
     const char *filename = entry->d_name;
 
     // check if the filename ends with ".job"
@@ -191,62 +115,120 @@ void readDir(char directory[], int max_backups, int max_threads) {
     if (!(len > 4 && strcmp(filename + len - 4, ".job") == 0)) {
         continue;
     }
-    // get file path
-    snprintf(pathname, sizeof(pathname), "%s/%s", directory, filename);
-
-    // allocates arguments for threads
-    ThreadArgs* threadArgs = (ThreadArgs*) malloc(sizeof(ThreadArgs));
-    strcpy(threadArgs->pathname, pathname);
-    threadArgs->max_backups = max_backups;
-
-    // creates a new thread
-    if (pthread_create(&threads[thread_count++], NULL, threadWorker, (void*) threadArgs) != 0) {
-        fprintf(stderr, "Failed to create thread\n");
-        free(threadArgs);
-        continue;
-    }
-
-    // if max_threads is reached, waits for all threads to terminate 
-    if (thread_count >= max_threads) {
-      for (int i = 0; i < thread_count; i++) {
-          pthread_join(threads[i], NULL);
+    if (job_count == job_capacity) {
+      job_capacity = job_capacity > 0 ? job_capacity * 2 : 16;
+      JobFile *grown = realloc(jobs, job_capacity * sizeof(JobFile));
+      if (grown == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        break;
       }
-      thread_count = 0;
+      jobs = grown;
     }
+    // get file path and size
+    JobFile *job = &jobs[job_count++];
+    snprintf(job->pathname, sizeof(job->pathname), "%s/%s", directory, filename);
+    struct stat st;
+    job->size = stat(job->pathname, &st) == 0 ? st.st_size : 0;
   }
-  // waits for all threads to terminate 
-  for (int i = 0; i < thread_count; i++) {
-      pthread_join(threads[i], NULL);
-  }
-  // cleanup
   closedir(dir);
+
+  // workers inherit the mask, so SIGUSR1 is left to the client manager
+  sigset_t set, old_set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &set, &old_set);
+  run_jobs(jobs, job_count, max_threads, largest_first, readFile);
+  pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+  // cleanup
+  free(jobs);
   if (kvs_terminate()) {
     return;
   }
 }
 
 int main(int argc, char *argv[]) {
-  if (argc != 5) {
+  KvsConfig config = {0, 0, NULL, WAL_SYNC_ALWAYS, 0};
+  int largest_first = 0;
+  NotifyPolicy notify_policy = NOTIFY_DROP_OLDEST;
+  int opt;
+  while ((opt = getopt(argc, argv, "bfil:n:s:S:c:")) != -1) {
+    switch (opt) {
+      case 'b':
+        batch_changes = 1;
+        break;
+      case 'f':
+        largest_first = 1;
+        break;
+      case 'i':
+        config.incremental_backups = 1;
+        break;
+      case 'l':
+        config.wal_dir = optarg;
+        break;
+      case 'n':
+        if (strcmp(optarg, "drop") == 0) {
+          notify_policy = NOTIFY_DROP_OLDEST;
+        } else if (strcmp(optarg, "disconnect") == 0) {
+          notify_policy = NOTIFY_DISCONNECT;
+        } else {
+          fprintf(stderr, "Invalid notification policy %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 's':
+        if (strcmp(optarg, "always") == 0) {
+          config.wal_sync_ms = WAL_SYNC_ALWAYS;
+        } else if (strcmp(optarg, "off") == 0) {
+          config.wal_sync_ms = WAL_SYNC_OFF;
+        } else if ((config.wal_sync_ms = atoi(optarg)) <= 0) {
+          fprintf(stderr, "Invalid fsync policy %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'S':
+        if ((config.num_stripes = (size_t) atoi(optarg)) == 0) {
+          fprintf(stderr, "Invalid number of stripes %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'c':
+        if ((manager_config.max_sessions = atoi(optarg)) <= 0) {
+          fprintf(stderr, "Invalid number of sessions %s\n", optarg);
+          return 1;
+        }
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-b] [-f] [-i] [-l <log_dir>] [-n drop|disconnect] [-s always|off|<ms>] [-S <stripes>] [-c <sessions>] <jobs_dir> <max_backups> <max_threads> <register_pipe>\n", argv[0]);
+        return 1;
+    }
+  }
+  if (argc - optind != 4) {
     fprintf(stderr, "Wrong number of arguments.%d\n", argc);
     return 1;
   }
-  if (kvs_init()) {
+  char *directory = argv[optind];
+  config.max_backups = atoi(argv[optind + 1]);
+  int max_threads = atoi(argv[optind + 2]);
+  manager_config.server_path = argv[optind + 3];
+
+  if (kvs_init(&config)) {
     fprintf(stderr, "Failed to initialize KVS\n");
     return 1;
   }
 
-  char *directory = argv[1];
-  int backups = atoi(argv[2]);
-  int max_threads = atoi(argv[3]);
-  server_pipe = argv[4];
+  if (notifier_start(notify_policy)) {
+    fprintf(stderr, "Failed to start the notification dispatcher\n");
+    return 1;
+  }
 
   // create thread to manager clients
-  if (pthread_create(&client_manager_thread, NULL, client_manager, (void*) server_pipe) != 0) {
+  if (pthread_create(&client_manager_thread, NULL, client_manager, (void*) &manager_config) != 0) {
     fprintf(stderr, "Failed to create thread\n");
     return 1;
   }
 
-  readDir(directory, backups, max_threads);
+  readDir(directory, max_threads, largest_first);
 
   pthread_join(client_manager_thread, NULL);
 
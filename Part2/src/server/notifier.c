@@ -0,0 +1,402 @@
+#include "notifier.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// events handled by each call to epoll_wait
+#define MAX_EVENTS 64
+
+typedef enum {
+  EVENT_NOTIFY,   // a notification for the clients in fds
+  EVENT_COALESCE, // fd starts coalescing its notifications
+  EVENT_CLOSE     // fd is closed
+} EventKind;
+
+// A notification for some clients, or a change to a client's pipe.
+typedef struct NotifyEvent {
+  _Atomic(struct NotifyEvent*) next;
+  EventKind kind;
+  int fd;
+  char message[NOTIFY_MESSAGE_SIZE];
+  size_t count;
+  int fds[];
+} NotifyEvent;
+
+// Notifications of a client not yet written to its pipe, oldest first. Only
+// the dispatcher uses them.
+typedef struct Outbox {
+  int fd;
+  char messages[NOTIFY_BUFFER_MESSAGES][NOTIFY_MESSAGE_SIZE];
+  size_t first; // ring position of the oldest notification
+  size_t count;
+  size_t sent; // bytes of the oldest notification already written
+  int waiting; // the pipe was full, epoll reports when it has room
+  int dead;    // the client stopped reading, its notifications are dropped
+  int coalesce; // a key has at most one undelivered notification
+  int ready;   // listed to be written after the queue is drained
+  struct Outbox *next_ready;
+} Outbox;
+
+// Queue of events: writers push at the head with one exchange, the
+// dispatcher pops at the tail (Vyukov's intrusive MPSC queue).
+static NotifyEvent stub;
+static _Atomic(NotifyEvent*) queue_head = &stub;
+static NotifyEvent *queue_tail = &stub;
+
+// set while the dispatcher waits in epoll, so writers know to wake it
+static atomic_int sleeping = 0;
+static int wake_pipe[2];
+static int epoll_fd;
+static NotifyPolicy full_policy;
+static pthread_t dispatcher_thread;
+
+// outboxes by pipe, and those with notifications to write
+static Outbox **outboxes = NULL;
+static size_t num_outboxes = 0;
+static Outbox *ready = NULL;
+
+static void push(NotifyEvent *event) {
+  atomic_store_explicit(&event->next, NULL, memory_order_relaxed);
+  NotifyEvent *prev = atomic_exchange(&queue_head, event);
+  atomic_store_explicit(&prev->next, event, memory_order_release);
+}
+
+/// Takes the oldest event.
+/// @return The event, or NULL if there is none or the newest is still being
+/// linked by its writer.
+static NotifyEvent *pop(void) {
+  NotifyEvent *tail = queue_tail;
+  NotifyEvent *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (tail == &stub) {
+    if (next == NULL) {
+      return NULL;
+    }
+    queue_tail = tail = next;
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  }
+  if (next == NULL) {
+    if (tail != atomic_load(&queue_head)) {
+      return NULL;
+    }
+    push(&stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next == NULL) {
+      return NULL;
+    }
+  }
+  queue_tail = next;
+  return tail;
+}
+
+static int queue_empty(void) {
+  return atomic_load(&queue_head) == queue_tail;
+}
+
+static void wake_dispatcher(void) {
+  if (atomic_exchange(&sleeping, 0)) {
+    char byte = 0;
+    if (write(wake_pipe[1], &byte, 1) == -1 && errno != EAGAIN) {
+      perror("Failed to wake the notification dispatcher");
+    }
+  }
+}
+
+int notifier_post(const int *fds, size_t count, const char *key, const char *value) {
+  NotifyEvent *event = malloc(sizeof(NotifyEvent) + count * sizeof(int));
+  if (event == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    return 1;
+  }
+  event->kind = EVENT_NOTIFY;
+  memset(event->message, '\0', sizeof(event->message));
+  strncpy(event->message, key, MAX_STRING_SIZE);
+  strncpy(event->message + MAX_STRING_SIZE + 1, value, MAX_STRING_SIZE);
+  event->count = count;
+  memcpy(event->fds, fds, count * sizeof(int));
+  push(event);
+  wake_dispatcher();
+  return 0;
+}
+
+/// Queues a change to a client's pipe.
+/// @return 0 if it was queued, 1 if there was no memory for it.
+static int post_change(EventKind kind, int notif_fd) {
+  NotifyEvent *event = malloc(sizeof(NotifyEvent));
+  if (event == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    return 1;
+  }
+  event->kind = kind;
+  event->fd = notif_fd;
+  event->count = 0;
+  push(event);
+  wake_dispatcher();
+  return 0;
+}
+
+void notifier_coalesce(int notif_fd) {
+  post_change(EVENT_COALESCE, notif_fd);
+}
+
+void notifier_close(int notif_fd) {
+  if (post_change(EVENT_CLOSE, notif_fd) != 0) {
+    // nothing can be queued for a client no longer subscribed, but its
+    // queued notifications may still be written to a reused descriptor
+    close(notif_fd);
+  }
+}
+
+/// Outbox of a client, created with its first notification.
+/// @return The outbox, or NULL if there was no memory for it.
+static Outbox *get_outbox(int fd) {
+  size_t index = (size_t) fd;
+  if (index >= num_outboxes) {
+    size_t len = num_outboxes > 0 ? num_outboxes : 64;
+    while (len <= index) {
+      len *= 2;
+    }
+    Outbox **grown = realloc(outboxes, len * sizeof(Outbox*));
+    if (grown == NULL) {
+      return NULL;
+    }
+    memset(grown + num_outboxes, 0, (len - num_outboxes) * sizeof(Outbox*));
+    outboxes = grown;
+    num_outboxes = len;
+  }
+  if (outboxes[index] == NULL) {
+    Outbox *outbox = calloc(1, sizeof(Outbox));
+    if (outbox == NULL) {
+      return NULL;
+    }
+    outbox->fd = fd;
+    // epoll only reports errors until the pipe fills up
+    struct epoll_event event = {.events = 0, .data.ptr = outbox};
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      outbox->dead = 1;
+    }
+    outboxes[index] = outbox;
+  }
+  return outboxes[index];
+}
+
+/// Stops writing to a client that closed its pipe or fell behind.
+static void kill_outbox(Outbox *outbox) {
+  outbox->dead = 1;
+  outbox->count = 0;
+  outbox->sent = 0;
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, outbox->fd, NULL);
+}
+
+/// Writes as many notifications of an outbox as its pipe takes, and has
+/// epoll watch the pipe while some are left.
+static void flush(Outbox *outbox) {
+  while (outbox->count > 0 && !outbox->dead) {
+    // the ring is at most two runs of messages
+    size_t run = NOTIFY_BUFFER_MESSAGES - outbox->first;
+    if (run > outbox->count) {
+      run = outbox->count;
+    }
+    struct iovec iov[2];
+    iov[0].iov_base = outbox->messages[outbox->first] + outbox->sent;
+    iov[0].iov_len = run * NOTIFY_MESSAGE_SIZE - outbox->sent;
+    iov[1].iov_base = outbox->messages[0];
+    iov[1].iov_len = (outbox->count - run) * NOTIFY_MESSAGE_SIZE;
+    ssize_t written = writev(outbox->fd, iov, iov[1].iov_len > 0 ? 2 : 1);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN) {
+        break;
+      }
+      kill_outbox(outbox);
+      return;
+    }
+    size_t done = outbox->sent + (size_t) written;
+    outbox->first = (outbox->first + done / NOTIFY_MESSAGE_SIZE) % NOTIFY_BUFFER_MESSAGES;
+    outbox->count -= done / NOTIFY_MESSAGE_SIZE;
+    outbox->sent = done % NOTIFY_MESSAGE_SIZE;
+  }
+  int waiting = outbox->count > 0 && !outbox->dead;
+  if (waiting != outbox->waiting && !outbox->dead) {
+    struct epoll_event event = {.events = waiting ? EPOLLOUT : 0, .data.ptr = outbox};
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, outbox->fd, &event);
+  }
+  outbox->waiting = waiting;
+}
+
+/// Replaces the value of a queued notification for the same key.
+/// @return 1 if one was replaced, 0 if the key has none queued.
+static int coalesce(Outbox *outbox, const char *message) {
+  // the bytes of a partly written notification are already in the pipe
+  for (size_t i = outbox->sent > 0 ? 1 : 0; i < outbox->count; i++) {
+    char *queued = outbox->messages[(outbox->first + i) % NOTIFY_BUFFER_MESSAGES];
+    if (strncmp(queued, message, MAX_STRING_SIZE + 1) == 0) {
+      memcpy(queued + MAX_STRING_SIZE + 1, message + MAX_STRING_SIZE + 1, MAX_STRING_SIZE + 1);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/// Adds a notification to an outbox, applying the policy if it is full.
+static void append(Outbox *outbox, const char *message) {
+  if (outbox->dead || (outbox->coalesce && coalesce(outbox, message))) {
+    return;
+  }
+  if (outbox->count == NOTIFY_BUFFER_MESSAGES && !outbox->waiting) {
+    // the buffer filled up within one drain of the queue, the pipe may
+    // still have room
+    flush(outbox);
+  }
+  if (outbox->count == NOTIFY_BUFFER_MESSAGES) {
+    if (full_policy == NOTIFY_DISCONNECT) {
+      kill_outbox(outbox);
+      // the pipe number stays taken until the client is closed, but the
+      // client reads the end of its notifications
+      int null_fd = open("/dev/null", O_WRONLY);
+      if (null_fd != -1) {
+        dup2(null_fd, outbox->fd);
+        close(null_fd);
+      }
+      return;
+    }
+    // a partly written notification is kept whole, the one after it goes
+    size_t second = (outbox->first + 1) % NOTIFY_BUFFER_MESSAGES;
+    if (outbox->sent > 0) {
+      memcpy(outbox->messages[second], outbox->messages[outbox->first], NOTIFY_MESSAGE_SIZE);
+    }
+    outbox->first = second;
+    outbox->count--;
+  }
+  size_t last = (outbox->first + outbox->count) % NOTIFY_BUFFER_MESSAGES;
+  memcpy(outbox->messages[last], message, NOTIFY_MESSAGE_SIZE);
+  outbox->count++;
+  if (!outbox->ready && !outbox->waiting) {
+    outbox->ready = 1;
+    outbox->next_ready = ready;
+    ready = outbox;
+  }
+}
+
+static void close_outbox(int fd) {
+  size_t index = (size_t) fd;
+  Outbox *outbox = index < num_outboxes ? outboxes[index] : NULL;
+  if (outbox != NULL) {
+    if (!outbox->dead) {
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    }
+    free(outbox);
+    outboxes[index] = NULL;
+  }
+  close(fd);
+}
+
+/// Writes the outboxes that got notifications, emptying the ready list.
+static void flush_ready(void) {
+  while (ready != NULL) {
+    Outbox *outbox = ready;
+    ready = outbox->next_ready;
+    outbox->ready = 0;
+    flush(outbox);
+  }
+}
+
+/// Moves every queued notification into the outboxes of its clients.
+static void drain_queue(void) {
+  NotifyEvent *event;
+  while ((event = pop()) != NULL) {
+    if (event->kind == EVENT_CLOSE) {
+      // the outbox may be in the ready list, and its last notifications
+      // are still delivered if the pipe takes them
+      flush_ready();
+      close_outbox(event->fd);
+    } else if (event->kind == EVENT_COALESCE) {
+      Outbox *outbox = get_outbox(event->fd);
+      if (outbox != NULL) {
+        outbox->coalesce = 1;
+      }
+    }
+    for (size_t i = 0; i < event->count; i++) {
+      Outbox *outbox = get_outbox(event->fds[i]);
+      if (outbox == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        continue;
+      }
+      append(outbox, event->message);
+    }
+    free(event);
+  }
+}
+
+static void *dispatch(void *arg) {
+  (void) arg;
+  // a client that closed its pipe makes writes fail with EPIPE instead
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  struct epoll_event events[MAX_EVENTS];
+  while (1) {
+    drain_queue();
+    flush_ready();
+
+    // writers wake the dispatcher only once it says it sleeps, so the queue
+    // is checked again after saying so
+    atomic_store(&sleeping, 1);
+    if (!queue_empty()) {
+      atomic_store(&sleeping, 0);
+      continue;
+    }
+    int count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    atomic_store(&sleeping, 0);
+    for (int i = 0; i < count; i++) {
+      Outbox *outbox = events[i].data.ptr;
+      if (outbox == NULL) {
+        char bytes[64];
+        while (read(wake_pipe[0], bytes, sizeof(bytes)) > 0)
+          ;
+      } else if (events[i].events & EPOLLOUT) {
+        flush(outbox);
+      } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        kill_outbox(outbox);
+      }
+    }
+  }
+  return NULL;
+}
+
+int notifier_start(NotifyPolicy policy) {
+  full_policy = policy;
+  epoll_fd = epoll_create1(0);
+  if (epoll_fd == -1) {
+    return 1;
+  }
+  if (pipe(wake_pipe) == -1) {
+    close(epoll_fd);
+    return 1;
+  }
+  fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_pipe[0], &event) == -1 ||
+      pthread_create(&dispatcher_thread, NULL, dispatch, NULL) != 0) {
+    close(epoll_fd);
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef KVS_NOTIFIER_H
+#define KVS_NOTIFIER_H
+
+#include <stddef.h>
+
+#include "constants.h"
+
+// a notification: the key and then its value, each in MAX_STRING_SIZE + 1 bytes
+#define NOTIFY_MESSAGE_SIZE (2 * (MAX_STRING_SIZE + 1))
+// notifications kept for a client that does not read them fast enough
+#define NOTIFY_BUFFER_MESSAGES 64
+
+// What the dispatcher does with a notification for a client whose buffer is
+// full.
+typedef enum {
+  NOTIFY_DROP_OLDEST, // the oldest undelivered notification is dropped
+  NOTIFY_DISCONNECT   // the client's notifications pipe is closed
+} NotifyPolicy;
+
+/// @brief Starts the notification dispatcher, the only thread that writes to
+/// the clients' notifications pipes
+/// @param policy what to do when a client falls behind
+/// @return 0 if the dispatcher started, 1 otherwise
+int notifier_start(NotifyPolicy policy);
+
+/// @brief Queues a notification for some clients, without blocking: writers
+/// call it while holding the lock of the changed key
+/// @param fds notifications pipes of the clients
+/// @param count number of clients
+/// @param key key changed
+/// @param value its new value, or "DELETED"
+/// @return 0 if the notification was queued, 1 if there was no memory for it
+int notifier_post(const int *fds, size_t count, const char *key, const char *value);
+
+/// @brief Coalesces a client's notifications from now on: a notification for
+/// a key that already has one queued for the client replaces its value in
+/// place, so the client only gets the latest value of a hot key
+/// @param notif_fd notifications pipe of the client
+void notifier_coalesce(int notif_fd);
+
+/// @brief Hands a client's notifications pipe to the dispatcher to close,
+/// after the notifications queued before. The client must not be subscribed
+/// to any key anymore
+/// @param notif_fd notifications pipe of the client
+void notifier_close(int notif_fd);
+
+#endif // KVS_NOTIFIER_H
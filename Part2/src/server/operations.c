@@ -4,20 +4,102 @@
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h> 
-#include <sys/wait.h>
 #include <pthread.h>
+#include <semaphore.h>
 
+#include "operations.h"
 #include "kvs.h"
+#include "io.h"
+#include "dump.h"
+#include "wal.h"
+#include "stats.h"
 #include "constants.h"
+#include "src/common/backup.h"
 
 static struct HashTable* kvs_table = NULL;
 
-// lock for each table entry
-pthread_rwlock_t table_locks[TABLE_SIZE] = {PTHREAD_RWLOCK_INITIALIZER};
+// Lock of a table stripe, alone on its cache line so that threads taking
+// neighbouring stripes do not invalidate each other's.
+typedef struct {
+  _Alignas(CACHE_LINE_SIZE) pthread_rwlock_t lock;
+} StripeLock;
 
-// lock for accessing current simultaneous backups
+// lock for each table stripe
+static StripeLock *table_locks = NULL;
+static size_t num_stripes = 0;
+
+// lock for changing the list of running backups
 pthread_mutex_t backups_lock = PTHREAD_MUTEX_INITIALIZER;
 
+// free slots for backups being written at the same time
+static sem_t backup_slots;
+static int backup_slot_count = 0;
+
+// longest READ or DELETE output line: every pair is "(key,value)"
+#define LIST_OUTPUT_SIZE (MAX_WRITE_SIZE * (2 * MAX_STRING_SIZE + 3) + 3)
+// optimistic reads tried before falling back to the stripe locks
+#define OPTIMISTIC_TRIES 3
+// lock stripes for each online core, unless their number is given
+#define STRIPES_PER_CORE 4
+
+typedef struct {
+  PairCopy *pairs;
+  size_t count;
+  size_t capacity;
+  int failed; // set if pairs could not grow
+} Snapshot;
+
+// Value a pair held before it changed during a backup.
+typedef struct PreservedPair {
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+  struct PreservedPair *next;
+} PreservedPair;
+
+// Keys of a stripe changed since the last backup started. A key is added on
+// its first change after that backup, found with the version of its node, so
+// it is only repeated when deleted and created again.
+typedef struct {
+  char (*keys)[MAX_STRING_SIZE];
+  size_t count;
+  size_t capacity;
+  int failed; // set if a key could not be added
+} DirtyKeys;
+
+// Backup written by its own thread while writers keep going. The first change
+// to a pair after the backup started preserves the old value in the list of
+// the pair's stripe, under the stripe's write lock.
+typedef struct Backup {
+  uint64_t version; // table version the backup shows
+  PreservedPair **preserved; // by stripe
+  int failed; // set if a value could not be preserved
+  int delta; // only holds the keys changed since the base version
+  int checkpoint; // checkpoint of the write-ahead log, outside the deltas
+  uint64_t lsn; // last change of the log a checkpoint holds
+  uint64_t base_version; // version of the previous backup, for deltas
+  DirtyKeys *dirty; // keys changed since the base version, by stripe
+  char pathname[PATH_MAX];
+  struct Backup *next;
+} Backup;
+
+// backups being written; only changed with backups_lock and every stripe
+// lock held
+static Backup *running_backups = NULL;
+
+// set when backups are binary, and deltas of the previous one
+static int incremental_backups = 0;
+// the fields below are changed with backups_lock and every stripe lock held
+static int backups_taken = 0;
+static uint64_t last_backup_version = 0;
+// keys changed since the last backup, by stripe, under the stripe's lock
+static DirtyKeys *dirty_keys = NULL;
+// set, under backups_lock, when a backup file could not be written, so the
+// next one cannot be a delta
+static int base_lost = 0;
+
+// set when changes are logged to a write-ahead log
+static int wal_enabled = 0;
+
 /// Calculates a timespec from a delay in milliseconds.
 /// @param delay_ms Delay in milliseconds.
 /// @return Timespec with the given delay.
@@ -25,14 +107,297 @@ static struct timespec delay_to_timespec(unsigned int delay_ms) {
   return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
 }
 
-int kvs_init() {
+static int compare_stripes(const void *a, const void *b) {
+  size_t x = *(const size_t*) a, y = *(const size_t*) b;
+  return (x > y) - (x < y);
+}
+
+/// Sorts a list of stripe indexes, dropping repeated ones.
+/// @param count Number of indexes.
+/// @param stripes Array of stripe indexes to sort.
+/// @return Number of distinct stripes.
+static size_t sort_stripes(size_t count, size_t stripes[]) {
+  if (count == 0) {
+    return 0;
+  }
+  qsort(stripes, count, sizeof(size_t), compare_stripes);
+  size_t unique = 1;
+  for (size_t i = 1; i < count; i++) {
+    if (stripes[i] != stripes[unique - 1]) {
+      stripes[unique++] = stripes[i];
+    }
+  }
+  return unique;
+}
+
+/// Lists the stripes that hold a set of keys.
+/// @param num_pairs Number of keys.
+/// @param keys Array of keys' strings.
+/// @param stripes Array of num_pairs stripe indexes to fill, by increasing
+/// index and without repeats.
+/// @return Number of distinct stripes.
+static size_t list_stripes(size_t num_pairs, char *keys[], size_t stripes[]) {
+  for (size_t i = 0; i < num_pairs; i++) {
+    stripes[i] = key_stripe(kvs_table, keys[i]);
+  }
+  return sort_stripes(num_pairs, stripes);
+}
+
+/// Groups keys by stripe with a counting sort over their stripe indexes.
+/// Keys of the same stripe keep their relative order.
+/// @param num_pairs Number of keys.
+/// @param keys Array of keys' strings.
+/// @param order Array of num_pairs key indexes to fill, by increasing stripe.
+/// @param stripes Array of num_pairs stripe indexes to fill, by increasing
+/// index and without repeats.
+/// @return Number of distinct stripes.
+static size_t order_by_stripe(size_t num_pairs, char *keys[], size_t order[], size_t stripes[]) {
+  size_t key_stripes[num_pairs];
+  size_t starts[num_stripes + 1];
+  memset(starts, 0, sizeof(starts));
+  for (size_t i = 0; i < num_pairs; i++) {
+    key_stripes[i] = key_stripe(kvs_table, keys[i]);
+    starts[key_stripes[i] + 1]++;
+  }
+  size_t count = 0;
+  for (size_t i = 0; i < num_stripes; i++) {
+    if (starts[i + 1] > 0) {
+      stripes[count++] = i;
+    }
+    starts[i + 1] += starts[i];
+  }
+  for (size_t i = 0; i < num_pairs; i++) {
+    order[starts[key_stripes[i]]++] = i;
+  }
+  return count;
+}
+
+/// Compares two keys' strings, for qsort.
+static int compare_keys(const void *a, const void *b) {
+  return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/// Acquires the locks of a list of stripes. Locks are always taken by
+/// increasing stripe index, which stops dead-locks between threads.
+/// @param count Number of stripes.
+/// @param stripes Array of stripe indexes, sorted without repeats.
+/// @param write 1 to lock for a change, 0 for reading.
+/// @param stat Operation the time spent waiting is counted for.
+static void lock_stripes(size_t count, const size_t stripes[], int write, StatOp stat) {
+  uint64_t start = stats_now();
+  for (size_t i = 0; i < count; i++) {
+    if (write) {
+      pthread_rwlock_wrlock(&table_locks[stripes[i]].lock);
+    } else {
+      pthread_rwlock_rdlock(&table_locks[stripes[i]].lock);
+    }
+  }
+  stats_record(stat, start);
+}
+
+/// Releases the locks taken by lock_stripes.
+/// @param count Number of stripes.
+/// @param stripes Array of stripe indexes.
+static void unlock_stripes(size_t count, const size_t stripes[]) {
+  for (size_t i = 0; i < count; i++) {
+    pthread_rwlock_unlock(&table_locks[stripes[i]].lock);
+  }
+}
+
+/// Acquires every stripe lock, by increasing index like lock_stripes, which
+/// stops every change to the table. Only SHOW and backups do this, so
+/// changes never share a lock beyond their own stripes.
+/// @param write 1 to also keep readers out, 0 to only stop changes.
+static void lock_all_stripes(int write) {
+  for (size_t i = 0; i < num_stripes; i++) {
+    if (write) {
+      pthread_rwlock_wrlock(&table_locks[i].lock);
+    } else {
+      pthread_rwlock_rdlock(&table_locks[i].lock);
+    }
+  }
+}
+
+/// Releases the locks taken by lock_all_stripes.
+static void unlock_all_stripes(void) {
+  for (size_t i = num_stripes; i > 0; i--) {
+    pthread_rwlock_unlock(&table_locks[i - 1].lock);
+  }
+}
+
+/// Formats "(key,value)" into an output area.
+/// @param dest Where to write, with room for 2 * MAX_STRING_SIZE + 3 bytes.
+/// @param key Key of the pair.
+/// @param value Value of the pair.
+/// @return Number of bytes written.
+static size_t format_pair(char *dest, const char *key, const char *value) {
+  size_t len = 0;
+  dest[len++] = '(';
+  len += strn_memcpy(dest + len, key, MAX_STRING_SIZE);
+  dest[len++] = ',';
+  len += strn_memcpy(dest + len, value, MAX_STRING_SIZE);
+  dest[len++] = ')';
+  return len;
+}
+
+static void add_dirty_key(DirtyKeys *dirty, const char *key) {
+  if (dirty->count == dirty->capacity) {
+    size_t capacity = dirty->capacity > 0 ? dirty->capacity * 2 : 64;
+    char (*keys)[MAX_STRING_SIZE] = realloc(dirty->keys, capacity * MAX_STRING_SIZE);
+    if (keys == NULL) {
+      dirty->failed = 1;
+      return;
+    }
+    dirty->keys = keys;
+    dirty->capacity = capacity;
+  }
+  char *dest = dirty->keys[dirty->count++];
+  dest[strn_memcpy(dest, key, MAX_STRING_SIZE - 1)] = '\0';
+}
+
+/// Records a change to a key for the backups: it is marked dirty for the next
+/// delta, and its current value preserved for every running backup it has
+/// not changed for yet. Must be called, holding the write lock of the key's
+/// stripe, before the key is written or deleted.
+/// @param key Key about to change.
+/// @param deleting 1 if the key is about to be deleted, 0 if written.
+static void track_change(const char *key, int deleting) {
+  if (running_backups == NULL && !(incremental_backups && backups_taken)) {
+    return;
+  }
+  KeyNode *keyNode = get_key_node(kvs_table, key);
+  if (keyNode == NULL && deleting) {
+    return; // nothing changes
+  }
+  size_t stripe = key_stripe(kvs_table, key);
+  if (incremental_backups && backups_taken &&
+      (keyNode == NULL || keyNode->version <= last_backup_version)) {
+    add_dirty_key(&dirty_keys[stripe], key);
+  }
+  if (keyNode == NULL) {
+    return; // backups that started before the key existed do not show it
+  }
+  for (Backup *backup = running_backups; backup != NULL; backup = backup->next) {
+    if (keyNode->version > backup->version) {
+      continue; // already changed, and preserved, since the backup started
+    }
+    PreservedPair *pair = malloc(sizeof(PreservedPair));
+    if (pair == NULL) {
+      backup->failed = 1;
+      continue;
+    }
+    strcpy(pair->key, keyNode->key);
+    strcpy(pair->value, keyNode->value);
+    pair->next = backup->preserved[stripe];
+    backup->preserved[stripe] = pair;
+  }
+}
+
+static int commit_changes(uint64_t lsn);
+
+/// Applies a change recovered from the write-ahead log.
+static void replay_change(uint8_t op, const char *key, const char *value, void *arg) {
+  (void) arg;
+  if (op == BACKUP_PUT) {
+    write_pair(kvs_table, key, value);
+  } else {
+    delete_pair(kvs_table, key);
+  }
+}
+
+/// Sizes the table for the checkpoint the log recovers first, and tells it
+/// where the checkpoint is mapped.
+static void begin_checkpoint(uint32_t count, const void *map, size_t len, void *arg) {
+  (void) arg;
+  reserve_pairs(kvs_table, count);
+  expect_mapping(kvs_table, map, len);
+}
+
+/// Stores a pair of the checkpoint, in place in its mapping.
+static void load_pair(const char *key, const char *value, void *arg) {
+  (void) arg;
+  adopt_pair(kvs_table, key, value);
+}
+
+/// Hands the mapped checkpoint over to the table its pairs were stored in.
+static void end_checkpoint(void *map, size_t len, void *arg) {
+  (void) arg;
+  adopt_mapping(kvs_table, map, len);
+}
+
+/// Picks the number of lock stripes: the one asked for, or STRIPES_PER_CORE
+/// for each online core, rounded up to a power of two.
+/// @param requested Number of stripes asked for, 0 for none.
+/// @return Number of stripes, at most MAX_TABLE_STRIPES.
+static size_t choose_stripes(size_t requested) {
+  if (requested == 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    requested = (cores > 0 ? (size_t) cores : 1) * STRIPES_PER_CORE;
+  }
+  size_t stripes = 1;
+  while (stripes < requested && stripes < MAX_TABLE_STRIPES) {
+    stripes *= 2;
+  }
+  return stripes;
+}
+
+/// Frees the table, its stripe locks and the keys tracked for backups.
+static void free_state() {
+  for (size_t i = 0; i < num_stripes; i++) {
+    if (dirty_keys != NULL) {
+      free(dirty_keys[i].keys);
+    }
+    if (table_locks != NULL) {
+      pthread_rwlock_destroy(&table_locks[i].lock);
+    }
+  }
+  free(dirty_keys);
+  free(table_locks);
+  if (kvs_table != NULL) {
+    free_table(kvs_table);
+  }
+  dirty_keys = NULL;
+  table_locks = NULL;
+  kvs_table = NULL;
+}
+
+int kvs_init(const KvsConfig *config) {
   if (kvs_table != NULL) {
     fprintf(stderr, "KVS state has already been initialized\n");
     return 1;
   }
 
-  kvs_table = create_hash_table();
-  return kvs_table == NULL;
+  incremental_backups = config->incremental_backups;
+  backup_slot_count = config->max_backups > 0 ? config->max_backups : 1;
+  if (sem_init(&backup_slots, 0, (unsigned int) backup_slot_count) != 0) {
+    return 1;
+  }
+
+  num_stripes = choose_stripes(config->num_stripes);
+  table_locks = aligned_alloc(CACHE_LINE_SIZE, num_stripes * sizeof(StripeLock));
+  dirty_keys = calloc(num_stripes, sizeof(DirtyKeys));
+  kvs_table = create_hash_table(num_stripes);
+  if (table_locks != NULL) {
+    for (size_t i = 0; i < num_stripes; i++) {
+      pthread_rwlock_init(&table_locks[i].lock, NULL);
+    }
+  }
+  if (table_locks == NULL || dirty_keys == NULL || kvs_table == NULL) {
+    free_state();
+    return 1;
+  }
+
+  // recover the state kept by the log before anything else runs
+  if (config->wal_dir != NULL) {
+    WalRecovery recovery = {begin_checkpoint, load_pair, end_checkpoint, replay_change, NULL};
+    if (wal_open(config->wal_dir, config->wal_sync_ms, &recovery) != 0) {
+      fprintf(stderr, "Failed to open the write-ahead log\n");
+      free_state();
+      return 1;
+    }
+    wal_enabled = 1;
+  }
+  return 0;
 }
 
 int kvs_terminate() {
@@ -41,316 +406,819 @@ int kvs_terminate() {
     return 1;
   }
 
-  free_table(kvs_table);
-  kvs_table = NULL;
-  return 0;
-}
-
-void sort_keys_values(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]) {
-  for (size_t i = 0; i < num_pairs; i++) {
-    size_t min = i;
-    for (size_t j = i+1; j < num_pairs; j++) {
-      if(strcmp(keys[min], keys[j]) > 0) {
-          min = j;   
-      }
-    }
-    if (min != i) {
-      char temp[MAX_STRING_SIZE];
-      strcpy(temp, keys[i]);
-      strcpy(keys[i], keys[min]);
-      strcpy(keys[min], temp);
-      char temp2[MAX_STRING_SIZE];
-      strcpy(temp2, values[i]);
-      strcpy(values[i], values[min]);
-      strcpy(values[min], temp2);
-    }
+  // wait for the backups still being written
+  for (int i = 0; i < backup_slot_count; i++) {
+    sem_wait(&backup_slots);
   }
+  sem_destroy(&backup_slots);
+  if (wal_enabled) {
+    wal_close();
+    wal_enabled = 0;
+  }
+
+  free_state();
+  return 0;
 }
 
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]) {
+int kvs_write(size_t num_pairs, char *keys[], char *values[]) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  // stops dead-locks between threads
-  sort_keys_values(num_pairs, keys, values);
+  if (num_pairs == 0) {
+    return 0;
+  }
+  uint64_t start = stats_now();
+
+  // group the pairs by stripe and acquire the locks of those stripes; pairs
+  // of a stripe keep their order, so the last value given for a key is stored
+  size_t order[num_pairs];
+  size_t stripes[num_pairs];
+  size_t num_locked = order_by_stripe(num_pairs, keys, order, stripes);
+  lock_stripes(num_locked, stripes, 1, STAT_WRITE_LOCK);
 
-  // acquire locks correspondent to each table entry
-  int locked_indices[TABLE_SIZE] = {0};
+  uint64_t lsn = 0;
   for (size_t i = 0; i < num_pairs; i++) {
-    int index = hash(keys[i]);
-    if (!locked_indices[index]) {
-      locked_indices[index] = 1;
-      pthread_rwlock_wrlock(&table_locks[index]);
+    size_t pair = order[i];
+    track_change(keys[pair], 0);
+    if (write_pair(kvs_table, keys[pair], values[pair]) != 0) {
+      fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[pair], values[pair]);
+    } else if (wal_enabled) {
+      lsn = wal_append(BACKUP_PUT, keys[pair], values[pair]);
     }
   }
-  
+
+  // free locks
+  unlock_stripes(num_locked, stripes);
+
+  int result = commit_changes(lsn);
+  stats_record(STAT_WRITE, start);
+  return result;
+}
+
+void sort_keys(size_t num_pairs, char *keys[]) {
+  qsort(keys, num_pairs, sizeof(char*), compare_keys);
+}
+
+/// Formats a READ output line from values copied without taking locks. With
+/// KVS_LOCK_FREE_READS copying never fails and each value is read as it was
+/// at some point of the call; otherwise the values are only kept if none of
+/// their stripes changed, so they are read together.
+/// @param num_pairs Number of keys.
+/// @param keys Array of keys' strings, sorted.
+/// @param content Where to write the line, with room for LIST_OUTPUT_SIZE bytes.
+/// @return Length of the line, 0 if a writer changed one of the stripes.
+static size_t read_optimistic(size_t num_pairs, char *keys[], char *content) {
+  // sequence of the segment of each key, all taken before any is copied
+  unsigned seqs[num_pairs];
+  memset(seqs, 0, sizeof(seqs));
+#ifndef KVS_LOCK_FREE_READS
   for (size_t i = 0; i < num_pairs; i++) {
-    if (write_pair(kvs_table, keys[i], values[i]) != 0) {
-      fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[i], values[i]);
-    }
+    seqs[i] = segment_read_begin(&kvs_table->segments[key_stripe(kvs_table, keys[i])]);
   }
+#endif
 
-  // free locks
+  size_t len = 0;
+  content[len++] = '[';
   for (size_t i = 0; i < num_pairs; i++) {
-    int index = hash(keys[i]);
-    if (locked_indices[index]) {
-      locked_indices[index] = 0;
-      pthread_rwlock_unlock(&table_locks[index]);
+    char value[MAX_STRING_SIZE];
+    int found = copy_value(kvs_table, keys[i], value, seqs[i]);
+    if (found < 0) {
+      return 0;
     }
+    len += format_pair(content + len, keys[i], found ? value : "KVSERROR");
   }
+  content[len++] = ']';
+  content[len++] = '\n';
 
-  return 0;
-}
-
-void sort_keys(size_t num_pairs, char keys[][MAX_STRING_SIZE]) {
+#ifndef KVS_LOCK_FREE_READS
+  // every stripe must be unchanged for the values to be read together
   for (size_t i = 0; i < num_pairs; i++) {
-    size_t min = i;
-    for (size_t j = i+1; j < num_pairs; j++) {
-      if(strcmp(keys[min], keys[j]) > 0) {
-          min = j;   
-      }
-    }
-    if (min != i) {
-      char temp[MAX_STRING_SIZE];
-      strcpy(temp, keys[i]);
-      strcpy(keys[i], keys[min]);
-      strcpy(keys[min], temp);
+    if (!segment_read_valid(&kvs_table->segments[key_stripe(kvs_table, keys[i])], seqs[i])) {
+      return 0;
     }
   }
+#endif
+  return len;
 }
 
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int file_out) {
+int kvs_read(size_t num_pairs, char *keys[], OutBuffer *out) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  // prevents dead-locks between threads
+  uint64_t start = stats_now();
+  // output is listed by key order
   sort_keys(num_pairs, keys);
 
-  // acquire locks correspondent to each table entry
-  int locked_indices[TABLE_SIZE] = {0};
-  for (size_t i = 0; i < num_pairs; i++) {
-    int index = hash(keys[i]);
-    if (!locked_indices[index]) {
-      locked_indices[index] = 1;
-      pthread_rwlock_rdlock(&table_locks[index]);
-    }
-  }
+  // room for the whole line is reserved before locking, so the output is
+  // never flushed while the stripes are held
+  char *content = outbuf_reserve(out, LIST_OUTPUT_SIZE);
 
-  // write to output file
-  write(file_out, "[", 1);
-  for (size_t i = 0; i < num_pairs; i++) {
-    char* result = read_pair(kvs_table, keys[i]);
-    if (result == NULL) {
-      char content[MAX_WRITE_SIZE];
-      sprintf(content, "(%s,KVSERROR)", keys[i]);
-      write(file_out, content, strlen(content));
-    } else {
-      char content[MAX_WRITE_SIZE];
-      sprintf(content, "(%s,%s)", keys[i], result);
-      write(file_out, content, strlen(content));
-    }
-    free(result);
+  // read without locks while no writer gets in the way
+  size_t len = 0;
+  for (int attempt = 0; attempt < OPTIMISTIC_TRIES && len == 0; attempt++) {
+    len = read_optimistic(num_pairs, keys, content);
   }
-  write(file_out, "]\n", 2);
 
-  // free locks
-  for (size_t i = 0; i < num_pairs; i++) {
-    int index = hash(keys[i]);
-    if (locked_indices[index]) {
-      locked_indices[index] = 0;
-      pthread_rwlock_unlock(&table_locks[index]);
+  if (len == 0) {
+    // acquire locks of the stripes holding the keys
+    size_t stripes[num_pairs];
+    size_t num_locked = list_stripes(num_pairs, keys, stripes);
+    lock_stripes(num_locked, stripes, 0, STAT_READ_LOCK);
+
+    // format the pairs straight from the stored values
+    content[len++] = '[';
+    for (size_t i = 0; i < num_pairs; i++) {
+      const char *value = lookup_value(kvs_table, keys[i]);
+      len += format_pair(content + len, keys[i], value != NULL ? value : "KVSERROR");
     }
+    content[len++] = ']';
+    content[len++] = '\n';
+
+    // free locks
+    unlock_stripes(num_locked, stripes);
   }
+
+  outbuf_commit(out, len);
+  stats_record(STAT_READ, start);
   return 0;
 }
 
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int file_out) {
+int kvs_delete(size_t num_pairs, char *keys[], OutBuffer *out) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  // prevents dead-locks between threads
+  uint64_t start = stats_now();
+  // output is listed by key order
   sort_keys(num_pairs, keys);
 
-  // acquire locks correspondent to each table entry
-  int locked_indices[TABLE_SIZE] = {0};
-  for (size_t i = 0; i < num_pairs; i++) {
-    int index = hash(keys[i]);
-    if (!locked_indices[index]) {
-      locked_indices[index] = 1;
-      pthread_rwlock_wrlock(&table_locks[index]);
-    }
-  }
+  char *content = outbuf_reserve(out, LIST_OUTPUT_SIZE);
+
+  // acquire locks of the stripes holding the keys
+  size_t stripes[num_pairs];
+  size_t num_locked = list_stripes(num_pairs, keys, stripes);
+  lock_stripes(num_locked, stripes, 1, STAT_DELETE_LOCK);
 
-  // delete pairs
-  int aux = 0;
+  // delete pairs, listing the missing ones
+  size_t len = 0;
+  uint64_t lsn = 0;
   for (size_t i = 0; i < num_pairs; i++) {
+    track_change(keys[i], 1);
     if (delete_pair(kvs_table, keys[i]) != 0) {
-      if (!aux) {
-        write(file_out, "[", 1);
-        aux = 1;
+      if (len == 0) {
+        content[len++] = '[';
       }
-      char content[MAX_WRITE_SIZE];
-      sprintf(content, "(%s,KVSMISSING)", keys[i]);
-      write(file_out, content, strlen(content));
+      len += format_pair(content + len, keys[i], "KVSMISSING");
+    } else if (wal_enabled) {
+      lsn = wal_append(BACKUP_DELETE, keys[i], NULL);
     }
   }
-  if (aux) {
-    write(file_out, "]\n", 2);
+  if (len > 0) {
+    content[len++] = ']';
+    content[len++] = '\n';
   }
 
   // free locks
-  for (size_t i = 0; i < num_pairs; i++) {
-    int index = hash(keys[i]);
-    if (locked_indices[index]) {
-      locked_indices[index] = 0;
-      pthread_rwlock_unlock(&table_locks[index]);
+  unlock_stripes(num_locked, stripes);
+
+  int result = commit_changes(lsn);
+
+  outbuf_commit(out, len);
+  stats_record(STAT_DELETE, start);
+  return result;
+}
+
+int kvs_apply(size_t num_changes, KvsChange changes[], OutBuffer *out) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  // acquire the locks of every stripe the batch touches
+  uint64_t start = stats_now();
+  size_t num_keys = 0;
+  size_t num_deleted = 0;
+  for (size_t c = 0; c < num_changes; c++) {
+    num_keys += changes[c].num_pairs;
+    if (changes[c].deleting) {
+      // output is listed by key order
+      sort_keys(changes[c].num_pairs, changes[c].keys);
+      num_deleted += changes[c].num_pairs;
+    }
+  }
+  size_t stripes[num_keys > 0 ? num_keys : 1];
+  size_t num_locked = 0;
+  for (size_t c = 0; c < num_changes; c++) {
+    for (size_t i = 0; i < changes[c].num_pairs; i++) {
+      stripes[num_locked++] = key_stripe(kvs_table, changes[c].keys[i]);
     }
   }
+  num_locked = sort_stripes(num_locked, stripes);
+  // keys found missing by the deletes, listed once the locks are released
+  unsigned char missing[num_deleted > 0 ? num_deleted : 1];
+  lock_stripes(num_locked, stripes, 1, STAT_APPLY_LOCK);
 
-  return 0;
+  uint64_t lsn = 0;
+  size_t deleted = 0;
+  for (size_t c = 0; c < num_changes; c++) {
+    KvsChange *change = &changes[c];
+    for (size_t i = 0; i < change->num_pairs; i++) {
+      const char *key = change->keys[i];
+      track_change(key, change->deleting);
+      if (change->deleting) {
+        missing[deleted] = delete_pair(kvs_table, key) != 0;
+        if (!missing[deleted++] && wal_enabled) {
+          lsn = wal_append(BACKUP_DELETE, key, NULL);
+        }
+      } else if (write_pair(kvs_table, key, change->values[i]) != 0) {
+        fprintf(stderr, "Failed to write keypair (%s,%s)\n", key, change->values[i]);
+      } else if (wal_enabled) {
+        lsn = wal_append(BACKUP_PUT, key, change->values[i]);
+      }
+    }
+  }
+
+  // free locks
+  unlock_stripes(num_locked, stripes);
+
+  int result = commit_changes(lsn);
+
+  deleted = 0;
+  for (size_t c = 0; c < num_changes; c++) {
+    if (!changes[c].deleting) {
+      continue;
+    }
+    char *content = outbuf_reserve(out, LIST_OUTPUT_SIZE);
+    size_t len = 0;
+    for (size_t i = 0; i < changes[c].num_pairs; i++) {
+      if (missing[deleted++]) {
+        if (len == 0) {
+          content[len++] = '[';
+        }
+        len += format_pair(content + len, changes[c].keys[i], "KVSMISSING");
+      }
+    }
+    if (len > 0) {
+      content[len++] = ']';
+      content[len++] = '\n';
+    }
+    outbuf_commit(out, len);
+  }
+  stats_record(STAT_APPLY, start);
+  return result;
 }
 
-void kvs_show(int file_out) {
-  // acquire locks for all table entries
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    pthread_rwlock_rdlock(&table_locks[i]);
+static void add_pair(const char *key, const char *value, void *arg) {
+  Snapshot *snapshot = (Snapshot*) arg;
+  if (snapshot->count == snapshot->capacity) {
+    size_t capacity = snapshot->capacity > 0 ? snapshot->capacity * 2 : 64;
+    PairCopy *pairs = realloc(snapshot->pairs, capacity * sizeof(PairCopy));
+    if (pairs == NULL) {
+      snapshot->failed = 1;
+      return;
+    }
+    snapshot->pairs = pairs;
+    snapshot->capacity = capacity;
   }
+  PairCopy *pair = &snapshot->pairs[snapshot->count++];
+  pair->key[strn_memcpy(pair->key, key, MAX_STRING_SIZE - 1)] = '\0';
+  pair->value[strn_memcpy(pair->value, value, MAX_STRING_SIZE - 1)] = '\0';
+}
 
-  // show table contents
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = kvs_table->table[i];
-    while (keyNode != NULL) {
-      char content[MAX_WRITE_SIZE];
-      sprintf(content, "(%s, %s)\n", keyNode->key, keyNode->value);
-      write(file_out, content, strlen(content));
-      keyNode = keyNode->next; // Move to the next node
+static void add_node(KeyNode *keyNode, void *arg) {
+  add_pair(keyNode->key, keyNode->value, arg);
+}
+
+static int compare_pairs(const void *a, const void *b) {
+  return strcmp(((const PairCopy*) a)->key, ((const PairCopy*) b)->key);
+}
+
+/// Copies every pair of the table without taking locks. The copy is only
+/// kept if no stripe changed from before the first pair was copied until
+/// after the last, so it is the state of the table at one instant.
+/// @param snapshot Snapshot to fill.
+/// @return 0 if the copy is consistent, 1 otherwise.
+static int snapshot_optimistic(Snapshot *snapshot) {
+  unsigned seqs[num_stripes];
+  for (size_t i = 0; i < num_stripes; i++) {
+    seqs[i] = segment_read_begin(&kvs_table->segments[i]);
+  }
+  snapshot->count = 0;
+  for (size_t i = 0; i < num_stripes; i++) {
+    if (copy_pairs(kvs_table, i, seqs[i], add_pair, snapshot) != 0) {
+      return 1;
+    }
+  }
+  for (size_t i = 0; i < num_stripes; i++) {
+    if (!segment_read_valid(&kvs_table->segments[i], seqs[i])) {
+      return 1;
     }
   }
+  return 0;
+}
 
-  // free locks
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    pthread_rwlock_unlock(&table_locks[i]);
+/// Sorts the pairs of a snapshot by key.
+/// @param snapshot Pairs to sort.
+static void sort_snapshot(Snapshot *snapshot) {
+  if (snapshot->count > 0) {
+    qsort(snapshot->pairs, snapshot->count, sizeof(PairCopy), compare_pairs);
+  }
+}
+
+void kvs_show(OutBuffer *out) {
+  uint64_t start = stats_now();
+  Snapshot snapshot = {NULL, 0, 0, 0};
+
+  // copy the table without blocking writers, or with them all stopped if
+  // they keep getting in the way
+  int copied = 0;
+  for (int attempt = 0; attempt < OPTIMISTIC_TRIES && !copied && !snapshot.failed; attempt++) {
+    copied = snapshot_optimistic(&snapshot) == 0;
   }
+  if (!copied && !snapshot.failed) {
+    uint64_t lock_start = stats_now();
+    lock_all_stripes(0);
+    stats_record(STAT_SHOW_LOCK, lock_start);
+    snapshot.count = 0;
+    for (size_t i = 0; i < num_stripes; i++) {
+      visit_nodes(kvs_table, i, add_node, &snapshot);
+    }
+    unlock_all_stripes();
+  }
+  if (snapshot.failed) {
+    fprintf(stderr, "Failed to allocate memory for SHOW\n");
+    free(snapshot.pairs);
+    return;
+  }
+
+  // pairs are listed by key order, independently of where they are stored
+  dump_pairs(snapshot.pairs, snapshot.count, out);
+  free(snapshot.pairs);
+  stats_record(STAT_SHOW, start);
 }
 
-int kvs_backup(char pathname[], int max_backups, int *simultaneous_backups, int backup_num) { 
-  int pid, status;
+// Arguments for the visitor that collects the pairs a backup shows.
+typedef struct {
+  Snapshot *snapshot;
+  uint64_t version;
+} BackupVisit;
 
-  // acquire lock for backups
+static void add_unchanged_node(KeyNode *keyNode, void *arg) {
+  BackupVisit *visit = (BackupVisit*) arg;
+  // nodes written later hold new values; their old ones were preserved
+  if (keyNode->version <= visit->version) {
+    add_pair(keyNode->key, keyNode->value, visit->snapshot);
+  }
+}
+
+/// Removes a backup from the running ones, so writers stop preserving values
+/// for it.
+/// @param backup Backup to remove.
+static void remove_backup(Backup *backup) {
   pthread_mutex_lock(&backups_lock);
-  // if simultaneous_backups exceed the maximum, wait for one backup to terminate
-  if (*simultaneous_backups >= max_backups) {
-    pid = wait(&status);
-    *simultaneous_backups -= 1;
+  lock_all_stripes(1);
+  for (Backup **it = &running_backups; *it != NULL; it = &(*it)->next) {
+    if (*it == backup) {
+      *it = backup->next;
+      break;
+    }
   }
-  // increment simultaneous_backups and release lock
-  *simultaneous_backups += 1;
+  unlock_all_stripes();
   pthread_mutex_unlock(&backups_lock);
 
-  // acquire locks for all table entries
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    pthread_rwlock_rdlock(&table_locks[i]);
+  for (size_t i = 0; i < num_stripes; i++) {
+    while (backup->preserved[i] != NULL) {
+      PreservedPair *next = backup->preserved[i]->next;
+      free(backup->preserved[i]);
+      backup->preserved[i] = next;
+    }
   }
-  pid = fork();
-  // free locks
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    pthread_rwlock_unlock(&table_locks[i]);
-  }
-  // child process
-  if (pid == 0) {
-    // get backup file path
-    char filename_out[MAX_JOB_FILE_NAME_SIZE], pathname_out[PATH_MAX];
-    strcpy(filename_out, pathname);
-    char *dotPos = strrchr(filename_out, '.');
-    *dotPos = '\0';
-    snprintf(pathname_out, sizeof(filename_out)+sizeof(backup_num)+4, "%s-%d.bck", filename_out, backup_num);
-    
-    // open backup file
-    int file_out = open(pathname_out, O_CREAT | O_WRONLY | O_TRUNC, 0644);
-
-    // perform backup
-    kvs_show(file_out);
-
-    // cleanup and exit
+}
+
+static int compare_dirty_keys(const void *a, const void *b) {
+  return strcmp((const char*) a, (const char*) b);
+}
+
+/// Sorts the keys of a dirty set, dropping repeated ones.
+/// @param dirty Keys to sort.
+static void sort_dirty_keys(DirtyKeys *dirty) {
+  if (dirty->count == 0) {
+    return;
+  }
+  qsort(dirty->keys, dirty->count, MAX_STRING_SIZE, compare_dirty_keys);
+  size_t unique = 1;
+  for (size_t i = 1; i < dirty->count; i++) {
+    if (strcmp(dirty->keys[i], dirty->keys[unique - 1]) != 0) {
+      memcpy(dirty->keys[unique++], dirty->keys[i], MAX_STRING_SIZE);
+    }
+  }
+  dirty->count = unique;
+}
+
+/// Collects the pairs of a stripe a backup shows: pairs changed since the
+/// backup started are skipped, and their preserved values used instead. For
+/// deltas only the keys changed since the base version are collected.
+/// @param backup Backup being written.
+/// @param stripe Stripe to read.
+/// @param snapshot Snapshot to add the pairs to.
+static void collect_stripe(Backup *backup, size_t stripe, Snapshot *snapshot) {
+  DirtyKeys *dirty = &backup->dirty[stripe];
+  pthread_rwlock_rdlock(&table_locks[stripe].lock);
+  if (!backup->delta) {
+    BackupVisit visit = {snapshot, backup->version};
+    visit_nodes(kvs_table, stripe, add_unchanged_node, &visit);
+  } else {
+    for (size_t i = 0; i < dirty->count; i++) {
+      KeyNode *keyNode = get_key_node(kvs_table, dirty->keys[i]);
+      if (keyNode != NULL && keyNode->version <= backup->version) {
+        add_pair(keyNode->key, keyNode->value, snapshot);
+      }
+    }
+  }
+  for (PreservedPair *pair = backup->preserved[stripe]; pair != NULL; pair = pair->next) {
+    if (!backup->delta || (dirty->count > 0 &&
+        bsearch(pair->key, dirty->keys, dirty->count, MAX_STRING_SIZE, compare_dirty_keys) != NULL)) {
+      add_pair(pair->key, pair->value, snapshot);
+    }
+  }
+  pthread_rwlock_unlock(&table_locks[stripe].lock);
+}
+
+static void write_backup_bytes(OutBuffer *out, uint32_t *crc, const unsigned char *data, size_t len) {
+  *crc = crc32_update(*crc, data, len);
+  outbuf_write(out, (const char*) data, len);
+}
+
+/// Writes a backup in the binary format. Full backups hold a put for every
+/// pair; deltas a put for every changed key still stored at the backup's
+/// version, and a delete for every other changed key.
+/// @param backup Backup being written.
+/// @param snapshot Pairs the backup shows, sorted by key.
+/// @param changed Keys changed since the base version, sorted without
+/// repeats. Only used by deltas.
+/// @param num_changed Number of changed keys.
+/// @param out Output buffer to write the output.
+static void write_binary_backup(Backup *backup, Snapshot *snapshot, char (*changed)[MAX_STRING_SIZE], size_t num_changed, OutBuffer *out) {
+  BackupHeader header = {
+    BACKUP_FORMAT, backup->delta ? BACKUP_DELTA : BACKUP_FULL, backup->base_version, backup->version,
+    (uint32_t) (backup->delta ? num_changed : snapshot->count)
+  };
+  unsigned char bytes[BACKUP_RECORD_SIZE(MAX_STRING_SIZE, MAX_STRING_SIZE)];
+  uint32_t crc = 0;
+  backup_encode_header(&header, bytes);
+  write_backup_bytes(out, &crc, bytes, BACKUP_HEADER_SIZE);
+
+  size_t pair = 0;
+  for (size_t i = 0; i < header.count; i++) {
+    size_t len;
+    if (!backup->delta || (pair < snapshot->count && strcmp(snapshot->pairs[pair].key, changed[i]) == 0)) {
+      len = backup_encode_record(BACKUP_FORMAT, BACKUP_PUT, snapshot->pairs[pair].key, snapshot->pairs[pair].value, bytes);
+      pair++;
+    } else {
+      len = backup_encode_record(BACKUP_FORMAT, BACKUP_DELETE, changed[i], NULL, bytes);
+    }
+    write_backup_bytes(out, &crc, bytes, len);
+  }
+
+  backup_encode_trailer(crc, bytes);
+  outbuf_write(out, (const char*) bytes, BACKUP_TRAILER_SIZE);
+}
+
+/// Allocates a backup with empty lists for every stripe.
+/// @return New backup, NULL on failure.
+static Backup *new_backup() {
+  Backup *backup = calloc(1, sizeof(Backup));
+  if (backup == NULL) {
+    return NULL;
+  }
+  backup->preserved = calloc(num_stripes, sizeof(PreservedPair*));
+  backup->dirty = calloc(num_stripes, sizeof(DirtyKeys));
+  if (backup->preserved == NULL || backup->dirty == NULL) {
+    free(backup->preserved);
+    free(backup->dirty);
+    free(backup);
+    return NULL;
+  }
+  return backup;
+}
+
+/// Frees a backup once it was written, with the keys it was given.
+/// @param backup Backup to free; its preserved values are already freed.
+static void free_backup(Backup *backup) {
+  for (size_t i = 0; i < num_stripes; i++) {
+    free(backup->dirty[i].keys);
+  }
+  free(backup->preserved);
+  free(backup->dirty);
+  free(backup);
+}
+
+/// Collects the pairs a backup shows and writes them to its file.
+/// @param arg Backup to write, freed at the end.
+static void *backup_thread(void *arg) {
+  Backup *backup = (Backup*) arg;
+  Snapshot snapshot = {NULL, 0, 0, 0};
+  char (*changed)[MAX_STRING_SIZE] = NULL;
+  size_t num_changed = 0;
+
+  for (size_t i = 0; i < num_stripes; i++) {
+    sort_dirty_keys(&backup->dirty[i]);
+    num_changed += backup->dirty[i].count;
+  }
+  for (size_t i = 0; i < num_stripes; i++) {
+    collect_stripe(backup, i, &snapshot);
+  }
+  remove_backup(backup);
+
+  int failed = snapshot.failed || backup->failed;
+  if (backup->delta && num_changed > 0 && !failed) {
+    // the changed keys of every stripe, sorted like the pairs
+    changed = malloc(num_changed * MAX_STRING_SIZE);
+    if (changed == NULL) {
+      failed = 1;
+    } else {
+      size_t len = 0;
+      for (size_t i = 0; i < num_stripes; i++) {
+        if (backup->dirty[i].count > 0) {
+          memcpy(changed[len], backup->dirty[i].keys, backup->dirty[i].count * MAX_STRING_SIZE);
+          len += backup->dirty[i].count;
+        }
+      }
+      qsort(changed, num_changed, MAX_STRING_SIZE, compare_dirty_keys);
+    }
+  }
+
+  int file_out = -1;
+  OutBuffer *out = NULL;
+  if (failed) {
+    fprintf(stderr, "Failed to allocate memory for backup %s\n", backup->pathname);
+  } else if ((file_out = open(backup->pathname, O_CREAT | O_WRONLY | O_TRUNC, 0644)) == -1 ||
+             (out = malloc(sizeof(OutBuffer))) == NULL) {
+    fprintf(stderr, "Failed to open backup file %s\n", backup->pathname);
+    failed = 1;
+  } else {
+    outbuf_init(out, file_out);
+    if (incremental_backups || backup->checkpoint) {
+      sort_snapshot(&snapshot);
+      write_binary_backup(backup, &snapshot, changed, num_changed, out);
+    } else {
+      dump_pairs(snapshot.pairs, snapshot.count, out);
+    }
+    outbuf_flush(out);
+    if (backup->checkpoint && fsync(file_out) != 0) {
+      perror("Failed to sync checkpoint");
+      failed = 1;
+    }
+  }
+  if (backup->checkpoint) {
+    if (file_out != -1) {
+      close(file_out);
+      file_out = -1;
+    }
+    if (failed) {
+      wal_request_checkpoint();
+    } else {
+      wal_checkpoint_done(backup->lsn);
+    }
+  } else if (failed && incremental_backups) {
+    // deltas after this one would miss its changes
+    pthread_mutex_lock(&backups_lock);
+    base_lost = 1;
+    pthread_mutex_unlock(&backups_lock);
+  }
+
+  // cleanup
+  if (file_out != -1) {
     close(file_out);
-    kvs_terminate();
-    exit(0);
   }
-  // parent process
-  else {
-    // esperar que os filhos acabem
-    for (int i = 0; i < *simultaneous_backups; i++) {
-      wait(NULL);
+  free(out);
+  free(changed);
+  free(snapshot.pairs);
+  free_backup(backup);
+  sem_post(&backup_slots);
+  return NULL;
+}
+
+/// Fixes the state a backup shows and starts writing it. The caller holds
+/// one of the backup slots, given back once the backup is written.
+/// @param backup Backup to start.
+static void start_backup(Backup *backup) {
+  // with writers locked out, fix the version the backup shows
+  uint64_t start = stats_now();
+  pthread_mutex_lock(&backups_lock);
+  lock_all_stripes(1);
+  stats_record(STAT_BACKUP_LOCK, start);
+  backup->version = start_version(kvs_table);
+  if (backup->checkpoint) {
+    backup->lsn = wal_last_lsn();
+    wal_checkpoint_path(backup->lsn, 1, backup->pathname, sizeof(backup->pathname));
+  } else if (incremental_backups) {
+    // the backup takes the keys changed since the previous one; if any could
+    // not be tracked, or the previous backup was lost, it holds every pair
+    int dirty_failed = 0;
+    for (size_t i = 0; i < num_stripes; i++) {
+      dirty_failed |= dirty_keys[i].failed;
+      backup->dirty[i] = dirty_keys[i];
+      dirty_keys[i] = (DirtyKeys){NULL, 0, 0, 0};
     }
+    backup->delta = backups_taken && !base_lost && !dirty_failed;
+    backup->base_version = backup->delta ? last_backup_version : 0;
+    backups_taken = 1;
+    last_backup_version = backup->version;
+    base_lost = 0;
+  }
+  backup->next = running_backups;
+  running_backups = backup;
+  unlock_all_stripes();
+  pthread_mutex_unlock(&backups_lock);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, backup_thread, backup) != 0) {
+    // written by this thread instead
+    backup_thread(backup);
+    return;
+  }
+  pthread_detach(thread);
+}
+
+/// Commits the changes logged by an operation, then starts the checkpoint
+/// requested when the log closed a segment, if a backup slot is free.
+/// @param lsn Last change logged by the operation, 0 if none.
+/// @return 0 if the changes are logged as the fsync policy promises, 1 if
+/// the log failed.
+static int commit_changes(uint64_t lsn) {
+  if (!wal_enabled) {
     return 0;
   }
-  
+  int result = 0;
+  if (lsn != 0 && wal_commit(lsn) != 0) {
+    fprintf(stderr, "Failed to log changes up to %llu\n", (unsigned long long) lsn);
+    result = 1;
+  }
+  if (wal_take_checkpoint()) {
+    Backup *backup;
+    if (sem_trywait(&backup_slots) != 0) {
+      wal_request_checkpoint();
+    } else if ((backup = new_backup()) == NULL) {
+      sem_post(&backup_slots);
+      wal_request_checkpoint();
+    } else {
+      backup->checkpoint = 1;
+      start_backup(backup);
+    }
+  }
+  return result;
+}
+
+int kvs_backup(const char *pathname, int backup_num) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  uint64_t start = stats_now();
+  Backup *backup = new_backup();
+  if (backup == NULL) {
+    return 1;
+  }
+  // get backup file path
+  char filename_out[MAX_JOB_FILE_NAME_SIZE];
+  strcpy(filename_out, pathname);
+  char *dotPos = strrchr(filename_out, '.');
+  *dotPos = '\0';
+  snprintf(backup->pathname, sizeof(backup->pathname), "%s-%d.bck", filename_out, backup_num);
+
+  // wait until fewer than max_backups backups are being written
+  sem_wait(&backup_slots);
+  start_backup(backup);
+  stats_record(STAT_BACKUP, start);
   return 0;
 }
 
-void kvs_wait(int file_out, unsigned int delay_ms) {
-  char wait[] = "Waiting...\n";
-  write(file_out, wait, strlen(wait));
+void kvs_wait(OutBuffer *out, unsigned int delay_ms) {
+  // the output so far is written before sleeping
+  outbuf_str(out, "Waiting...\n");
+  outbuf_flush(out);
   struct timespec delay = delay_to_timespec(delay_ms);
   nanosleep(&delay, NULL);
 }
 
-int subscribe_key(char *key, int notif_fd) {
+/// Slot of a client's subscriptions holding a key, or the free slot it
+/// would go in. The client must have room for one more subscription.
+static size_t find_subscription(const Subscriptions *subs, const char *key, uint64_t key_hash) {
+  size_t mask = subs->capacity - 1;
+  size_t i = key_hash & mask;
+  while (subs->slots[i].hash != 0 &&
+         (subs->slots[i].hash != key_hash || strcmp(subs->slots[i].key, key) != 0)) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+/// Doubles a client's subscriptions table, rehashing its keys.
+/// @return 0 if the table grew, 1 if there was no memory for it.
+static int grow_subscriptions(Subscriptions *subs) {
+  Subscriptions grown = {NULL, subs->count, subs->capacity > 0 ? subs->capacity * 2 : 8};
+  grown.slots = calloc(grown.capacity, sizeof(Subscription));
+  if (grown.slots == NULL) {
+    return 1;
+  }
+  for (size_t i = 0; i < subs->capacity; i++) {
+    if (subs->slots[i].hash != 0) {
+      grown.slots[find_subscription(&grown, subs->slots[i].key, subs->slots[i].hash)] = subs->slots[i];
+    }
+  }
+  free(subs->slots);
+  *subs = grown;
+  return 0;
+}
+
+int subscribe_key(char *key, int notif_fd, Subscriptions *subs) {
+  // room for the key in the client's table, at most 3/4 full, before it is
+  // subscribed
+  uint64_t key_hash = hash(key) | 1;
+  if (4 * (subs->count + 1) > 3 * subs->capacity && grow_subscriptions(subs) != 0) {
+    return 0;
+  }
+
+  size_t stripe = key_stripe(kvs_table, key);
+  pthread_rwlock_wrlock(&table_locks[stripe].lock);
   KeyNode *keyNode = get_key_node(kvs_table, key);
 
   // se a chave não existe
   if (keyNode == NULL) {
+    pthread_rwlock_unlock(&table_locks[stripe].lock);
     return 0;
   }
 
-  for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-    if (keyNode->clients[i] == -1) {
-      pthread_rwlock_wrlock(&table_locks[hash(keyNode->key)]);
-      keyNode->clients[i] = notif_fd;
-      pthread_rwlock_unlock(&table_locks[hash(keyNode->key)]);
-      return 1;
+  int subscribed = add_subscriber(keyNode, notif_fd);
+  pthread_rwlock_unlock(&table_locks[stripe].lock);
+  if (subscribed) {
+    Subscription *slot = &subs->slots[find_subscription(subs, key, key_hash)];
+    if (slot->hash == 0) {
+      slot->hash = key_hash;
+      strncpy(slot->key, key, MAX_STRING_SIZE);
+      slot->key[MAX_STRING_SIZE] = '\0';
+      subs->count++;
     }
   }
-
-  return 0;
+  return subscribed;
 }
 
-int unsubscribe_key(char *key, int notif_fd) {
+/// Unsubscribes a client from a key still in the table.
+static int remove_subscription(const char *key, int notif_fd) {
+  size_t stripe = key_stripe(kvs_table, key);
+  pthread_rwlock_wrlock(&table_locks[stripe].lock);
   KeyNode *keyNode = get_key_node(kvs_table, key);
 
   // se a chave não existir
   if (keyNode == NULL) {
+    pthread_rwlock_unlock(&table_locks[stripe].lock);
     return FAILURE;
   }
 
-  for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-    if (keyNode->clients[i] == notif_fd) {
-      pthread_rwlock_wrlock(&table_locks[hash(keyNode->key)]);
-      keyNode->clients[i] = -1;
-      pthread_rwlock_unlock(&table_locks[hash(keyNode->key)]);
-      return SUCCESS;
+  // falha se o cliente nao estiver subscrito a essa chave
+  int result = remove_subscriber(keyNode, notif_fd);
+  pthread_rwlock_unlock(&table_locks[stripe].lock);
+  return result;
+}
+
+int unsubscribe_key(char *key, int notif_fd, Subscriptions *subs) {
+  if (subs->count > 0) {
+    uint64_t key_hash = hash(key) | 1;
+    size_t mask = subs->capacity - 1;
+    size_t i = find_subscription(subs, key, key_hash);
+    if (subs->slots[i].hash != 0) {
+      // the keys after it that probed past it move back, so no lookup stops
+      // short at the freed slot
+      for (size_t j = (i + 1) & mask; subs->slots[j].hash != 0; j = (j + 1) & mask) {
+        size_t home = subs->slots[j].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+          subs->slots[i] = subs->slots[j];
+          i = j;
+        }
+      }
+      subs->slots[i].hash = 0;
+      subs->count--;
     }
   }
-
-  // se o cliente nao estiver subscrito a essa chave
-  return FAILURE;
+  return remove_subscription(key, notif_fd);
 }
 
-void delete_all_subs(int notif_fd) {
-  if (kvs_table == NULL) {
-    return;
-  }
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *head = kvs_table->table[i];
-    while (head != NULL) {
-      unsubscribe_key(head->key, notif_fd);
-      head = head->next;
+void delete_all_subs(int notif_fd, Subscriptions *subs) {
+  if (kvs_table != NULL) {
+    for (size_t i = 0; i < subs->capacity; i++) {
+      if (subs->slots[i].hash != 0) {
+        remove_subscription(subs->slots[i].key, notif_fd);
+      }
     }
   }
+  free(subs->slots);
+  subs->slots = NULL;
+  subs->count = subs->capacity = 0;
 }
@@ -2,79 +2,133 @@
 #define KVS_OPERATIONS_H
 
 #include <stddef.h>
+#include <stdint.h>
 
-/// Initializes the KVS state.
+#include "constants.h"
+#include "io.h"
+
+/// Options of the KVS state.
+typedef struct {
+  int max_backups; // backups being written at the same time
+  int incremental_backups; // backups are binary, each a delta of the previous one
+  const char *wal_dir; // directory of the write-ahead log, NULL for none
+  int wal_sync_ms; // fsync policy of the log, see wal.h
+  // lock stripes (and table segments), rounded up to a power of two; 0 for
+  // STRIPES_PER_CORE per online core
+  size_t num_stripes;
+} KvsConfig;
+
+/// Initializes the KVS state, recovering it from the write-ahead log if one
+/// is used.
+/// @param config Options of the KVS state.
 /// @return 0 if the KVS state was initialized successfully, 1 otherwise.
-int kvs_init();
+int kvs_init(const KvsConfig *config);
 
-/// Destroys the KVS state.
+/// Destroys the KVS state, once every backup was written.
 /// @return 0 if the KVS state was terminated successfully, 1 otherwise.
 int kvs_terminate();
 
-/// @brief Sorts (key, value) pairs by key alphabetical order
-/// @param num_pairs Number of pairs to sort
-/// @param keys Array of keys' strings
-/// @param values Array of values' strings
-void sort_keys_values(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]);
-
 /// Writes a key value pair to the KVS. If key already exists it is updated.
 /// @param num_pairs Number of pairs being written.
 /// @param keys Array of keys' strings.
 /// @param values Array of values' strings.
-/// @return 0 if the pairs were written successfully, 1 otherwise.
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]);
+/// @return 0 if the pairs were written successfully, 1 otherwise, also when
+/// the write-ahead log failed to store them.
+int kvs_write(size_t num_pairs, char *keys[], char *values[]);
 
-/// @brief Sorts keys by alphabetical order
+/// @brief Sorts keys by alphabetical order, moving only the pointers
 /// @param num_pairs Number of keys
 /// @param keys Array of keys' strings
-void sort_keys(size_t num_pairs, char keys[][MAX_STRING_SIZE]);
+void sort_keys(size_t num_pairs, char *keys[]);
 
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
-/// @param file_out File descriptor to write the (successful) output.
+/// @param out Output buffer to write the (successful) output.
 /// @return 0 if the key reading, 1 otherwise.
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int file_out);
+int kvs_read(size_t num_pairs, char *keys[], OutBuffer *out);
 
 /// Deletes key value pairs from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
-/// @param file_out File descriptor to write the (unsuccessful) output.
-/// @return 0 if the pairs were deleted successfully, 1 otherwise.
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int file_out);
+/// @param out Output buffer to write the (unsuccessful) output.
+/// @return 0 if the pairs were deleted successfully, 1 otherwise, also when
+/// the write-ahead log failed to store the deletes.
+int kvs_delete(size_t num_pairs, char *keys[], OutBuffer *out);
+
+/// A WRITE or DELETE of a batch given to kvs_apply.
+typedef struct {
+  int deleting; // 1 for a DELETE, 0 for a WRITE
+  size_t num_pairs;
+  char **keys;
+  char **values; // only used by WRITE
+} KvsChange;
+
+/// Applies consecutive writes and deletes in order, taking the locks of
+/// every stripe they touch once, and committing them to the log together.
+/// A key written twice keeps the later value. The output is the same as
+/// calling kvs_write and kvs_delete for each change.
+/// @param num_changes Number of changes.
+/// @param changes Changes to apply; keys of deletes are sorted.
+/// @param out Output buffer to write the (unsuccessful) deletes.
+/// @return 0 if the changes were applied, 1 otherwise, also when the
+/// write-ahead log failed to store them.
+int kvs_apply(size_t num_changes, KvsChange changes[], OutBuffer *out);
 
 /// Writes the state of the KVS.
-/// @param file_out File descriptor to write the output.
-void kvs_show(int file_out);
+/// @param out Output buffer to write the output.
+void kvs_show(OutBuffer *out);
 
 /// Creates a backup of the KVS state and stores it in the correspondent
-/// backup file.
+/// backup file. The state is fixed when the call returns, and the file is
+/// written by a separate thread while the KVS keeps changing. Blocks while
+/// the maximum number of backups is being written.
 /// @param pathname Path for the file that requested the backup
-/// @param max_backups Maximum simultaneous backups allowed
-/// @param simultaneous_backups Current simultaneous backups 
 /// @param backup_num Number of the current backup
-/// @return 0 if the backup was successful, 1 otherwise.
-int kvs_backup(char pathname[], int max_backups, int *simultaneous_backups, int backup_num);
+/// @return 0 if the backup was started successfully, 1 otherwise.
+int kvs_backup(const char *pathname, int backup_num);
 
-/// Waits for a given amount of time.
-/// @param file_out File descriptor to write the output.
+/// Waits for a given amount of time, flushing the output first.
+/// @param out Output buffer to write the output.
 /// @param delay_us Delay in milliseconds.
-void kvs_wait(int file_out, unsigned int delay_ms);
+void kvs_wait(OutBuffer *out, unsigned int delay_ms);
+
+/// A key a client subscribed, with its hash (made odd, so 0 marks a free
+/// slot).
+typedef struct {
+  uint64_t hash;
+  char key[MAX_STRING_SIZE + 1];
+} Subscription;
+
+/// Keys a client subscribed, the other side of the subscribers of each key,
+/// so a client's subscriptions are dropped without visiting the whole table.
+/// A linear probing table of capacity slots (a power of two, or 0 before the
+/// first subscription). Only the client's own thread uses it. It may still
+/// list keys deleted since, which took their subscribers with them.
+typedef struct {
+  Subscription *slots;
+  size_t count;
+  size_t capacity;
+} Subscriptions;
 
 /// @brief Adds a key to a client's subscriptions
 /// @param key key to subscribe
 /// @param notif_fd file descriptor for the client's notifications pipe
+/// @param subs keys the client subscribed, starting zeroed
 /// @return 1 if the operation is successful and 0 otherwise
-int subscribe_key(char *key, int notif_fd);
+int subscribe_key(char *key, int notif_fd, Subscriptions *subs);
 
 /// @brief Removes a key from a client's subscriptions
 /// @param key key to unsubscribe
 /// @param notif_fd file descriptor for the client's notifications pipe
+/// @param subs keys the client subscribed
 /// @return 0 if the operation is successful and 1 otherwise
-int unsubscribe_key(char *key, int notif_fd);
+int unsubscribe_key(char *key, int notif_fd, Subscriptions *subs);
 
-/// @brief Deletes all subscriptions from one client
+/// @brief Deletes all subscriptions from one client, in time proportional to
+/// its subscriptions, and frees the list of them
 /// @param notif_fd file descriptor for the client's notifications pipe
-void delete_all_subs(int notif_fd);
+/// @param subs keys the client subscribed
+void delete_all_subs(int notif_fd, Subscriptions *subs);
 
 #endif  // KVS_OPERATIONS_H
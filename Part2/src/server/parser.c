@@ -3,20 +3,174 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "constants.h"
 
-static int read_string(int fd, char *buffer, size_t max) {
-  ssize_t bytes_read;
+// initial size of the buffer of a file read with read_whole_file
+#define READ_INITIAL_SIZE 4096
+
+// Reader over fd that reads one byte at a time, so it never consumes the
+// bytes after the command it parses.
+static void reader_init_stream(JobReader *reader, int fd) {
+  reader->fd = fd;
+  reader->data = &reader->byte;
+  reader->pos = 0;
+  reader->len = 0;
+  reader->mapped = 0;
+  reader->stream = 1;
+}
+
+// Reads the whole file into memory, for files that cannot be mapped.
+static int read_whole_file(JobReader *reader) {
+  size_t size = 0, capacity = READ_INITIAL_SIZE;
+  char *data = malloc(capacity);
+  if (data == NULL) {
+    return 1;
+  }
+  while (1) {
+    if (size == capacity) {
+      char *grown = realloc(data, capacity * 2);
+      if (grown == NULL) {
+        free(data);
+        return 1;
+      }
+      data = grown;
+      capacity *= 2;
+    }
+    ssize_t bytes_read = read(reader->fd, data + size, capacity - size);
+    if (bytes_read < 0) {
+      free(data);
+      return 1;
+    }
+    if (bytes_read == 0) {
+      break;
+    }
+    size += (size_t)bytes_read;
+  }
+  reader->data = data;
+  reader->len = size;
+  return 0;
+}
+
+int reader_open(JobReader *reader, int fd) {
+  reader->fd = fd;
+  reader->pos = 0;
+  reader->mapped = 0;
+  reader->stream = 0;
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    // read-only: tokens are handed out as slices, never terminated in place
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+      reader->data = map;
+      reader->len = (size_t)st.st_size;
+      reader->mapped = 1;
+      return 0;
+    }
+  }
+
+  return read_whole_file(reader);
+}
+
+void reader_close(JobReader *reader) {
+  if (reader->stream) {
+    return;
+  }
+  if (reader->mapped) {
+    munmap((void *)reader->data, reader->len);
+  } else {
+    free((void *)reader->data);
+  }
+  reader->data = NULL;
+  reader->len = 0;
+}
+
+// Gets the next byte of the file.
+// @return 1 if a byte was read, 0 at the end of the file or on error.
+static int next_char(JobReader *reader, char *ch) {
+  if (reader->pos == reader->len) {
+    // a reader holding the whole file has nothing left to read
+    if (!reader->stream) {
+      return 0;
+    }
+    ssize_t bytes_read = read(reader->fd, &reader->byte, 1);
+    if (bytes_read <= 0) {
+      return 0;
+    }
+    reader->pos = 0;
+    reader->len = (size_t)bytes_read;
+  }
+  *ch = reader->data[reader->pos++];
+  return 1;
+}
+
+// Reads up to n bytes.
+// @return Number of bytes read, lower than n only at the end of the file.
+static size_t next_chars(JobReader *reader, char *buf, size_t n) {
+  size_t i = 0;
+  while (i < n && next_char(reader, buf + i)) {
+    i++;
+  }
+  return i;
+}
+
+static int is_delimiter(char ch) {
+  return ch == ',' || ch == ')' || ch == ']' || ch == ' ';
+}
+
+// Finds the first byte that ends a key or value: ',', ')' or ']', or the
+// ' ' that makes it invalid.
+// @return Index of the byte, len if there is none.
+static size_t find_delimiter(const char *data, size_t len) {
+  size_t i = 0;
+#ifdef __SSE2__
+  if (len >= 16) {
+    const __m128i comma = _mm_set1_epi8(','), paren = _mm_set1_epi8(')');
+    const __m128i bracket = _mm_set1_epi8(']'), space = _mm_set1_epi8(' ');
+    while (1) {
+      // the last chunk overlaps the one before instead of going scalar
+      if (i + 16 > len) {
+        i = len - 16;
+      }
+      __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+      __m128i hits = _mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi8(chunk, comma), _mm_cmpeq_epi8(chunk, paren)),
+          _mm_or_si128(_mm_cmpeq_epi8(chunk, bracket), _mm_cmpeq_epi8(chunk, space)));
+      int mask = _mm_movemask_epi8(hits);
+      if (mask != 0) {
+        return i + (size_t)__builtin_ctz((unsigned int)mask);
+      }
+      if (i + 16 == len) {
+        return len;
+      }
+      i += 16;
+    }
+  }
+#endif
+  for (; i < len; i++) {
+    if (is_delimiter(data[i])) {
+      return i;
+    }
+  }
+  return len;
+}
+
+static int read_string(JobReader *reader, char *buffer, size_t max) {
   char ch;
   size_t i = 0;
   int value = -1;
 
   while (i < max) {
-    bytes_read = read(fd, &ch, 1);
-
-    if (bytes_read <= 0) {
+    if (!next_char(reader, &ch)) {
         return -1;
     }
 
@@ -37,6 +191,11 @@ static int read_string(int fd, char *buffer, size_t max) {
       break;
     }
 
+    // leaves room for the '\0'
+    if (i == max - 1) {
+      return -1;
+    }
+
     buffer[i++] = ch;
   }
 
@@ -45,12 +204,51 @@ static int read_string(int fd, char *buffer, size_t max) {
   return value;
 }
 
-static int read_uint(int fd, unsigned int *value, char *next) {
+// Gets the next key or value, of at most max - 1 bytes. A reader holding the
+// whole file returns a slice of it; a stream reader copies the token to
+// storage, terminated.
+// @return 0, 1 or 2 when the token ends at ',', ')' or ']', -1 on error.
+static int next_token(JobReader *reader, Token *token, char *storage, size_t max) {
+  if (reader->stream) {
+    int end = read_string(reader, storage, max);
+    token->ptr = storage;
+    token->len = end < 0 ? 0 : strlen(storage);
+    return end;
+  }
+
+  // like read_string, gives up after max bytes without a delimiter, and
+  // consumes the delimiter of an invalid token too
+  const char *start = reader->data + reader->pos;
+  size_t left = reader->len - reader->pos;
+  size_t window = left < max ? left : max;
+  size_t len = find_delimiter(start, window);
+  if (len == window) {
+    reader->pos += window;
+    return -1;
+  }
+
+  char ch = start[len];
+  reader->pos += len + 1;
+  if (ch == ' ') {
+    return -1;
+  }
+
+  token->ptr = start;
+  token->len = len;
+  return ch == ',' ? 0 : ch == ')' ? 1 : 2;
+}
+
+static int read_uint(JobReader *reader, unsigned int *value, char *next) {
   char buf[16];
 
-  int i = 0;
+  size_t i = 0;
   while (1) {
-    if (read(fd, buf + i, 1) == 0) {
+    if (i == sizeof(buf) - 1) {
+      return 1;
+    }
+
+    if (!next_char(reader, buf + i)) {
+      buf[i] = '\0';
       *next = '\0';
       break;
     }
@@ -76,23 +274,29 @@ static int read_uint(int fd, unsigned int *value, char *next) {
   return 0;
 }
 
-static void cleanup(int fd) {
+static void cleanup(JobReader *reader) {
+  if (!reader->stream) {
+    char *newline = memchr(reader->data + reader->pos, '\n', reader->len - reader->pos);
+    reader->pos = newline != NULL ? (size_t)(newline - reader->data) + 1 : reader->len;
+    return;
+  }
+
   char ch;
-  while (read(fd, &ch, 1) == 1 && ch != '\n')
+  while (next_char(reader, &ch) && ch != '\n')
     ;
 }
 
-enum Command get_next(int fd) {
+enum Command reader_get_next(JobReader *reader) {
   char buf[16];
-  if (read(fd, buf, 1) != 1) {
+  if (!next_char(reader, buf)) {
     return EOC;
   }
 
   switch (buf[0]) {
     case 'W':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
-        if (read(fd, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
-          cleanup(fd);
+      if (next_chars(reader, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
+        if (next_chars(reader, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
+          cleanup(reader);
           return CMD_INVALID;
         }
         return CMD_WRITE;
@@ -101,114 +305,123 @@ enum Command get_next(int fd) {
       return CMD_WAIT;
 
     case 'R':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
-        cleanup(fd);
+      if (next_chars(reader, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
+        cleanup(reader);
         return CMD_INVALID;
       }
 
       return CMD_READ;
 
     case 'D':
-      if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
-        cleanup(fd);
+      if (next_chars(reader, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
+        cleanup(reader);
         return CMD_INVALID;
       }
 
       return CMD_DELETE;
 
     case 'S':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
-        cleanup(fd);
-        return CMD_INVALID;
+      if (next_chars(reader, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
+        if (strncmp(buf, "STAT", 4) != 0 || next_chars(reader, buf + 4, 1) != 1 || buf[4] != 'S') {
+          cleanup(reader);
+          return CMD_INVALID;
+        }
+
+        if (next_chars(reader, buf + 5, 1) != 0 && buf[5] != '\n') {
+          cleanup(reader);
+          return CMD_INVALID;
+        }
+
+        return CMD_STATS;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-        cleanup(fd);
+      if (next_chars(reader, buf + 4, 1) != 0 && buf[4] != '\n') {
+        cleanup(reader);
         return CMD_INVALID;
       }
 
       return CMD_SHOW;
 
     case 'B':
-      if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
-        cleanup(fd);
+      if (next_chars(reader, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
+        cleanup(reader);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
-        cleanup(fd);
+      if (next_chars(reader, buf + 6, 1) != 0 && buf[6] != '\n') {
+        cleanup(reader);
         return CMD_INVALID;
       }
 
       return CMD_BACKUP;
 
     case 'H':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
-        cleanup(fd);
+      if (next_chars(reader, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
+        cleanup(reader);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-        cleanup(fd);
+      if (next_chars(reader, buf + 4, 1) != 0 && buf[4] != '\n') {
+        cleanup(reader);
         return CMD_INVALID;
       }
 
       return CMD_HELP;
 
     case '#':
-      cleanup(fd);
+      cleanup(reader);
       return CMD_EMPTY;
 
     case '\n':
       return CMD_EMPTY;
 
     default:
-      cleanup(fd);
+      cleanup(reader);
       return CMD_INVALID;
   }
 }
 
-int parse_pair(int fd, char *key, char *value) {
-  if (read_string(fd, key, MAX_STRING_SIZE) != 0) {
-    cleanup(fd);
+static int parse_pair(JobReader *reader, Token *key, Token *value, char *key_storage, char *value_storage, size_t max_string_size) {
+  if (next_token(reader, key, key_storage, max_string_size) != 0) {
+    cleanup(reader);
     return 0;
   }
 
-  if (read_string(fd, value, MAX_STRING_SIZE) != 1) {
-    cleanup(fd);
+  if (next_token(reader, value, value_storage, max_string_size) != 1) {
+    cleanup(reader);
     return 0;
   }
 
   return 1;
 }
 
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
+// Parses a WRITE command. Stream readers copy the pairs to key_storage and
+// value_storage, which may be NULL for readers holding the whole file.
+static size_t parse_write_tokens(JobReader *reader, Token keys[], Token values[], char key_storage[][MAX_STRING_SIZE], char value_storage[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
-    cleanup(fd);
+  if (!next_char(reader, &ch) || ch != '[') {
+    cleanup(reader);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || ch != '(') {
-    cleanup(fd);
+  if (!next_char(reader, &ch) || ch != '(') {
+    cleanup(reader);
     return 0;
   }
 
   size_t num_pairs = 0;
-  char key[max_string_size];
-  char value[max_string_size];
   while (num_pairs < max_pairs) {
-    if(parse_pair(fd, key, value) == 0) {
-      cleanup(fd);
+    char *key_copy = key_storage != NULL ? key_storage[num_pairs] : NULL;
+    char *value_copy = value_storage != NULL ? value_storage[num_pairs] : NULL;
+    if(parse_pair(reader, &keys[num_pairs], &values[num_pairs], key_copy, value_copy, max_string_size) == 0) {
+      cleanup(reader);
       return 0;
     }
+    num_pairs++;
 
-    strcpy(keys[num_pairs], key);
-    strcpy(values[num_pairs++], value);
-
-    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
-      cleanup(fd);
+    if (!next_char(reader, &ch) || (ch != '(' && ch != ']')) {
+      cleanup(reader);
       return 0;
     }
 
@@ -218,36 +431,36 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
   }
 
   if (num_pairs == max_pairs) {
-    cleanup(fd);
+    cleanup(reader);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-    cleanup(fd);
+  if (!next_char(reader, &ch) || (ch != '\n' && ch != '\0')) {
+    cleanup(reader);
     return 0;
   }
 
   return num_pairs;
 }
 
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size) {
+// Parses a READ or DELETE command, storing keys like parse_write_tokens.
+static size_t parse_read_delete_tokens(JobReader *reader, Token keys[], char key_storage[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size) {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
-    cleanup(fd);
+  if (!next_char(reader, &ch) || ch != '[') {
+    cleanup(reader);
     return 0;
   }
 
   size_t num_keys = 0;
-  char key[max_string_size];
   while (num_keys < max_keys) {
-    int output = read_string(fd, key, max_string_size);
+    char *key_copy = key_storage != NULL ? key_storage[num_keys] : NULL;
+    int output = next_token(reader, &keys[num_keys], key_copy, max_string_size);
     if(output < 0 || output == 1) {
-      cleanup(fd);
+      cleanup(reader);
       return 0;
     }
-
-    strcpy(keys[num_keys++], key);
+    num_keys++;
 
     if (output == 2){
       break;
@@ -255,34 +468,42 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
   }
 
   if (num_keys == max_keys) {
-    cleanup(fd);
+    cleanup(reader);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-    cleanup(fd);
+  if (!next_char(reader, &ch) || (ch != '\n' && ch != '\0')) {
+    cleanup(reader);
     return 0;
   }
 
   return num_keys;
 }
 
-int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
+size_t reader_parse_write(JobReader *reader, Token keys[], Token values[], size_t max_pairs) {
+  return parse_write_tokens(reader, keys, values, NULL, NULL, max_pairs, MAX_STRING_SIZE);
+}
+
+size_t reader_parse_read_delete(JobReader *reader, Token keys[], size_t max_keys) {
+  return parse_read_delete_tokens(reader, keys, NULL, max_keys, MAX_STRING_SIZE);
+}
+
+int reader_parse_wait(JobReader *reader, unsigned int *delay, unsigned int *thread_id) {
   char ch;
 
-  if (read_uint(fd, delay, &ch) != 0) {
-    cleanup(fd);
+  if (read_uint(reader, delay, &ch) != 0) {
+    cleanup(reader);
     return -1;
   }
 
   if (ch == ' ') {
     if (thread_id == NULL) {
-      cleanup(fd);
+      cleanup(reader);
       return 0;
     }
 
-    if (read_uint(fd, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
-      cleanup(fd);
+    if (read_uint(reader, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
+      cleanup(reader);
       return -1;
     }
 
@@ -290,7 +511,33 @@ int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
   } else if (ch == '\n' || ch == '\0') {
     return 0;
   } else {
-    cleanup(fd);
+    cleanup(reader);
     return -1;
   }
-}
\ No newline at end of file
+}
+
+enum Command get_next(int fd) {
+  JobReader reader;
+  reader_init_stream(&reader, fd);
+  return reader_get_next(&reader);
+}
+
+size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
+  JobReader reader;
+  reader_init_stream(&reader, fd);
+  Token key_tokens[max_pairs + 1], value_tokens[max_pairs + 1];
+  return parse_write_tokens(&reader, key_tokens, value_tokens, keys, values, max_pairs, max_string_size);
+}
+
+size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size) {
+  JobReader reader;
+  reader_init_stream(&reader, fd);
+  Token key_tokens[max_keys + 1];
+  return parse_read_delete_tokens(&reader, key_tokens, keys, max_keys, max_string_size);
+}
+
+int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
+  JobReader reader;
+  reader_init_stream(&reader, fd);
+  return reader_parse_wait(&reader, delay, thread_id);
+}
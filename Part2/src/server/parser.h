@@ -11,12 +11,75 @@ enum Command {
   CMD_SHOW,
   CMD_WAIT,
   CMD_BACKUP,
+  CMD_STATS,
   CMD_HELP,
   CMD_EMPTY,
   CMD_INVALID,
   EOC  // End of commands
 };
 
+/// Key or value parsed by a JobReader: len bytes at ptr, not terminated.
+typedef struct {
+  const char *ptr;
+  size_t len;
+} Token;
+
+/// Reader over a job file. Readers opened with reader_open hold the whole file
+/// in memory, mapped read-only when possible, and hand out keys and values as
+/// slices of it.
+typedef struct {
+  int fd;
+  const char *data; // bytes being parsed: the whole file, or byte when streaming
+  size_t pos; // next byte of data to be parsed
+  size_t len; // bytes in data
+  int mapped; // data is a read-only mapping of the file
+  int stream; // data is refilled one byte per read(), for the fd functions
+  char byte;
+} JobReader;
+
+/// Opens a reader over a whole file, mapping it into memory, or reading it
+/// all when it cannot be mapped.
+/// @param reader Reader to open.
+/// @param fd File descriptor of the job file.
+/// @return 0 if the reader was opened successfully, 1 otherwise.
+int reader_open(JobReader *reader, int fd);
+
+/// Releases the memory of a reader. Keys and values parsed by it become
+/// invalid.
+/// @param reader Reader to close.
+void reader_close(JobReader *reader);
+
+/// Reads a line and returns the corresponding command.
+/// @param reader Reader to read from.
+/// @return The command read.
+enum Command reader_get_next(JobReader *reader);
+
+/// Parses a WRITE command. Keys and values are not copied nor terminated:
+/// they are slices of the reader's data, valid until it is closed.
+/// @param reader Reader to read from.
+/// @param keys Array to store the keys in.
+/// @param values Array to store the values in.
+/// @param max_pairs number of pairs to be written.
+/// @return Number of pairs parsed. 0 on failure.
+size_t reader_parse_write(JobReader *reader, Token keys[], Token values[], size_t max_pairs);
+
+/// Parses a READ or DELETE command, storing the keys like reader_parse_write.
+/// @param reader Reader to read from.
+/// @param keys Array to store the keys in.
+/// @param max_keys number of keys to be read or deleted.
+/// @return Number of keys read or deleted. 0 on failure.
+size_t reader_parse_read_delete(JobReader *reader, Token keys[], size_t max_keys);
+
+/// Parses a WAIT command.
+/// @param reader Reader to read from.
+/// @param delay Pointer to the variable to store the wait delay in.
+/// @param thread_id Pointer to the variable to store the thread ID in. May not be set.
+/// @return 0 if no thread was specified, 1 if a thread was specified, -1 on error.
+int reader_parse_wait(JobReader *reader, unsigned int *delay, unsigned int *thread_id);
+
+// The functions below read straight from a file descriptor, one byte per
+// read(), and never past the end of the command they parse.
+
 /// Reads a line and returns the corresponding command.
 /// @param fd File descriptor to read from.
 /// @return The command read.
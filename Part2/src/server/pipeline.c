@@ -0,0 +1,213 @@
+#include "pipeline.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "constants.h"
+#include "src/common/io.h"
+
+// slots of a queue, a power of two above PIPELINE_BATCHES and PIPELINE_CHUNKS
+#define QUEUE_SLOTS 16
+
+/// Bounded queue between one producer and one consumer thread. Each side
+/// only writes its own index, so items pass without a lock; a side finding
+/// the queue full (or empty) sleeps until the other side moves.
+typedef struct {
+  void *slots[QUEUE_SLOTS];
+  atomic_size_t head; // next slot to pop, written by the consumer
+  atomic_size_t tail; // next slot to push, written by the producer
+  atomic_int sleepers;
+  pthread_mutex_t lock;
+  pthread_cond_t moved;
+} SpscQueue;
+
+// Output of the executor, waiting for the writer. Its data is storage the
+// executor's output buffer filled, traded for the chunk's previous storage,
+// so the bytes are never copied.
+typedef struct {
+  size_t len;
+  char *data;
+} Chunk;
+
+typedef struct {
+  JobReader *reader;
+  int fd; // output file
+  SpscQueue free_batches; // executor to parser
+  SpscQueue ready_batches; // parser to executor
+  SpscQueue free_chunks; // writer to executor
+  SpscQueue ready_chunks; // executor to writer, NULL ends the writer
+  // chunks the executor holds, only touched by it
+  Chunk *spare[PIPELINE_CHUNKS];
+  size_t num_spare;
+  CommandBatch batches[PIPELINE_BATCHES];
+  Chunk chunks[PIPELINE_CHUNKS];
+  char storage[PIPELINE_CHUNKS][OUTBUF_SIZE];
+} Pipeline;
+
+static void queue_init(SpscQueue *queue) {
+  atomic_init(&queue->head, 0);
+  atomic_init(&queue->tail, 0);
+  atomic_init(&queue->sleepers, 0);
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->moved, NULL);
+}
+
+static void queue_destroy(SpscQueue *queue) {
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->moved);
+}
+
+static int queue_blocked(SpscQueue *queue, int pushing) {
+  size_t used = atomic_load(&queue->tail) - atomic_load(&queue->head);
+  return pushing ? used == QUEUE_SLOTS : used == 0;
+}
+
+/// Sleeps until the queue has room (or an item). The sleeper is counted
+/// before the queue is checked again, and the other side checks the count
+/// after moving its index, so one of them always sees the other.
+static void queue_wait(SpscQueue *queue, int pushing) {
+  pthread_mutex_lock(&queue->lock);
+  atomic_fetch_add(&queue->sleepers, 1);
+  while (queue_blocked(queue, pushing)) {
+    pthread_cond_wait(&queue->moved, &queue->lock);
+  }
+  atomic_fetch_sub(&queue->sleepers, 1);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+static void queue_wake(SpscQueue *queue) {
+  if (atomic_load(&queue->sleepers) > 0) {
+    pthread_mutex_lock(&queue->lock);
+    pthread_cond_broadcast(&queue->moved);
+    pthread_mutex_unlock(&queue->lock);
+  }
+}
+
+static void queue_push(SpscQueue *queue, void *item) {
+  if (queue_blocked(queue, 1)) {
+    queue_wait(queue, 1);
+  }
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  queue->slots[tail % QUEUE_SLOTS] = item;
+  atomic_store(&queue->tail, tail + 1);
+  queue_wake(queue);
+}
+
+static void *queue_pop(SpscQueue *queue) {
+  if (queue_blocked(queue, 0)) {
+    queue_wait(queue, 0);
+  }
+  size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  void *item = queue->slots[head % QUEUE_SLOTS];
+  atomic_store(&queue->head, head + 1);
+  queue_wake(queue);
+  return item;
+}
+
+/// Parser stage: fills batches with the commands of the job file.
+static void *parse_stage(void *arg) {
+  Pipeline *pipeline = (Pipeline*) arg;
+  int done = 0;
+  while (!done) {
+    CommandBatch *batch = queue_pop(&pipeline->free_batches);
+    done = fill_batch(pipeline->reader, batch);
+    queue_push(&pipeline->ready_batches, batch);
+  }
+  return NULL;
+}
+
+/// Writer stage: writes the chunks of output in order, and gives them back.
+static void *write_stage(void *arg) {
+  Pipeline *pipeline = (Pipeline*) arg;
+  for (;;) {
+    Chunk *chunk = queue_pop(&pipeline->ready_chunks);
+    if (chunk == NULL) {
+      return NULL;
+    }
+    if (write_all(pipeline->fd, chunk->data, chunk->len) == -1) {
+      perror("Error writing output");
+    }
+    queue_push(&pipeline->free_chunks, chunk);
+  }
+}
+
+/// Sink of the job's output buffer: trades the buffer's storage for the
+/// storage of a free chunk, and hands the chunk to the writer. A sync waits
+/// for every chunk to come back, as they only do once written.
+static char *send_output(char *data, size_t len, int sync, void *arg) {
+  Pipeline *pipeline = (Pipeline*) arg;
+  if (len > 0) {
+    Chunk *chunk = pipeline->num_spare > 0 ? pipeline->spare[--pipeline->num_spare] :
+                   queue_pop(&pipeline->free_chunks);
+    char *free_storage = chunk->data;
+    chunk->data = data;
+    chunk->len = len;
+    queue_push(&pipeline->ready_chunks, chunk);
+    data = free_storage;
+  }
+  while (sync && pipeline->num_spare < PIPELINE_CHUNKS) {
+    pipeline->spare[pipeline->num_spare++] = queue_pop(&pipeline->free_chunks);
+  }
+  return data;
+}
+
+int run_pipelined(JobReader *reader, JobState *job) {
+  Pipeline *pipeline = malloc(sizeof(Pipeline));
+  if (pipeline == NULL) {
+    return 1;
+  }
+  pipeline->reader = reader;
+  pipeline->fd = job->out->fd;
+  queue_init(&pipeline->free_batches);
+  queue_init(&pipeline->ready_batches);
+  queue_init(&pipeline->free_chunks);
+  queue_init(&pipeline->ready_chunks);
+  for (size_t i = 0; i < PIPELINE_BATCHES; i++) {
+    queue_push(&pipeline->free_batches, &pipeline->batches[i]);
+  }
+  for (size_t i = 0; i < PIPELINE_CHUNKS; i++) {
+    pipeline->chunks[i].data = pipeline->storage[i];
+    pipeline->spare[i] = &pipeline->chunks[i];
+  }
+  pipeline->num_spare = PIPELINE_CHUNKS;
+
+  pthread_t parser, writer;
+  int result = 1;
+  if (pthread_create(&writer, NULL, write_stage, pipeline) != 0) {
+    goto cleanup;
+  }
+  if (pthread_create(&parser, NULL, parse_stage, pipeline) != 0) {
+    queue_push(&pipeline->ready_chunks, NULL);
+    pthread_join(writer, NULL);
+    goto cleanup;
+  }
+  result = 0;
+
+  // executor stage, on the calling thread
+  outbuf_set_sink(job->out, send_output, pipeline);
+  int last = 0;
+  while (!last) {
+    CommandBatch *batch = queue_pop(&pipeline->ready_batches);
+    run_batch(batch, job);
+    last = batch->last;
+    queue_push(&pipeline->free_batches, batch);
+  }
+  // every chunk is back once flushed, so the buffer can go back to its own
+  // storage, wherever it is now
+  outbuf_flush(job->out);
+  outbuf_set_sink(job->out, NULL, NULL);
+
+  queue_push(&pipeline->ready_chunks, NULL);
+  pthread_join(parser, NULL);
+  pthread_join(writer, NULL);
+
+cleanup:
+  queue_destroy(&pipeline->free_batches);
+  queue_destroy(&pipeline->ready_batches);
+  queue_destroy(&pipeline->free_chunks);
+  queue_destroy(&pipeline->ready_chunks);
+  free(pipeline);
+  return result;
+}
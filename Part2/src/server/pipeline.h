@@ -0,0 +1,26 @@
+#ifndef KVS_PIPELINE_H
+#define KVS_PIPELINE_H
+
+#include "job.h"
+#include "parser.h"
+
+// job files at least this large run pipelined
+#define PIPELINE_MIN_JOB_SIZE (256 * 1024)
+// batches shared by the parser and the executor
+#define PIPELINE_BATCHES 4
+// output chunks shared by the executor and the writer
+#define PIPELINE_CHUNKS 8
+
+/// @brief Runs a job file in three stages, each on its own thread: a parser
+/// filling batches of commands, the calling thread executing them, and a
+/// writer writing their output. Stages hand batches and output chunks to
+/// the next through bounded single-producer single-consumer queues. The
+/// output is the same as running the batches on a single thread; WAIT and
+/// BACKUP only run once the output before them is written.
+/// @param reader reader over the whole job file
+/// @param job job file being run; its output buffer must be empty
+/// @return 0 on success, 1 if the stages could not be started and nothing
+/// was run
+int run_pipelined(JobReader *reader, JobState *job);
+
+#endif // KVS_PIPELINE_H
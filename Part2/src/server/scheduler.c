@@ -0,0 +1,136 @@
+#include "scheduler.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Files dealt to a worker, as indices into the job array. The owner takes
+// them from the head; other workers steal from the tail, so an owner and a
+// thief only meet on its last file.
+typedef struct {
+  pthread_mutex_t lock;
+  size_t *items;
+  size_t head;
+  size_t tail;
+} JobDeque;
+
+typedef struct {
+  JobFile *jobs;
+  JobDeque *deques;
+  int num_workers;
+  void (*run)(const char*);
+} Pool;
+
+typedef struct {
+  Pool *pool;
+  int id;
+} Worker;
+
+static int compare_sizes(const void *a, const void *b) {
+  off_t sa = ((const JobFile*) a)->size, sb = ((const JobFile*) b)->size;
+  return (sa < sb) - (sa > sb);
+}
+
+/// Takes a file from a deque.
+/// @param deque Deque to take from.
+/// @param steal 1 to take from the tail, 0 from the head.
+/// @param item Index of the file taken.
+/// @return 1 if a file was taken, 0 if the deque is empty.
+static int take_job(JobDeque *deque, int steal, size_t *item) {
+  int taken = 0;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->head < deque->tail) {
+    *item = steal ? deque->items[--deque->tail] : deque->items[deque->head++];
+    taken = 1;
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return taken;
+}
+
+/// Runs files until every deque is empty. No file is added once the workers
+/// start, so a worker that finds nothing to steal is done.
+static void *work(void *arg) {
+  Worker *worker = (Worker*) arg;
+  Pool *pool = worker->pool;
+  for (;;) {
+    size_t item;
+    int found = take_job(&pool->deques[worker->id], 0, &item);
+    for (int i = 1; !found && i < pool->num_workers; i++) {
+      found = take_job(&pool->deques[(worker->id + i) % pool->num_workers], 1, &item);
+    }
+    if (!found) {
+      return NULL;
+    }
+    pool->run(pool->jobs[item].pathname);
+  }
+}
+
+void run_jobs(JobFile *jobs, size_t count, int num_workers, int largest_first, void (*run)(const char*)) {
+  if (count == 0) {
+    return;
+  }
+  if (num_workers < 1) {
+    num_workers = 1;
+  }
+  if ((size_t) num_workers > count) {
+    num_workers = (int) count; // idle workers would only steal
+  }
+  if (largest_first) {
+    qsort(jobs, count, sizeof(JobFile), compare_sizes);
+  }
+
+  size_t workers = (size_t) num_workers;
+  JobDeque *deques = calloc(workers, sizeof(JobDeque));
+  size_t *items = malloc(count * sizeof(size_t));
+  Worker *args = malloc(workers * sizeof(Worker));
+  pthread_t *threads = malloc(workers * sizeof(pthread_t));
+  if (deques == NULL || items == NULL || args == NULL || threads == NULL) {
+    // run everything on the calling thread rather than drop the jobs
+    fprintf(stderr, "Failed to allocate the worker pool\n");
+    for (size_t i = 0; i < count; i++) {
+      run(jobs[i].pathname);
+    }
+    free(deques);
+    free(items);
+    free(args);
+    free(threads);
+    return;
+  }
+
+  // deal the files round-robin: deque w gets files w, w + workers, ...
+  Pool pool = {jobs, deques, num_workers, run};
+  for (size_t w = 0; w < workers; w++) {
+    JobDeque *deque = &deques[w];
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->items = items + w * (count / workers) + (w < count % workers ? w : count % workers);
+    deque->head = deque->tail = 0;
+    for (size_t i = w; i < count; i += workers) {
+      deque->items[deque->tail++] = i;
+    }
+  }
+
+  size_t started = 0;
+  for (size_t w = 0; w < workers; w++) {
+    args[w].pool = &pool;
+    args[w].id = (int) w;
+    if (pthread_create(&threads[w], NULL, work, &args[w]) != 0) {
+      fprintf(stderr, "Failed to create thread\n");
+      break;
+    }
+    started++;
+  }
+  if (started == 0) {
+    work(&args[0]); // the calling thread drains every deque alone
+  }
+  for (size_t w = 0; w < started; w++) {
+    pthread_join(threads[w], NULL);
+  }
+
+  for (size_t w = 0; w < workers; w++) {
+    pthread_mutex_destroy(&deques[w].lock);
+  }
+  free(deques);
+  free(items);
+  free(args);
+  free(threads);
+}
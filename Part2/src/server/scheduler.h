@@ -0,0 +1,27 @@
+#ifndef KVS_SCHEDULER_H
+#define KVS_SCHEDULER_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "constants.h"
+
+// A .job file waiting to be run.
+typedef struct {
+  char pathname[PATH_MAX];
+  off_t size;
+} JobFile;
+
+/// @brief Runs every job file on a fixed pool of workers. Files are dealt to
+/// the workers' deques; a worker takes the next file of its own deque as soon
+/// as it finishes one, and steals from the others once its own is empty
+/// @param jobs files to run, reordered
+/// @param count number of files
+/// @param num_workers number of workers, at least 1
+/// @param largest_first 1 to deal the files by decreasing size, so the
+/// longest jobs start first
+/// @param run function called with the path of each file, from a worker
+void run_jobs(JobFile *jobs, size_t count, int num_workers, int largest_first, void (*run)(const char*));
+
+#endif // KVS_SCHEDULER_H
@@ -0,0 +1,196 @@
+#include "slab.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define SLAB_CLASSES (SLAB_MAX_OBJECT / SLAB_GRANULE)
+
+// Header at the start of every slab, linking all slabs of an allocator.
+typedef struct Slab {
+  struct Slab *next;
+  // keeps the objects after the header 16-byte aligned
+  uint64_t padding;
+} Slab;
+
+typedef struct FreeObject {
+  struct FreeObject *next;
+} FreeObject;
+
+struct SlabAllocator {
+  Slab *slabs;
+  pthread_mutex_t lock; // protects slabs and batches
+  unsigned long id;
+  // lists of SLAB_BATCH free objects given back by threads, by size class
+  FreeObject **batches[SLAB_CLASSES];
+  size_t num_batches[SLAB_CLASSES];
+  size_t batch_capacity[SLAB_CLASSES];
+};
+
+// Objects owned by a thread for one allocator. Objects freed by a thread go to
+// its own lists, whichever thread allocated them, until it holds 2 *
+// SLAB_BATCH of a class and gives a batch back to the allocator, for any
+// thread to take. A thread only caches objects of the last allocator it used;
+// objects it still caches when it moves to another allocator, or exits, stay
+// unused until their slab is released.
+typedef struct {
+  unsigned long owner;
+  FreeObject *free_lists[SLAB_CLASSES];
+  size_t free_counts[SLAB_CLASSES];
+  char *next[SLAB_CLASSES];
+  char *end[SLAB_CLASSES];
+} ThreadCache;
+
+static _Thread_local ThreadCache cache;
+
+// ids start at 1, so a zeroed cache belongs to no allocator
+static unsigned long next_id = 1;
+static pthread_mutex_t next_id_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t size_class(size_t size) {
+  return (size + SLAB_GRANULE - 1) / SLAB_GRANULE - 1;
+}
+
+static ThreadCache *thread_cache(SlabAllocator *allocator) {
+  if (cache.owner != allocator->id) {
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+      cache.free_lists[i] = NULL;
+      cache.free_counts[i] = 0;
+      cache.next[i] = NULL;
+      cache.end[i] = NULL;
+    }
+    cache.owner = allocator->id;
+  }
+  return &cache;
+}
+
+SlabAllocator *slab_create() {
+  SlabAllocator *allocator = malloc(sizeof(SlabAllocator));
+  if (allocator == NULL) {
+    return NULL;
+  }
+  allocator->slabs = NULL;
+  for (size_t i = 0; i < SLAB_CLASSES; i++) {
+    allocator->batches[i] = NULL;
+    allocator->num_batches[i] = 0;
+    allocator->batch_capacity[i] = 0;
+  }
+  pthread_mutex_init(&allocator->lock, NULL);
+  pthread_mutex_lock(&next_id_lock);
+  allocator->id = next_id++;
+  pthread_mutex_unlock(&next_id_lock);
+  return allocator;
+}
+
+// Moves a batch of free objects given back by other threads to the thread's
+// list of a class.
+// @return 1 if there was a batch to take, 0 otherwise.
+static int take_batch(SlabAllocator *allocator, ThreadCache *tc, size_t class) {
+  FreeObject *batch = NULL;
+  pthread_mutex_lock(&allocator->lock);
+  if (allocator->num_batches[class] > 0) {
+    batch = allocator->batches[class][--allocator->num_batches[class]];
+  }
+  pthread_mutex_unlock(&allocator->lock);
+  if (batch == NULL) {
+    return 0;
+  }
+  tc->free_lists[class] = batch;
+  tc->free_counts[class] = SLAB_BATCH;
+  return 1;
+}
+
+// Gives the first SLAB_BATCH objects of the thread's list of a class back to
+// the allocator. They stay with the thread if the allocator has no room.
+static void give_batch(SlabAllocator *allocator, ThreadCache *tc, size_t class) {
+  FreeObject *batch = tc->free_lists[class], *last = batch;
+  for (size_t i = 1; i < SLAB_BATCH; i++) {
+    last = last->next;
+  }
+
+  pthread_mutex_lock(&allocator->lock);
+  if (allocator->num_batches[class] == allocator->batch_capacity[class]) {
+    size_t capacity = allocator->batch_capacity[class] > 0 ? allocator->batch_capacity[class] * 2 : 16;
+    FreeObject **batches = realloc(allocator->batches[class], capacity * sizeof(FreeObject*));
+    if (batches == NULL) {
+      pthread_mutex_unlock(&allocator->lock);
+      return;
+    }
+    allocator->batches[class] = batches;
+    allocator->batch_capacity[class] = capacity;
+  }
+  allocator->batches[class][allocator->num_batches[class]++] = batch;
+  tc->free_lists[class] = last->next;
+  tc->free_counts[class] -= SLAB_BATCH;
+  last->next = NULL;
+  pthread_mutex_unlock(&allocator->lock);
+}
+
+void *slab_alloc(SlabAllocator *allocator, size_t size) {
+  if (size == 0 || size > SLAB_MAX_OBJECT) {
+    return NULL;
+  }
+  ThreadCache *tc = thread_cache(allocator);
+  size_t class = size_class(size);
+  size_t object_size = (class + 1) * SLAB_GRANULE;
+
+  // reuse a freed object first
+  FreeObject *object = tc->free_lists[class];
+  if (object != NULL) {
+    tc->free_lists[class] = object->next;
+    tc->free_counts[class]--;
+    return object;
+  }
+
+  // otherwise carve one from the thread's current slab of this class, and
+  // once it is used up take objects other threads freed before a new slab
+  if (tc->next[class] == NULL || tc->next[class] + object_size > tc->end[class]) {
+    if (take_batch(allocator, tc, class)) {
+      object = tc->free_lists[class];
+      tc->free_lists[class] = object->next;
+      tc->free_counts[class]--;
+      return object;
+    }
+    Slab *slab = malloc(SLAB_SIZE);
+    if (slab == NULL) {
+      return NULL;
+    }
+    pthread_mutex_lock(&allocator->lock);
+    slab->next = allocator->slabs;
+    allocator->slabs = slab;
+    pthread_mutex_unlock(&allocator->lock);
+    tc->next[class] = (char*) slab + sizeof(Slab);
+    tc->end[class] = (char*) slab + SLAB_SIZE;
+  }
+  void *ptr = tc->next[class];
+  tc->next[class] += object_size;
+  return ptr;
+}
+
+void slab_free(SlabAllocator *allocator, void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return;
+  }
+  ThreadCache *tc = thread_cache(allocator);
+  size_t class = size_class(size);
+  FreeObject *object = ptr;
+  object->next = tc->free_lists[class];
+  tc->free_lists[class] = object;
+  if (++tc->free_counts[class] >= 2 * SLAB_BATCH) {
+    give_batch(allocator, tc, class);
+  }
+}
+
+void slab_destroy(SlabAllocator *allocator) {
+  Slab *slab = allocator->slabs;
+  while (slab != NULL) {
+    Slab *next = slab->next;
+    free(slab);
+    slab = next;
+  }
+  for (size_t i = 0; i < SLAB_CLASSES; i++) {
+    free(allocator->batches[i]);
+  }
+  pthread_mutex_destroy(&allocator->lock);
+  free(allocator);
+}
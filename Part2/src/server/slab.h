@@ -0,0 +1,44 @@
+#ifndef KVS_SLAB_H
+#define KVS_SLAB_H
+
+#include <stddef.h>
+
+// bytes requested from malloc for each slab
+#define SLAB_SIZE (64 * 1024)
+// objects are grouped in size classes of SLAB_GRANULE bytes
+#define SLAB_GRANULE 8
+// largest object a slab allocator hands out
+#define SLAB_MAX_OBJECT 64
+// free objects of a size class passed between a thread and its allocator at
+// once; a thread holding twice as many gives a batch back
+#define SLAB_BATCH 64
+
+typedef struct SlabAllocator SlabAllocator;
+
+/// @brief Creates an allocator for small fixed size objects. Each thread
+/// carves objects from its own slabs and keeps its own free lists, so only
+/// getting a new slab, or a batch of objects other threads freed, takes a
+/// lock.
+/// @return Newly created allocator, NULL on failure
+SlabAllocator *slab_create();
+
+/// @brief Allocates an object
+/// @param allocator allocator to use
+/// @param size size of the object, at most SLAB_MAX_OBJECT
+/// @return pointer to the object, NULL on failure
+void *slab_alloc(SlabAllocator *allocator, size_t size);
+
+/// @brief Returns an object to the free list of its size class. Threads that
+/// free more objects than they allocate, such as the ones reclaiming nodes
+/// other threads retired, hand them back to the allocator in batches.
+/// @param allocator allocator the object came from
+/// @param ptr object to free, may be NULL
+/// @param size size the object was allocated with
+void slab_free(SlabAllocator *allocator, void *ptr, size_t size);
+
+/// @brief Releases every slab at once, together with all objects still
+/// allocated from them
+/// @param allocator allocator to destroy
+void slab_destroy(SlabAllocator *allocator);
+
+#endif // KVS_SLAB_H
@@ -0,0 +1,192 @@
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Counters of one operation. Only their thread writes them, with plain
+// relaxed stores, so readers adding them up never see a torn value.
+typedef struct {
+  atomic_uint_fast64_t count;
+  atomic_uint_fast64_t total_ns;
+  atomic_uint_fast64_t max_ns;
+  atomic_uint_fast64_t buckets[STATS_BUCKETS];
+} OpStats;
+
+// Counters of a thread. They are listed for as long as the server runs: a
+// thread that exits releases them, and the next thread that records takes
+// them over, counts included, so totals never go back.
+typedef struct ThreadStats {
+  OpStats ops[STAT_OPS];
+  atomic_int in_use;
+  struct ThreadStats *next;
+} ThreadStats;
+
+// Totals of an operation over every thread.
+typedef struct {
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[STATS_BUCKETS];
+} OpTotals;
+
+static const char *const op_names[STAT_OPS] = {
+  "write", "read", "delete", "apply", "show", "backup",
+  "write_lock", "read_lock", "delete_lock", "apply_lock", "show_lock", "backup_lock",
+  "parse", "notify"
+};
+
+// every ThreadStats ever allocated; entries are only added, at the head
+static _Atomic(ThreadStats*) all_stats = NULL;
+static _Thread_local ThreadStats *local_stats = NULL;
+// releases the counters of a thread when it exits
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+static void release_stats(void *arg) {
+  atomic_store_explicit(&((ThreadStats*) arg)->in_use, 0, memory_order_release);
+}
+
+static void create_key(void) {
+  if (pthread_key_create(&stats_key, release_stats) != 0) {
+    fprintf(stderr, "Failed to create the statistics key\n");
+  }
+}
+
+/// Claims counters released by an exited thread, or lists new ones.
+/// @return Counters of the calling thread, NULL if none could be allocated.
+static ThreadStats *claim_stats(void) {
+  pthread_once(&stats_once, create_key);
+  ThreadStats *stats = atomic_load(&all_stats);
+  for (; stats != NULL; stats = stats->next) {
+    int released = 0;
+    if (atomic_load_explicit(&stats->in_use, memory_order_relaxed) == 0 &&
+        atomic_compare_exchange_strong(&stats->in_use, &released, 1)) {
+      break;
+    }
+  }
+  if (stats == NULL) {
+    stats = calloc(1, sizeof(ThreadStats));
+    if (stats == NULL) {
+      return NULL;
+    }
+    atomic_init(&stats->in_use, 1);
+    stats->next = atomic_load(&all_stats);
+    while (!atomic_compare_exchange_weak(&all_stats, &stats->next, stats))
+      ;
+  }
+  pthread_setspecific(stats_key, stats);
+  return stats;
+}
+
+/// Bucket of a latency: values below 2^STATS_SUB_BITS have one each, and
+/// every power of two above is split in 2^STATS_SUB_BITS buckets.
+static size_t bucket_of(uint64_t ns) {
+  if (ns < (UINT64_C(1) << STATS_SUB_BITS)) {
+    return (size_t) ns;
+  }
+  if (ns >= (UINT64_C(1) << STATS_MAX_BITS)) {
+    return STATS_BUCKETS - 1;
+  }
+  int shift = 63 - __builtin_clzll(ns) - STATS_SUB_BITS;
+  return ((size_t) (shift + 1) << STATS_SUB_BITS) + (size_t) (ns >> shift) - (1u << STATS_SUB_BITS);
+}
+
+/// Highest latency counted in a bucket.
+static uint64_t bucket_top(size_t bucket) {
+  if (bucket < (1u << STATS_SUB_BITS)) {
+    return bucket;
+  }
+  unsigned shift = (unsigned) (bucket >> STATS_SUB_BITS) - 1;
+  uint64_t low = (uint64_t) ((bucket & ((1u << STATS_SUB_BITS) - 1)) + (1u << STATS_SUB_BITS)) << shift;
+  return low + (UINT64_C(1) << shift) - 1;
+}
+
+static void add(atomic_uint_fast64_t *counter, uint64_t n) {
+  uint64_t value = atomic_load_explicit(counter, memory_order_relaxed);
+  atomic_store_explicit(counter, value + n, memory_order_relaxed);
+}
+
+uint64_t stats_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+void stats_record(StatOp op, uint64_t start) {
+  uint64_t ns = stats_now() - start;
+  ThreadStats *stats = local_stats;
+  if (stats == NULL && (stats = local_stats = claim_stats()) == NULL) {
+    return;
+  }
+  OpStats *counters = &stats->ops[op];
+  add(&counters->count, 1);
+  add(&counters->total_ns, ns);
+  add(&counters->buckets[bucket_of(ns)], 1);
+  if (ns > atomic_load_explicit(&counters->max_ns, memory_order_relaxed)) {
+    atomic_store_explicit(&counters->max_ns, ns, memory_order_relaxed);
+  }
+}
+
+/// Adds up the counters of an operation over every thread.
+static void sum_op(StatOp op, OpTotals *totals) {
+  memset(totals, 0, sizeof(OpTotals));
+  for (ThreadStats *stats = atomic_load(&all_stats); stats != NULL; stats = stats->next) {
+    OpStats *counters = &stats->ops[op];
+    totals->count += atomic_load_explicit(&counters->count, memory_order_relaxed);
+    totals->total_ns += atomic_load_explicit(&counters->total_ns, memory_order_relaxed);
+    uint64_t max_ns = atomic_load_explicit(&counters->max_ns, memory_order_relaxed);
+    if (max_ns > totals->max_ns) {
+      totals->max_ns = max_ns;
+    }
+    for (size_t i = 0; i < STATS_BUCKETS; i++) {
+      totals->buckets[i] += atomic_load_explicit(&counters->buckets[i], memory_order_relaxed);
+    }
+  }
+}
+
+/// Latency under which a share of the operations took.
+/// @param totals Totals of the operation.
+/// @param per_mille Share of the operations, in thousandths.
+/// @return Top of the bucket holding that share, at most the highest latency.
+static uint64_t percentile(const OpTotals *totals, uint64_t per_mille) {
+  // counters are read while threads record, so the buckets may hold a few
+  // more than count
+  uint64_t rank = (totals->count * per_mille + 999) / 1000;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < STATS_BUCKETS; i++) {
+    seen += totals->buckets[i];
+    if (seen >= rank && seen > 0) {
+      uint64_t top = bucket_top(i);
+      return top < totals->max_ns ? top : totals->max_ns;
+    }
+  }
+  return totals->max_ns;
+}
+
+size_t stats_format(char *dest) {
+  OpTotals *totals = malloc(sizeof(OpTotals));
+  size_t len = 0;
+  dest[0] = '\0';
+  if (totals == NULL) {
+    return 0;
+  }
+  for (int op = 0; op < STAT_OPS; op++) {
+    sum_op((StatOp) op, totals);
+    int written = snprintf(dest + len, STATS_LINE_SIZE,
+        "%s count=%llu mean=%llu p50=%llu p90=%llu p99=%llu p999=%llu max=%llu\n",
+        op_names[op], (unsigned long long) totals->count,
+        (unsigned long long) (totals->count > 0 ? totals->total_ns / totals->count : 0),
+        (unsigned long long) percentile(totals, 500), (unsigned long long) percentile(totals, 900),
+        (unsigned long long) percentile(totals, 990), (unsigned long long) percentile(totals, 999),
+        (unsigned long long) totals->max_ns);
+    if (written > 0) {
+      len += (size_t) written < STATS_LINE_SIZE ? (size_t) written : STATS_LINE_SIZE - 1;
+    }
+  }
+  free(totals);
+  return len;
+}
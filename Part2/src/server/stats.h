@@ -0,0 +1,58 @@
+#ifndef KVS_STATS_H
+#define KVS_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Operations timed by the server. The *_LOCK ones time how long each
+// operation waited for its locks.
+typedef enum {
+  STAT_WRITE,
+  STAT_READ,
+  STAT_DELETE,
+  STAT_APPLY,
+  STAT_SHOW,
+  STAT_BACKUP,
+  STAT_WRITE_LOCK,
+  STAT_READ_LOCK,
+  STAT_DELETE_LOCK,
+  STAT_APPLY_LOCK,
+  STAT_SHOW_LOCK,
+  STAT_BACKUP_LOCK,
+  STAT_PARSE,
+  STAT_NOTIFY,
+  STAT_OPS // number of timed operations
+} StatOp;
+
+// Latencies are kept in log-linear buckets: every power of two is split in
+// 2^STATS_SUB_BITS buckets, so a bucket is at most 1/16 wider than its values
+#define STATS_SUB_BITS 4
+// latencies from 2^STATS_MAX_BITS ns (about a minute) up share the last bucket
+#define STATS_MAX_BITS 36
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+// longest line written for an operation by stats_format
+#define STATS_LINE_SIZE 224
+// room stats_format needs for the whole report
+#define STATS_OUTPUT_SIZE (STAT_OPS * STATS_LINE_SIZE)
+
+/// @brief Reads the clock latencies are measured with
+/// @return monotonic time in nanoseconds
+uint64_t stats_now(void);
+
+/// @brief Counts an operation of the calling thread, and the time it took.
+/// Each thread records into its own histograms, without locks or atomic
+/// read-modify-writes; a thread that exits leaves them to the next one
+/// @param op operation that ended
+/// @param start time the operation started, from stats_now
+void stats_record(StatOp op, uint64_t start);
+
+/// @brief Writes the counts and latency percentiles of every operation,
+/// added up over all threads, one line per operation:
+/// "<op> count=<n> mean=<ns> p50=<ns> p90=<ns> p99=<ns> p999=<ns> max=<ns>",
+/// latencies in nanoseconds
+/// @param dest where to write, with room for STATS_OUTPUT_SIZE bytes
+/// @return number of bytes written, not counting the final '\0'
+size_t stats_format(char *dest);
+
+#endif // KVS_STATS_H
@@ -0,0 +1,74 @@
+#!/bin/bash
+
+# Shared by the run_*.sh tests, which source it after setting kvs_binary.
+# Gives each test a temporary directory, runs the server until its jobs are
+# done, and reports results. A test ends with finish.
+
+temp_dir=$(mktemp -d)
+server_log="$temp_dir/server.txt"
+failed=0
+
+pass() {
+    echo -e "\e[32mTest passed for $1\e[0m"
+}
+
+fail() {
+    echo -e "\e[31mTest failed for $1\e[0m"
+    failed=1
+}
+
+# Runs the server with the given arguments, its output in $server_log, until
+# the shell condition in $1 holds. The server keeps serving clients after its
+# jobs, so it is killed then, or after 5 seconds.
+# Returns the exit status of a server that stopped by itself, 0 otherwise.
+run_server() {
+    local done=$1
+    shift
+    "./$kvs_binary" "$@" &> "$server_log" &
+    local pid=$!
+    for _ in $(seq 50); do
+        sleep 0.1
+        if ! kill -0 "$pid" 2> /dev/null; then
+            wait "$pid"
+            return
+        fi
+        if eval "$done"; then
+            break
+        fi
+    done
+    # let the server write the rest of its output
+    sleep 0.3
+    kill -9 "$pid" 2> /dev/null
+    wait "$pid" 2> /dev/null
+    return 0
+}
+
+# Compares a file with the expected one.
+check_file() {
+    local name=$1
+    local actual=$2
+    local expected=$3
+    if diff "$actual" "$expected"; then
+        pass "$name"
+    else
+        fail "$name"
+    fi
+}
+
+# Checks that the server, or a tool whose output is in a file, reported an
+# error.
+check_error() {
+    local name=$1
+    local output=$2
+    local error=$3
+    if grep -qxF "$error" "$output"; then
+        pass "$name"
+    else
+        fail "$name: expected \"$error\", got \"$(cat "$output")\""
+    fi
+}
+
+finish() {
+    rm -rf "$temp_dir"
+    exit $failed
+}
@@ -0,0 +1,31 @@
+#!/bin/bash
+
+# Checks that batching runs of WRITE and DELETE commands (-b) does not change
+# the output: a key repeated in one WRITE keeps its last value, and a DELETE
+# sees the keys written before it in the same run. The job is run without
+# and with -b, and both outputs must match the expected one.
+# Run from Part2: bash src/server/tests/run_batch.sh src/server/kvs
+
+if [ -z "$1" ]; then
+    echo "Usage: $0 <executable>"
+    exit 1
+fi
+kvs_binary=$1
+
+test_dir="src/server/tests/batch"
+source "$(dirname "$0")/harness.sh"
+
+# Runs batch.job with the given options and compares its output.
+run_job() {
+    local name=$1
+    shift
+    mkdir "$temp_dir/$name"
+    cp "$test_dir/batch.job" "$temp_dir/$name"
+    run_server '[ -f "$temp_dir/$name/batch.out" ]' "$@" "$temp_dir/$name" 1 1 "$temp_dir/register-$name"
+    check_file "$name" "$temp_dir/$name/batch.out" "$test_dir/batch.out"
+}
+
+run_job "serial"
+run_job "batched" -b
+
+finish
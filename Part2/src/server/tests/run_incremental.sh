@@ -0,0 +1,57 @@
+#!/bin/bash
+
+# Checks the incremental backups: a job backs up three times with -i, and
+# merging the backups gives the state of the KVS at each of them. The merge
+# tool must refuse deltas that do not follow its full backup, and corrupted
+# backups.
+# Run from Part2: bash src/server/tests/run_incremental.sh src/server/kvs src/merge/merge
+
+if [ -z "$1" ] || [ -z "$2" ]; then
+    echo "Usage: $0 <executable> <merge_executable>"
+    exit 1
+fi
+kvs_binary=$1
+merge_binary=$2
+
+test_dir="src/server/tests/incremental"
+source "$(dirname "$0")/harness.sh"
+
+# Checks a merge of backups against the expected SHOW output.
+merge() {
+    local expected=$1
+    shift
+    if ! (cd "$temp_dir" && "$OLDPWD/$merge_binary" merged "$@"); then
+        fail "merge of $*: the merge failed"
+    else
+        check_file "merge of $*" "$temp_dir/merged" "$expected"
+    fi
+}
+
+# Checks that the merge tool refuses a set of backups, reporting the given
+# error.
+refuse() {
+    local name=$1
+    local error=$2
+    shift 2
+    if (cd "$temp_dir" && "$OLDPWD/$merge_binary" refused "$@" 2> "$temp_dir/merge.txt"); then
+        fail "$name: the merge succeeded"
+    else
+        check_error "$name" "$temp_dir/merge.txt" "$error"
+    fi
+}
+
+# x.job backs up three times
+cp "$test_dir/x.job" "$temp_dir"
+run_server '[ -f "$temp_dir/x.out" ] && [ -f "$temp_dir/x-3.bck" ]' -i "$temp_dir" 1 1 "$temp_dir/register"
+check_file "x.job" "$temp_dir/x.out" "$test_dir/x.out"
+
+merge "$test_dir/x-2.merge" x-1.bck x-2.bck
+merge "$test_dir/x-3.merge" x-1.bck x-2.bck x-3.bck
+
+refuse "delta as base" "Backup x-2.bck is not a full backup" x-2.bck x-3.bck
+refuse "skipped delta" "Backup x-3.bck is not a delta of x-1.bck" x-1.bck x-3.bck
+cp "$temp_dir/x-2.bck" "$temp_dir/bad-2.bck"
+printf 'X' | dd of="$temp_dir/bad-2.bck" bs=1 seek=40 conv=notrunc status=none
+refuse "corrupted delta" "Backup bad-2.bck is corrupted" x-1.bck bad-2.bck x-3.bck
+
+finish
@@ -0,0 +1,22 @@
+#!/bin/bash
+
+# Checks that SHOW and backups list pairs sorted by key, whatever bucket or
+# stripe holds them: keys sharing a first character are written out of
+# order, and keys starting with a digit or an uppercase letter are mixed in.
+# Run from Part2: bash src/server/tests/run_order.sh src/server/kvs
+
+if [ -z "$1" ]; then
+    echo "Usage: $0 <executable>"
+    exit 1
+fi
+kvs_binary=$1
+
+test_dir="src/server/tests/order"
+source "$(dirname "$0")/harness.sh"
+
+cp "$test_dir/order.job" "$temp_dir"
+run_server '[ -f "$temp_dir/order.out" ] && [ -f "$temp_dir/order-1.bck" ]' "$temp_dir" 1 1 "$temp_dir/register"
+check_file "SHOW" "$temp_dir/order.out" "$test_dir/order.out"
+check_file "backup" "$temp_dir/order-1.bck" "$test_dir/order-1.bck"
+
+finish
@@ -0,0 +1,81 @@
+#!/bin/bash
+
+# Checks that the server recovers its state from the write-ahead log: a job
+# writes, the server is killed, and a restarted server SHOWs the pairs.
+# Run from Part2: bash src/server/tests/run_wal.sh src/server/kvs
+
+if [ -z "$1" ]; then
+    echo "Usage: $0 <executable>"
+    exit 1
+fi
+kvs_binary=$1
+
+test_dir="src/server/tests/wal"
+source "$(dirname "$0")/harness.sh"
+
+# Runs the jobs of a directory with the log in $temp_dir/log, until each one
+# has written its output.
+run_jobs() {
+    local jobs=$1
+    run_server '[ "$(find "$jobs" -name "*.out" | wc -l)" = "$(find "$jobs" -name "*.job" | wc -l)" ]' \
+        -l "$temp_dir/log" "$jobs" 1 1 "$temp_dir/register"
+}
+
+# Writes the pairs, then restarts the server on the log and compares SHOW.
+recover() {
+    local name=$1
+    local expected=$2
+    rm -rf "$temp_dir/show"
+    mkdir "$temp_dir/show"
+    cp "$test_dir/show.job" "$temp_dir/show"
+    if ! run_jobs "$temp_dir/show"; then
+        fail "$name: the server did not start"
+    else
+        check_file "$name" "$temp_dir/show/show.out" "$expected"
+    fi
+}
+
+# Checks that the server refuses to start on a damaged log, reporting the
+# given error, and keeps the log.
+refuse() {
+    local name=$1
+    local error=$2
+    mkdir -p "$temp_dir/none"
+    local segments
+    segments=$(ls "$temp_dir/log")
+    if run_jobs "$temp_dir/none"; then
+        fail "$name: the server started"
+    elif [ "$(ls "$temp_dir/log")" != "$segments" ]; then
+        fail "$name: the log was changed"
+    else
+        check_error "$name" "$server_log" "$error"
+    fi
+}
+
+mkdir "$temp_dir/write"
+cp "$test_dir/write.job" "$temp_dir/write"
+run_jobs "$temp_dir/write"
+recover "recovery" "$test_dir/show.out"
+
+# the restart opened a second segment; the first one is final no more, so
+# a damaged record in it is corruption, and without it the six changes of
+# write.job are missing
+first=$(ls "$temp_dir/log"/wal-*.log | head -1)
+second=$(ls "$temp_dir/log"/wal-*.log | tail -1)
+cp "$first" "$temp_dir/first.log"
+printf 'X' | dd of="$first" bs=1 seek=20 conv=notrunc status=none
+refuse "damaged segment" "Log segment $first has a damaged record"
+rm "$first"
+refuse "missing segment" "Changes 1 to 6 are missing before log segment $second"
+cp "$temp_dir/first.log" "$first"
+
+# a record cut by a crash at the end of the log is dropped
+rm -rf "$temp_dir/log"
+mkdir "$temp_dir/write2"
+cp "$test_dir/write.job" "$temp_dir/write2"
+run_jobs "$temp_dir/write2"
+last=$(ls "$temp_dir/log"/wal-*.log | tail -1)
+truncate -s -1 "$last"
+recover "truncated record" "$test_dir/show_truncated.out"
+
+finish
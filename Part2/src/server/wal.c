@@ -0,0 +1,542 @@
+#include "wal.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "src/common/backup.h"
+#include "src/common/io.h"
+
+// records of the log are encoded in the compact format, which needs no '\0'
+#define WAL_RECORD_FORMAT BACKUP_FORMAT_V1
+// longest record
+#define WAL_RECORD_MAX (WAL_FRAME_HEADER_SIZE + BACKUP_RECORD_SIZE(MAX_STRING_SIZE, MAX_STRING_SIZE))
+
+static char wal_dir[PATH_MAX];
+static int wal_sync_ms = WAL_SYNC_ALWAYS;
+
+// Segment being written. Only the thread writing records touches it.
+static int segment_fd = -1;
+static size_t segment_bytes = 0;
+
+// The fields below are guarded by wal_lock. Records are appended to pending;
+// a writer swaps it with spare and writes it without holding the lock, so
+// appends go on while it waits for the disk.
+static pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_written = PTHREAD_COND_INITIALIZER; // a write ended
+static pthread_cond_t wal_wakeup = PTHREAD_COND_INITIALIZER; // the log closes
+static unsigned char *pending = NULL, *spare = NULL;
+static size_t pending_len = 0;
+static uint64_t appended_lsn = 0;
+static uint64_t written_lsn = 0;
+static uint64_t synced_lsn = 0;
+static int writing = 0;
+static int closing = 0;
+// A write, sync or new segment failed. The log is not written anymore: the
+// records after the failure could not follow the ones before without a gap,
+// and nothing after the last successful sync is acknowledged.
+static int failed = 0;
+
+static pthread_t flusher;
+static int has_flusher = 0;
+static atomic_int checkpoint_due = 0;
+
+static void segment_path(uint64_t first_lsn, char *dest, size_t size) {
+  snprintf(dest, size, "%s/wal-%020" PRIu64 ".log", wal_dir, first_lsn);
+}
+
+void wal_checkpoint_path(uint64_t lsn, int temporary, char *dest, size_t size) {
+  snprintf(dest, size, "%s/checkpoint-%020" PRIu64 ".%s", wal_dir, lsn, temporary ? "tmp" : "bck");
+}
+
+/// Makes the creation, removal and renaming of files in the log directory
+/// durable.
+static void sync_dir() {
+  int fd = open(wal_dir, O_RDONLY);
+  if (fd != -1) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+static int compare_lsns(const void *a, const void *b) {
+  uint64_t la = *(const uint64_t*) a, lb = *(const uint64_t*) b;
+  return (la > lb) - (la < lb);
+}
+
+/// Lists the LSNs in the names of the files of the log directory of a kind.
+/// @param prefix Start of the names, up to the LSN.
+/// @param suffix End of the names, after the LSN.
+/// @param lsns Array allocated with the LSNs, by increasing order.
+/// @param count Number of LSNs found.
+/// @return 0 on success, 1 on failure.
+static int list_files(const char *prefix, const char *suffix, uint64_t **lsns, size_t *count) {
+  DIR *dir = opendir(wal_dir);
+  if (dir == NULL) {
+    return 1;
+  }
+  size_t capacity = 0;
+  *lsns = NULL;
+  *count = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    const char *name = entry->d_name;
+    size_t prefix_len = strlen(prefix);
+    if (strncmp(name, prefix, prefix_len) != 0) {
+      continue;
+    }
+    char *end;
+    uint64_t lsn = strtoull(name + prefix_len, &end, 10);
+    if (end == name + prefix_len || strcmp(end, suffix) != 0) {
+      continue;
+    }
+    if (*count == capacity) {
+      capacity = capacity > 0 ? capacity * 2 : 16;
+      uint64_t *grown = realloc(*lsns, capacity * sizeof(uint64_t));
+      if (grown == NULL) {
+        free(*lsns);
+        closedir(dir);
+        return 1;
+      }
+      *lsns = grown;
+    }
+    (*lsns)[(*count)++] = lsn;
+  }
+  closedir(dir);
+  if (*count > 0) {
+    qsort(*lsns, *count, sizeof(uint64_t), compare_lsns);
+  }
+  return 0;
+}
+
+/// Reads a whole file into memory.
+/// @param path Path of the file.
+/// @param data Buffer allocated with its bytes.
+/// @param len Number of bytes.
+/// @return 0 on success, 1 on failure.
+static int read_file(const char *path, unsigned char **data, size_t *len) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return 1;
+  }
+  struct stat st;
+  *data = NULL;
+  if (fstat(fd, &st) == 0) {
+    *len = (size_t) st.st_size;
+    *data = malloc(*len > 0 ? *len : 1);
+  }
+  if (*data == NULL || (*len > 0 && read_all(fd, *data, *len, NULL) != 1)) {
+    free(*data);
+    close(fd);
+    return 1;
+  }
+  close(fd);
+  return 0;
+}
+
+/// Loads every pair of a checkpoint, after checking all of it. The file is
+/// mapped; in the current format its pairs are handed over in place along
+/// with the mapping, older formats are decoded into copies.
+/// @return 0 on success, 1 if the checkpoint cannot be used.
+static int load_checkpoint(uint64_t lsn, const WalRecovery *recovery) {
+  char path[PATH_MAX];
+  wal_checkpoint_path(lsn, 0, path, sizeof(path));
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < BACKUP_HEADER_SIZE + BACKUP_TRAILER_SIZE) {
+    close(fd);
+    return 1;
+  }
+  size_t len = (size_t) st.st_size;
+  unsigned char *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return 1;
+  }
+  posix_madvise(data, len, POSIX_MADV_SEQUENTIAL);
+  BackupHeader header;
+  if (backup_check_trailer(data, len) != 0 || backup_decode_header(data, &header) != 0 ||
+      header.kind != BACKUP_FULL) {
+    munmap(data, len);
+    return 1;
+  }
+
+  int in_place = header.format == BACKUP_FORMAT;
+  recovery->begin_checkpoint(header.count, data, len, recovery->arg);
+  size_t pos = BACKUP_HEADER_SIZE, end = len - BACKUP_TRAILER_SIZE;
+  for (uint32_t i = 0; i < header.count; i++) {
+    uint8_t op;
+    size_t used;
+    if (in_place) {
+      const char *key, *value;
+      used = backup_view_record(data + pos, end - pos, &op, &key, &value, MAX_STRING_SIZE);
+      if (used != 0) {
+        recovery->load_pair(key, value, recovery->arg);
+      }
+    } else {
+      char key[MAX_STRING_SIZE], value[MAX_STRING_SIZE];
+      used = backup_decode_record(header.format, data + pos, end - pos, &op, key, value, MAX_STRING_SIZE);
+      if (used != 0) {
+        recovery->apply(op, key, value, recovery->arg);
+      }
+    }
+    if (used == 0) {
+      break;
+    }
+    pos += used;
+  }
+  if (in_place) {
+    recovery->end_checkpoint(data, len, recovery->arg);
+  } else {
+    munmap(data, len);
+  }
+  return 0;
+}
+
+/// Applies the records of a segment newer than the last one applied, which
+/// must follow it without a gap. Segments are synced before the next one is
+/// opened, so only the final segment may end with a record cut by a crash:
+/// its tail is truncated before it. A damaged record anywhere else is
+/// corruption, and the segment is left as it is.
+/// @param first_lsn LSN the segment is named after.
+/// @param final 1 for the newest segment.
+/// @param last LSN of the last change applied, updated.
+/// @return 0 if the segment was applied, 1 if it is damaged, not readable or
+/// changes are missing before it.
+static int replay_segment(uint64_t first_lsn, int final, uint64_t *last, const WalRecovery *recovery) {
+  char path[PATH_MAX];
+  segment_path(first_lsn, path, sizeof(path));
+  if (first_lsn > *last + 1) {
+    fprintf(stderr, "Changes %llu to %llu are missing before log segment %s\n",
+            (unsigned long long) (*last + 1), (unsigned long long) (first_lsn - 1), path);
+    return 1;
+  }
+  unsigned char *data;
+  size_t len;
+  if (read_file(path, &data, &len) != 0) {
+    fprintf(stderr, "Failed to read log segment %s\n", path);
+    return 1;
+  }
+  size_t pos = 0;
+  while (pos < len) {
+    if (len - pos < WAL_FRAME_HEADER_SIZE) {
+      break;
+    }
+    size_t record_len = decode_le(data + pos, 2);
+    if (record_len < 8 || len - pos - 6 < record_len ||
+        crc32_update(0, data + pos + 6, record_len) != (uint32_t) decode_le(data + pos + 2, 4)) {
+      break;
+    }
+    uint64_t lsn = decode_le(data + pos + 6, 8);
+    uint8_t op;
+    char key[MAX_STRING_SIZE], value[MAX_STRING_SIZE];
+    size_t body_len = record_len - 8;
+    if (backup_decode_record(WAL_RECORD_FORMAT, data + pos + WAL_FRAME_HEADER_SIZE, body_len, &op, key, value, MAX_STRING_SIZE) != body_len) {
+      break;
+    }
+    if (lsn > *last + 1) {
+      fprintf(stderr, "Log segment %s skips changes %llu to %llu\n", path,
+              (unsigned long long) (*last + 1), (unsigned long long) (lsn - 1));
+      free(data);
+      return 1;
+    }
+    if (lsn == *last + 1) {
+      recovery->apply(op, key, value, recovery->arg);
+      *last = lsn;
+    }
+    pos += 6 + record_len;
+  }
+  free(data);
+  if (pos < len) {
+    if (!final) {
+      fprintf(stderr, "Log segment %s has a damaged record\n", path);
+      return 1;
+    }
+    fprintf(stderr, "Log segment %s ends with a damaged record, truncating it\n", path);
+    if (truncate(path, (off_t) pos) != 0) {
+      perror("Failed to truncate log segment");
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int open_segment(uint64_t first_lsn) {
+  char path[PATH_MAX];
+  segment_path(first_lsn, path, sizeof(path));
+  segment_fd = open(path, O_CREAT | O_WRONLY | O_TRUNC | O_APPEND, 0644);
+  segment_bytes = 0;
+  if (segment_fd == -1) {
+    perror("Failed to open log segment");
+    return 1;
+  }
+  sync_dir();
+  return 0;
+}
+
+/// Writes the pending records, and syncs them if asked. Must be called
+/// holding wal_lock while no other thread is writing; the lock is released
+/// during the write. Closes full segments, requesting a checkpoint. On a
+/// failure the log fails: the written and synced LSNs stay where they were,
+/// and the records pending then or later are dropped.
+/// @param sync 1 to sync the records written.
+static void write_records(int sync) {
+  writing = 1;
+  unsigned char *data = pending;
+  size_t len = pending_len;
+  uint64_t last = appended_lsn;
+  pending = spare;
+  spare = data;
+  pending_len = 0;
+  pthread_mutex_unlock(&wal_lock);
+
+  int error = failed;
+  if (!error && len > 0) {
+    if (write_all(segment_fd, data, len) == -1) {
+      perror("Failed to write log");
+      error = 1;
+    }
+    segment_bytes += len;
+  }
+  int rotate = !error && segment_bytes >= WAL_SEGMENT_SIZE;
+  if (!error && (sync || rotate) && last > synced_lsn && fdatasync(segment_fd) != 0) {
+    perror("Failed to sync log");
+    error = 1;
+    rotate = 0;
+  }
+  if (rotate) {
+    close(segment_fd);
+    error = open_segment(last + 1) != 0;
+  }
+
+  pthread_mutex_lock(&wal_lock);
+  if (error) {
+    if (!failed) {
+      fprintf(stderr, "The log failed: changes after %llu are not logged\n",
+              (unsigned long long) synced_lsn);
+    }
+    failed = 1;
+  } else {
+    written_lsn = last;
+    if (sync || rotate) {
+      synced_lsn = last;
+    }
+  }
+  writing = 0;
+  pthread_cond_broadcast(&wal_written);
+  if (rotate) {
+    atomic_store(&checkpoint_due, 1);
+  }
+}
+
+/// Writes the log in the background: every WAL_FLUSH_INTERVAL_MS when it is
+/// not synced, or every interval of the fsync policy, syncing it.
+static void *flush_log(void *arg) {
+  (void) arg;
+  long interval_ms = wal_sync_ms > 0 ? wal_sync_ms : WAL_FLUSH_INTERVAL_MS;
+  pthread_mutex_lock(&wal_lock);
+  while (!closing) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += interval_ms / 1000;
+    deadline.tv_nsec += (interval_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&wal_wakeup, &wal_lock, &deadline);
+    if (!closing && !writing && !failed && appended_lsn > synced_lsn) {
+      write_records(wal_sync_ms > 0);
+    }
+  }
+  pthread_mutex_unlock(&wal_lock);
+  return NULL;
+}
+
+int wal_open(const char *dir, int sync_ms, const WalRecovery *recovery) {
+  snprintf(wal_dir, sizeof(wal_dir), "%s", dir);
+  wal_sync_ms = sync_ms;
+  if (mkdir(wal_dir, 0755) != 0 && errno != EEXIST) {
+    perror("Failed to create log directory");
+    return 1;
+  }
+
+  uint64_t *checkpoints, *segments;
+  size_t num_checkpoints, num_segments;
+  if (list_files("checkpoint-", ".bck", &checkpoints, &num_checkpoints) != 0) {
+    return 1;
+  }
+  if (list_files("wal-", ".log", &segments, &num_segments) != 0) {
+    free(checkpoints);
+    return 1;
+  }
+
+  // the latest checkpoint that can be read, then every change after it; if
+  // a newer checkpoint is damaged, the segments it replaced are gone and
+  // the changes after the one loaded are found missing
+  uint64_t last = 0;
+  for (size_t i = num_checkpoints; i > 0; i--) {
+    if (load_checkpoint(checkpoints[i - 1], recovery) == 0) {
+      last = checkpoints[i - 1];
+      break;
+    }
+  }
+  for (size_t i = 0; i < num_segments; i++) {
+    if (i + 1 < num_segments && segments[i + 1] <= last + 1) {
+      continue; // every change in it is in the checkpoint
+    }
+    if (replay_segment(segments[i], i + 1 == num_segments, &last, recovery) != 0) {
+      // the log is left untouched, for the changes still in it
+      free(checkpoints);
+      free(segments);
+      return 1;
+    }
+  }
+  free(checkpoints);
+  free(segments);
+
+  appended_lsn = written_lsn = synced_lsn = last;
+  failed = 0;
+  pending = malloc(WAL_BUFFER_SIZE);
+  spare = malloc(WAL_BUFFER_SIZE);
+  if (pending == NULL || spare == NULL || open_segment(last + 1) != 0) {
+    free(pending);
+    free(spare);
+    return 1;
+  }
+
+  closing = 0;
+  if (wal_sync_ms != WAL_SYNC_ALWAYS) {
+    has_flusher = pthread_create(&flusher, NULL, flush_log, NULL) == 0;
+  }
+  return 0;
+}
+
+uint64_t wal_append(uint8_t op, const char *key, const char *value) {
+  unsigned char record[WAL_RECORD_MAX];
+  size_t body_len = backup_encode_record(WAL_RECORD_FORMAT, op, key, value, record + WAL_FRAME_HEADER_SIZE);
+  size_t record_len = WAL_FRAME_HEADER_SIZE + body_len;
+
+  pthread_mutex_lock(&wal_lock);
+  // a full buffer is written by the thread that cannot append to it
+  while (pending_len + record_len > WAL_BUFFER_SIZE) {
+    if (writing) {
+      pthread_cond_wait(&wal_written, &wal_lock);
+    } else {
+      write_records(0);
+    }
+  }
+  uint64_t lsn = ++appended_lsn;
+  encode_le(record, 8 + body_len, 2);
+  encode_le(record + 6, lsn, 8);
+  encode_le(record + 2, crc32_update(0, record + 6, 8 + body_len), 4);
+  memcpy(pending + pending_len, record, record_len);
+  pending_len += record_len;
+  pthread_mutex_unlock(&wal_lock);
+  return lsn;
+}
+
+int wal_commit(uint64_t lsn) {
+  pthread_mutex_lock(&wal_lock);
+  // the first thread to find no write going on writes and syncs the records
+  // of every thread waiting, the others wait for it
+  while (wal_sync_ms == WAL_SYNC_ALWAYS && !failed && synced_lsn < lsn) {
+    if (writing) {
+      pthread_cond_wait(&wal_written, &wal_lock);
+    } else {
+      write_records(1);
+    }
+  }
+  // without syncing every commit, only a failure already seen is reported
+  int result = wal_sync_ms == WAL_SYNC_ALWAYS ? synced_lsn < lsn : failed;
+  pthread_mutex_unlock(&wal_lock);
+  return result;
+}
+
+uint64_t wal_last_lsn() {
+  pthread_mutex_lock(&wal_lock);
+  uint64_t lsn = appended_lsn;
+  pthread_mutex_unlock(&wal_lock);
+  return lsn;
+}
+
+int wal_take_checkpoint() {
+  return atomic_exchange(&checkpoint_due, 0);
+}
+
+void wal_request_checkpoint() {
+  atomic_store(&checkpoint_due, 1);
+}
+
+void wal_checkpoint_done(uint64_t lsn) {
+  char temporary[PATH_MAX], path[PATH_MAX];
+  wal_checkpoint_path(lsn, 1, temporary, sizeof(temporary));
+  wal_checkpoint_path(lsn, 0, path, sizeof(path));
+  if (rename(temporary, path) != 0) {
+    perror("Failed to publish checkpoint");
+    return;
+  }
+  sync_dir();
+
+  uint64_t *lsns;
+  size_t count;
+  if (list_files("checkpoint-", ".bck", &lsns, &count) == 0) {
+    for (size_t i = 0; i < count && lsns[i] < lsn; i++) {
+      wal_checkpoint_path(lsns[i], 0, path, sizeof(path));
+      unlink(path);
+    }
+    free(lsns);
+  }
+  // a segment only holds changes in the checkpoint if the next one starts
+  // after it; the segment being written has no next one
+  if (list_files("wal-", ".log", &lsns, &count) == 0) {
+    for (size_t i = 0; i + 1 < count && lsns[i + 1] <= lsn + 1; i++) {
+      segment_path(lsns[i], path, sizeof(path));
+      unlink(path);
+    }
+    free(lsns);
+  }
+}
+
+void wal_close() {
+  pthread_mutex_lock(&wal_lock);
+  closing = 1;
+  pthread_cond_signal(&wal_wakeup);
+  pthread_mutex_unlock(&wal_lock);
+  if (has_flusher) {
+    pthread_join(flusher, NULL);
+    has_flusher = 0;
+  }
+
+  pthread_mutex_lock(&wal_lock);
+  while (writing) {
+    pthread_cond_wait(&wal_written, &wal_lock);
+  }
+  write_records(1);
+  if (failed) {
+    fprintf(stderr, "The log is missing changes after %llu\n", (unsigned long long) synced_lsn);
+  }
+  pthread_mutex_unlock(&wal_lock);
+
+  if (segment_fd != -1) {
+    close(segment_fd);
+    segment_fd = -1;
+  }
+  free(pending);
+  free(spare);
+  pending = spare = NULL;
+}
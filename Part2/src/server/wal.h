@@ -0,0 +1,96 @@
+#ifndef KVS_WAL_H
+#define KVS_WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Write-ahead log of every change to the table, kept in a directory as
+// segments named wal-<first LSN>.log and checkpoints named
+// checkpoint-<LSN>.bck. A checkpoint is a full binary backup holding every
+// change up to its LSN; segments older than the latest one are removed.
+//
+// record: length of the rest (2 bytes), CRC-32 of LSN and body (4 bytes),
+//         LSN (8 bytes), body encoded like a backup record
+
+// bytes after which a segment is closed and a checkpoint requested
+#define WAL_SEGMENT_SIZE (16 * 1024 * 1024)
+// bytes of records gathered before a writer has to write them itself
+#define WAL_BUFFER_SIZE (256 * 1024)
+// interval between writes of the log when it is not synced
+#define WAL_FLUSH_INTERVAL_MS 100
+// bytes before the body of a record
+#define WAL_FRAME_HEADER_SIZE 14
+
+// fsync policies, besides a positive interval in milliseconds
+#define WAL_SYNC_ALWAYS (-1) // every commit waits for its records to be synced
+#define WAL_SYNC_OFF 0 // records are written, but never synced
+
+// Callbacks receiving the changes recovered from a log directory, in order.
+// Each gets arg as its last argument.
+typedef struct {
+  // The checkpoint about to be loaded holds count pairs, and is mapped at
+  // map for len bytes.
+  void (*begin_checkpoint)(uint32_t count, const void *map, size_t len, void *arg);
+  // A pair of a checkpoint in the current format, mapped from its file; key
+  // and value point into the mapping.
+  void (*load_pair)(const char *key, const char *value, void *arg);
+  // Every pair of the mapped checkpoint was given to load_pair. The callee
+  // owns the mapping, at map for len bytes, and must munmap it.
+  void (*end_checkpoint)(void *map, size_t len, void *arg);
+  // A change logged, or a pair of a checkpoint in an older format.
+  void (*apply)(uint8_t op, const char *key, const char *value, void *arg);
+  void *arg;
+} WalRecovery;
+
+/// @brief Recovers the changes stored in a log directory, creating it if
+/// needed, and opens a new segment for the changes to come
+/// @param dir log directory
+/// @param sync_ms fsync policy: WAL_SYNC_ALWAYS, WAL_SYNC_OFF or an interval
+/// @param recovery callbacks receiving the changes recovered
+/// @return 0 on success, 1 on failure
+int wal_open(const char *dir, int sync_ms, const WalRecovery *recovery);
+
+/// @brief Adds a change to the log. Changes to a key must be appended in the
+/// order they are applied, so callers hold the lock of the key
+/// @param op BACKUP_PUT or BACKUP_DELETE
+/// @param key key changed
+/// @param value value put, ignored for deletes
+/// @return LSN of the change
+uint64_t wal_append(uint8_t op, const char *key, const char *value);
+
+/// @brief Waits, if the policy syncs every commit, until every change up to
+/// an LSN is on disk. Concurrent commits are written and synced together.
+/// Once a write or sync of the log fails, no change after the last one synced
+/// is written anymore, and every commit fails
+/// @param lsn last change to be committed
+/// @return 0 if the changes are on disk (or will be, by the policy), 1 if
+/// the log failed before they were
+int wal_commit(uint64_t lsn);
+
+/// @brief Gets the LSN of the last change appended
+/// @return the LSN, 0 if no change was ever appended
+uint64_t wal_last_lsn();
+
+/// @brief Takes the checkpoint requested when a segment was closed, if any
+/// @return 1 if a checkpoint should be written, 0 otherwise
+int wal_take_checkpoint();
+
+/// @brief Requests a checkpoint again, after one could not be started
+void wal_request_checkpoint();
+
+/// @brief Builds the path of a checkpoint
+/// @param lsn last change the checkpoint holds
+/// @param temporary 1 for the path it is written to before it is complete
+/// @param dest buffer for the path
+/// @param size size of dest
+void wal_checkpoint_path(uint64_t lsn, int temporary, char *dest, size_t size);
+
+/// @brief Publishes a checkpoint written and synced to its temporary path,
+/// and removes the segments and checkpoints it makes useless
+/// @param lsn last change the checkpoint holds
+void wal_checkpoint_done(uint64_t lsn);
+
+/// @brief Writes and syncs every change appended, and closes the log
+void wal_close();
+
+#endif // KVS_WAL_H